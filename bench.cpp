@@ -0,0 +1,424 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <functional>
+#include <cstdlib>
+#include <unistd.h>
+#include "filesystem.h"
+#include "fatimage.h"
+#include "toolsupport.h"
+
+using namespace std;
+
+#define USAGE "Usage: bench [--volume-mb <n>] [--cluster-size <bytes>] [--directories <n>] [--fan-out <n>]\n" \
+              "             [--files-per-dir <n>] [--size-dist fixed|uniform|log] [--min-size <bytes>]\n" \
+              "             [--max-size <bytes>] [--big-dir <entries>] [--depth <n>] [--large-file <bytes>]\n" \
+              "             [--fragmentation <0..1>] [--seed <n>] [--iterations <n>] [--io-size <bytes>]\n" \
+              "             [--threads <n>] [--image <path>] [--filter <name>] [--backend mmap|cached|uring]\n" \
+              "             [--cache-mb <n>] [--journal <path>]"
+
+struct BenchOptions
+{
+    BenchOptions() : iterations(2000), io_size(64 << 10), threads(4), image_path("bench.img") {}
+
+    FAT_FS::ImageOptions image;
+    FAT_FS::MountOptions mount;
+    uint32_t iterations;
+    uint32_t io_size;
+    uint32_t threads;
+    std::string image_path;
+    std::string filter;
+};
+
+struct BenchResult
+{
+    std::string name;
+    std::vector<double> latencies;
+    double elapsed_seconds;
+    uint64_t bytes;
+};
+
+typedef std::chrono::steady_clock Clock;
+typedef std::function<void(FAT_FS::FileSystem&, const FAT_FS::ImageLayout&, BenchResult&)> BenchFunction;
+
+const BenchOptions* g_options = NULL;
+std::mt19937 g_random;
+FAT_FS::NullBuffer g_null_buffer;
+
+bool parseOptions(int argc, char **argv, BenchOptions& options);
+bool runBenchmark(std::string name, BenchFunction function);
+void printHeader();
+void printResult(BenchResult& result);
+double getPercentile(const std::vector<double>& sorted_latencies, double percentile);
+
+// Times one operation and records its latency in microseconds
+template<typename Operation>
+void measure(BenchResult& result, Operation operation)
+{
+    Clock::time_point start = Clock::now();
+    operation();
+    result.latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        cout << USAGE << endl;
+        return EXIT_FAILURE;
+    }
+    g_options = &options;
+
+    const uint32_t iterations = options.iterations;
+    const uint32_t io_size = options.io_size;
+    bool success = true;
+
+    printHeader();
+
+    // Mount cost, including the scan of the FAT into the free cluster bitmap
+    success &= runBenchmark("mount", [=](FAT_FS::FileSystem&, const FAT_FS::ImageLayout&, BenchResult& result) {
+        for (uint32_t i = 0; i < std::min<uint32_t>(iterations, 100); i++)
+            measure(result, [&]() { FAT_FS::FileSystem mounted(g_options->image_path, g_options->mount); });
+    });
+
+    success &= runBenchmark("fsinfo", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout&, BenchResult& result) {
+        for (uint32_t i = 0; i < iterations; i++)
+            measure(result, [&]() { fs.fsinfo(); });
+    });
+
+    // Lookup of random names in one directory with many entries
+    success &= runBenchmark("lookup_big_dir", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.large_directory_files.empty())
+            return;
+
+        std::uniform_int_distribution<size_t> pick(0, layout.large_directory_files.size() - 1);
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            const std::string& path = layout.large_directory_files[pick(g_random)];
+            measure(result, [&]() { fs.size(path); });
+        }
+    });
+
+    // Lookup of every file in the tree once each, so no path is cached beforehand
+    success &= runBenchmark("lookup_cold", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        std::vector<std::string> paths = layout.files;
+        std::shuffle(paths.begin(), paths.end(), g_random);
+
+        for (size_t i = 0; i < paths.size() && i < iterations; i++)
+            measure(result, [&]() { fs.size(paths[i]); });
+    });
+
+    success &= runBenchmark("deep_path_walk", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.deep_directory.empty())
+            return;
+
+        for (uint32_t i = 0; i < iterations; i++)
+            measure(result, [&]() { fs.size(layout.deep_directory); });
+    });
+
+    success &= runBenchmark("ls_big_dir", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.large_directory_files.empty())
+            return;
+
+        for (uint32_t i = 0; i < std::min<uint32_t>(iterations, 200); i++)
+            measure(result, [&]() { fs.ls("/big"); });
+    });
+
+    success &= runBenchmark("seq_read", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.large_file.empty())
+            return;
+
+        fs.open(layout.large_file, FAT_FS::READ);
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            uint32_t offset = ((uint64_t)i * io_size) % g_options->image.large_file_size;
+            measure(result, [&]() { fs.read(layout.large_file, offset, io_size); });
+            result.bytes += std::min(io_size, g_options->image.large_file_size - offset);
+        }
+        fs.close(layout.large_file);
+    });
+
+    success &= runBenchmark("rand_read_4k", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.large_file.empty() || g_options->image.large_file_size < 4096)
+            return;
+
+        std::uniform_int_distribution<uint32_t> pick(0, g_options->image.large_file_size / 4096 - 1);
+        fs.open(layout.large_file, FAT_FS::READ);
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            uint32_t offset = pick(g_random) * 4096;
+            measure(result, [&]() { fs.read(layout.large_file, offset, 4096); });
+            result.bytes += 4096;
+        }
+        fs.close(layout.large_file);
+    });
+
+    // Appends to a new file, allocating clusters as it grows
+    success &= runBenchmark("seq_write", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout&, BenchResult& result) {
+        std::string data(io_size, 'w');
+        fs.create("/seq.dat");
+        fs.open("/seq.dat", FAT_FS::READ_WRITE);
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            bool written = false;
+            measure(result, [&]() { written = fs.write("/seq.dat", i * io_size, data); });
+            if (!written)
+                break;
+            result.bytes += io_size;
+        }
+        fs.close("/seq.dat");
+    });
+
+    success &= runBenchmark("rand_write_4k", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        if (layout.large_file.empty() || g_options->image.large_file_size < 4096)
+            return;
+
+        std::string data(4096, 'r');
+        std::uniform_int_distribution<uint32_t> pick(0, g_options->image.large_file_size / 4096 - 1);
+        fs.open(layout.large_file, FAT_FS::READ_WRITE);
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            uint32_t offset = pick(g_random) * 4096;
+            measure(result, [&]() { fs.write(layout.large_file, offset, data); });
+            result.bytes += 4096;
+        }
+        fs.close(layout.large_file);
+    });
+
+    // Allocation of multi-cluster files on the generated free space, which fragmentation breaks up
+    success &= runBenchmark("alloc_churn", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout&, BenchResult& result) {
+        std::string data(io_size, 'a');
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            std::string path = "/c" + std::to_string(i % 64) + ".dat";
+            measure(result, [&]() {
+                fs.create(path);
+                fs.open(path, FAT_FS::WRITE);
+                fs.write(path, 0, data);
+                fs.close(path);
+            });
+            result.bytes += io_size;
+
+            // Free every other file so later allocations reuse scattered holes
+            if (i % 2 == 1)
+                fs.rm(path);
+        }
+    });
+
+    success &= runBenchmark("create_rm", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout&, BenchResult& result) {
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            std::string path = "/d1/n" + std::to_string(i) + ".tmp";
+            measure(result, [&]() {
+                fs.create(path);
+                fs.rm(path);
+            });
+        }
+    });
+
+    success &= runBenchmark("mkdir_rmdir", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout&, BenchResult& result) {
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            std::string path = "/d1/m" + std::to_string(i);
+            measure(result, [&]() {
+                fs.mkdir(path);
+                fs.rmdir(path);
+            });
+        }
+    });
+
+    // Several clients reading and writing their own files in separate directories at once
+    success &= runBenchmark("concurrent_mixed", [=](FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, BenchResult& result) {
+        uint32_t thread_count = std::max<uint32_t>(1, g_options->threads);
+        std::vector<std::vector<double> > latencies(thread_count);
+        std::vector<std::thread> threads;
+
+        for (uint32_t t = 0; t < thread_count; t++)
+        {
+            threads.push_back(std::thread([&, t]() {
+                BenchResult local;
+                std::string directory = "/t" + std::to_string(t);
+                std::string data(4096, 'c');
+                fs.mkdir(directory);
+
+                for (uint32_t i = 0; i < iterations / thread_count; i++)
+                {
+                    std::string path = directory + "/g" + std::to_string(i % 16);
+                    const std::string& shared_path = layout.files.empty() ? directory : layout.files[(t + i) % layout.files.size()];
+                    measure(local, [&]() {
+                        fs.create(path);
+                        fs.open(path, FAT_FS::READ_WRITE);
+                        fs.write(path, 0, data);
+                        fs.read(path, 0, 4096);
+                        fs.close(path);
+                        fs.size(shared_path);
+                        if (i % 3 == 0)
+                            fs.rm(path);
+                    });
+                }
+
+                latencies[t].swap(local.latencies);
+            }));
+        }
+
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+
+        for (size_t t = 0; t < latencies.size(); t++)
+            result.latencies.insert(result.latencies.end(), latencies[t].begin(), latencies[t].end());
+    });
+
+    unlink(options.image_path.c_str());
+    if (!options.mount.journal_file.empty())
+        unlink(options.mount.journal_file.c_str());
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool parseOptions(int argc, char **argv, BenchOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option(argv[i]);
+        if (i + 1 >= argc)
+            return false;
+
+        std::string value(argv[++i]);
+        try
+        {
+            if (option == "--directories")
+                options.image.directory_count = std::stoul(value);
+            else if (option == "--fan-out")
+                options.image.directory_fan_out = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--files-per-dir")
+                options.image.files_per_directory = std::stoul(value);
+            else if (option == "--size-dist")
+            {
+                if (value == "fixed")
+                    options.image.size_distribution = FAT_FS::SIZE_FIXED;
+                else if (value == "uniform")
+                    options.image.size_distribution = FAT_FS::SIZE_UNIFORM;
+                else if (value == "log")
+                    options.image.size_distribution = FAT_FS::SIZE_LOG_UNIFORM;
+                else
+                    return false;
+            }
+            else if (option == "--min-size")
+                options.image.min_file_size = std::stoul(value);
+            else if (option == "--max-size")
+                options.image.max_file_size = std::stoul(value);
+            else if (option == "--big-dir")
+                options.image.large_directory_entries = std::stoul(value);
+            else if (option == "--depth")
+                options.image.deep_path_depth = std::stoul(value);
+            else if (option == "--large-file")
+                options.image.large_file_size = std::stoul(value);
+            else if (option == "--fragmentation")
+                options.image.fragmentation = std::stod(value);
+            else if (option == "--iterations")
+                options.iterations = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--io-size")
+                options.io_size = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--threads")
+                options.threads = std::stoul(value);
+            else if (option == "--filter")
+                options.filter = value;
+            else if (!FAT_FS::parseImageOption(option, value, options.image, options.mount, options.image_path))
+                return false;
+        }
+        catch (const std::logic_error&)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool runBenchmark(std::string name, BenchFunction function)
+{
+    if (!g_options->filter.empty() && name.find(g_options->filter) == std::string::npos)
+        return true;
+
+    // Every benchmark starts from a freshly generated image and the same random sequence
+    FAT_FS::ImageLayout layout;
+    if (!FAT_FS::generateImage(g_options->image_path, g_options->image, layout))
+    {
+        cout << "Error: cannot generate image for " << name << "." << endl;
+        return false;
+    }
+    g_random.seed(g_options->image.seed);
+
+    // A journal left by an earlier image must not be replayed into this one
+    if (!g_options->mount.journal_file.empty())
+        unlink(g_options->mount.journal_file.c_str());
+
+    BenchResult result;
+    result.name = name;
+    result.bytes = 0;
+
+    {
+        FAT_FS::FileSystem fs(g_options->image_path, g_options->mount);
+        if (fs.hasError())
+        {
+            cout << "Error: cannot mount image for " << name << "." << endl;
+            return false;
+        }
+
+        std::streambuf* console_buffer = cout.rdbuf(&g_null_buffer);
+        Clock::time_point start = Clock::now();
+        function(fs, layout, result);
+        result.elapsed_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        cout.rdbuf(console_buffer);
+    }
+
+    printResult(result);
+    return true;
+}
+
+void printHeader()
+{
+    cout << std::left << std::setw(18) << "benchmark" << std::right
+         << std::setw(9) << "ops" << std::setw(13) << "ops/s" << std::setw(10) << "MB/s"
+         << std::setw(11) << "p50(us)" << std::setw(11) << "p90(us)" << std::setw(11) << "p99(us)"
+         << std::setw(11) << "max(us)" << endl;
+}
+
+void printResult(BenchResult& result)
+{
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    double total_seconds = 0;
+    for (size_t i = 0; i < result.latencies.size(); i++)
+        total_seconds += result.latencies[i] / 1e6;
+
+    // Concurrent runs overlap their latencies, so throughput uses the wall clock time instead
+    double seconds = (result.name.find("concurrent") == 0) ? result.elapsed_seconds : total_seconds;
+    double ops_per_second = (seconds > 0) ? result.latencies.size() / seconds : 0;
+    double MB_per_second = (seconds > 0) ? result.bytes / seconds / (1 << 20) : 0;
+
+    cout << std::left << std::setw(18) << result.name << std::right << std::fixed
+         << std::setw(9) << result.latencies.size()
+         << std::setw(13) << std::setprecision(0) << ops_per_second
+         << std::setw(10) << std::setprecision(1) << MB_per_second
+         << std::setprecision(2)
+         << std::setw(11) << getPercentile(result.latencies, 0.50)
+         << std::setw(11) << getPercentile(result.latencies, 0.90)
+         << std::setw(11) << getPercentile(result.latencies, 0.99)
+         << std::setw(11) << (result.latencies.empty() ? 0 : result.latencies.back()) << endl;
+}
+
+double getPercentile(const std::vector<double>& sorted_latencies, double percentile)
+{
+    if (sorted_latencies.empty())
+        return 0;
+
+    size_t index = percentile * (sorted_latencies.size() - 1) + 0.5;
+    return sorted_latencies[index];
+}
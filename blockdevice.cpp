@@ -0,0 +1,849 @@
+#include <algorithm>
+#include <deque>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "blockdevice.h"
+
+namespace FAT_FS
+{
+    // Bytes moved at a time by fill and copy on devices without a mapping
+    const uint64_t BLOCK_DEVICE_COPY_CHUNK = 1 << 20;
+
+    uint64_t getPageSize()
+    {
+        static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+        return page_size;
+    }
+
+    // pread or pwrite a whole range, stopping early only at an error or the end of the file
+    void transferRange(int file_descriptor, uint8_t* data, uint64_t length, uint64_t offset, bool write)
+    {
+        for (uint64_t done = 0; done < length; )
+        {
+            ssize_t count = write ? pwrite(file_descriptor, data + done, length - done, offset + done)
+                                  : pread(file_descriptor, data + done, length - done, offset + done);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+            done += count;
+        }
+    }
+
+    // A minimal io_uring: one submitter at a time, reads and writes only
+    class IORing
+    {
+        public:
+            IORing(uint32_t depth);
+            ~IORing();
+
+            bool isReady() const { return m_ring_descriptor >= 0; }
+
+            void prepare(uint8_t opcode, int file_descriptor, uint8_t* data, uint32_t length, uint64_t offset,
+                         uint64_t user_data);
+
+            // Submit everything prepared and wait for at least wait_count completions
+            bool enter(uint32_t wait_count);
+            bool popCompletion(uint64_t& user_data, int32_t& result);
+
+            // Take back what was prepared but not submitted, returning how many, and wait for the
+            // next completion of what was, even once enter fails
+            uint32_t discardUnsubmitted();
+            void waitForCompletion();
+        private:
+            int m_ring_descriptor;
+            uint32_t m_unsubmitted;
+
+            uint8_t* m_submission_ring;
+            size_t m_submission_ring_size;
+            uint8_t* m_completion_ring;
+            size_t m_completion_ring_size;
+            io_uring_sqe* m_entries;
+            size_t m_entries_size;
+
+            uint32_t* m_submission_tail;
+            uint32_t m_submission_mask;
+            uint32_t* m_submission_array;
+            uint32_t* m_completion_head;
+            uint32_t* m_completion_tail;
+            uint32_t m_completion_mask;
+            io_uring_cqe* m_completions;
+    };
+}
+
+using namespace FAT_FS;
+
+// *********************************************************
+// *********************************************************
+// *                     BLOCK DEVICE                      *
+// *********************************************************
+// *********************************************************
+
+void BlockDevice::fill(uint64_t offset, uint8_t value, uint64_t length)
+{
+    if (m_mapping)
+    {
+        memset(m_mapping + offset, value, length);
+        markDirty(offset, length);
+        return;
+    }
+
+    std::vector<uint8_t> buffer(std::min(length, BLOCK_DEVICE_COPY_CHUNK), value);
+    for (uint64_t done = 0; done < length; done += buffer.size())
+        writeBlocks(offset + done, buffer.data(), std::min<uint64_t>(buffer.size(), length - done));
+}
+
+void BlockDevice::copy(uint64_t destination, uint64_t source, uint64_t length)
+{
+    if (m_mapping)
+    {
+        memmove(m_mapping + destination, m_mapping + source, length);
+        markDirty(destination, length);
+        return;
+    }
+
+    std::vector<uint8_t> buffer(std::min(length, BLOCK_DEVICE_COPY_CHUNK));
+    for (uint64_t done = 0; done < length; done += buffer.size())
+    {
+        uint64_t chunk = std::min<uint64_t>(buffer.size(), length - done);
+        readBlocks(source + done, buffer.data(), chunk);
+        writeBlocks(destination + done, buffer.data(), chunk);
+    }
+}
+
+const uint8_t* BlockDevice::view(uint64_t offset, uint64_t length, std::vector<uint8_t>& buffer)
+{
+    if (m_mapping)
+        return m_mapping + offset;
+
+    buffer.resize(length);
+    readBlocks(offset, buffer.data(), length);
+    return buffer.data();
+}
+
+void BlockDevice::readBatch(const std::vector<BlockIO>& requests)
+{
+    std::vector<BlockIO>::const_iterator request;
+    for (request = requests.begin(); request != requests.end(); request++)
+        read(request->offset, request->data, request->length);
+}
+
+void BlockDevice::writeBatch(const std::vector<BlockIO>& requests)
+{
+    std::vector<BlockIO>::const_iterator request;
+    for (request = requests.begin(); request != requests.end(); request++)
+        write(request->offset, request->data, request->length);
+}
+
+void BlockDevice::setDirtyLimit(uint64_t limit, std::function<void()> callback)
+{
+    m_dirty_limit = limit;
+    m_dirty_callback = callback;
+}
+
+void BlockDevice::markDirty(uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return;
+
+    // Set the bits after the copy, so a flush that clears them has the new data to write
+    uint64_t page_size = getPageSize();
+    uint64_t first_page = offset / page_size;
+    uint64_t last_page = (offset + length - 1) / page_size;
+
+    for (uint64_t word = first_page / 64; word <= last_page / 64; word++)
+    {
+        uint64_t low = (word == first_page / 64) ? first_page % 64 : 0;
+        uint64_t high = (word == last_page / 64) ? last_page % 64 : 63;
+        uint64_t mask = (~0ULL >> (63 - high)) & (~0ULL << low);
+
+        uint64_t newly_dirty = mask & ~m_dirty_pages[word].fetch_or(mask, std::memory_order_acq_rel);
+        if (newly_dirty != 0)
+            addDirtyBytes(__builtin_popcountll(newly_dirty) * page_size);
+    }
+}
+
+void BlockDevice::addDirtyBytes(uint64_t bytes)
+{
+    uint64_t dirty_bytes = m_dirty_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (m_dirty_limit != 0 && dirty_bytes >= m_dirty_limit && dirty_bytes - bytes < m_dirty_limit)
+        m_dirty_callback();
+}
+
+// *********************************************************
+// *********************************************************
+// *                  MAPPED BLOCK DEVICE                  *
+// *********************************************************
+// *********************************************************
+
+MappedBlockDevice::MappedBlockDevice(int file_descriptor, uint64_t size, bool populate, bool huge_pages)
+{
+    // Fault every page in up front if asked
+    int map_flags = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+    void* mapping = mmap(0, size, PROT_READ | PROT_WRITE, map_flags, file_descriptor, 0);
+    if (mapping == MAP_FAILED)
+        return;
+
+    m_mapping = (uint8_t*)mapping;
+    m_size = size;
+
+    m_dirty_page_words = ((size + getPageSize() - 1) / getPageSize() + 63) / 64;
+    m_dirty_pages.reset(new std::atomic<uint64_t>[m_dirty_page_words]());
+
+    // Huge pages only take effect where the kernel supports them for file mappings
+    if (huge_pages)
+        madvise(m_mapping, m_size, MADV_HUGEPAGE);
+}
+
+MappedBlockDevice::~MappedBlockDevice()
+{
+    if (m_mapping)
+        munmap(m_mapping, m_size);
+}
+
+void MappedBlockDevice::sync(uint64_t offset, uint64_t length)
+{
+    uint64_t start = offset - offset % getPageSize();
+    msync(m_mapping + start, offset + length - start, MS_SYNC);
+}
+
+uint64_t MappedBlockDevice::flush()
+{
+    // msync each run of dirty pages rather than the whole mapping
+    uint64_t page_size = getPageSize();
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    uint64_t flushed_pages = 0;
+
+    for (size_t word = 0; word <= m_dirty_page_words; word++)
+    {
+        uint64_t dirty = 0;
+        if (word < m_dirty_page_words && m_dirty_pages[word].load(std::memory_order_relaxed) != 0)
+            dirty = m_dirty_pages[word].exchange(0, std::memory_order_acq_rel);
+        if (dirty == 0 && run_length == 0)
+            continue;
+
+        for (uint64_t bit = 0; bit < 64; bit++)
+        {
+            if ((dirty >> bit) & 1)
+            {
+                if (run_length++ == 0)
+                    run_start = word * 64 + bit;
+            }
+            else if (run_length != 0)
+            {
+                uint64_t start = run_start * page_size;
+                msync(m_mapping + start, std::min(run_length * page_size, m_size - start), MS_SYNC);
+                flushed_pages += run_length;
+                run_length = 0;
+            }
+        }
+    }
+
+    m_dirty_bytes.fetch_sub(flushed_pages * page_size, std::memory_order_relaxed);
+    return flushed_pages * page_size;
+}
+
+void MappedBlockDevice::advise(uint64_t offset, uint64_t length, int advice)
+{
+    uint64_t start = offset - offset % getPageSize();
+    madvise(m_mapping + start, offset + length - start, advice);
+}
+
+bool MappedBlockDevice::lockInMemory(uint64_t offset, uint64_t length)
+{
+    uint64_t start = offset - offset % getPageSize();
+    return (mlock(m_mapping + start, offset + length - start) == 0);
+}
+
+std::string MappedBlockDevice::describe()
+{
+    return "mmap, " + std::to_string(m_size >> 20) + " MB mapped";
+}
+
+// *********************************************************
+// *********************************************************
+// *                  CACHED BLOCK DEVICE                  *
+// *********************************************************
+// *********************************************************
+
+CachedBlockDevice::CachedBlockDevice(int file_descriptor, uint64_t size, uint32_t block_size, uint64_t cache_size)
+    : m_file_descriptor(file_descriptor), m_block_size(block_size), m_held_count(0), m_hits(0), m_misses(0),
+      m_write_backs(0)
+{
+    m_size = size;
+    m_shard_capacity = std::max<uint64_t>(1, cache_size / block_size / BLOCK_CACHE_SHARD_COUNT);
+
+    m_held_block_words = ((size + block_size - 1) / block_size + 63) / 64;
+    m_held_blocks.reset(new std::atomic<uint64_t>[m_held_block_words]());
+}
+
+CachedBlockDevice::~CachedBlockDevice()
+{
+    flush();
+}
+
+void CachedBlockDevice::readBlocks(uint64_t offset, uint8_t* data, uint64_t length)
+{
+    while (length > 0)
+    {
+        uint64_t block_number = offset / m_block_size;
+        uint64_t block_offset = offset % m_block_size;
+        uint64_t chunk = std::min<uint64_t>(length, m_block_size - block_offset);
+
+        Shard& shard = getShard(block_number);
+        {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            memcpy(data, getBlock(shard, block_number).data.get() + block_offset, chunk);
+        }
+
+        offset += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void CachedBlockDevice::writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length)
+{
+    while (length > 0)
+    {
+        uint64_t block_number = offset / m_block_size;
+        uint64_t block_offset = offset % m_block_size;
+        uint64_t chunk = std::min<uint64_t>(length, m_block_size - block_offset);
+
+        Shard& shard = getShard(block_number);
+        bool newly_dirty;
+        {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            Block& block = getBlock(shard, block_number);
+            memcpy(block.data.get() + block_offset, data, chunk);
+            newly_dirty = !block.dirty;
+            block.dirty = true;
+        }
+
+        if (newly_dirty)
+            addDirtyBytes(m_block_size);
+
+        offset += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void CachedBlockDevice::sync(uint64_t offset, uint64_t length)
+{
+    // Write back the dirty blocks of the range, then wait for the file to reach the disk
+    writeBackRange(offset, length);
+    fdatasync(m_file_descriptor);
+}
+
+uint64_t CachedBlockDevice::flush()
+{
+    // Blocks evicted since the last flush are in the file already but still count until fdatasync
+    uint64_t dirty_bytes = m_dirty_bytes.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < BLOCK_CACHE_SHARD_COUNT; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].lock);
+
+        std::list<Block>::iterator block;
+        for (block = m_shards[i].blocks.begin(); block != m_shards[i].blocks.end(); block++)
+        {
+            if (block->dirty)
+                writeBack(*block);
+            block->held = false;
+        }
+    }
+
+    for (size_t word = 0; word < m_held_block_words && m_held_count.load(std::memory_order_relaxed) != 0; word++)
+    {
+        uint64_t held = m_held_blocks[word].exchange(0, std::memory_order_relaxed);
+        if (held != 0)
+            m_held_count.fetch_sub(__builtin_popcountll(held), std::memory_order_relaxed);
+    }
+
+    if (dirty_bytes != 0)
+        fdatasync(m_file_descriptor);
+
+    m_dirty_bytes.fetch_sub(dirty_bytes, std::memory_order_relaxed);
+    return dirty_bytes;
+}
+
+void CachedBlockDevice::holdRange(uint64_t offset, uint64_t length)
+{
+    for (uint64_t block_number = offset / m_block_size; block_number * m_block_size < offset + length; block_number++)
+    {
+        uint64_t bit = 1ULL << (block_number % 64);
+        if (m_held_blocks[block_number / 64].load(std::memory_order_relaxed) & bit)
+            continue;
+
+        Shard& shard = getShard(block_number);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        getBlock(shard, block_number).held = true;
+
+        if ((m_held_blocks[block_number / 64].fetch_or(bit, std::memory_order_relaxed) & bit) == 0)
+            m_held_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::string CachedBlockDevice::describe()
+{
+    size_t cached_block_count = 0;
+    for (uint32_t i = 0; i < BLOCK_CACHE_SHARD_COUNT; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].lock);
+        cached_block_count += m_shards[i].blocks.size();
+    }
+
+    return "pread/pwrite, " + std::to_string(cached_block_count) + " of " +
+           std::to_string(m_shard_capacity * BLOCK_CACHE_SHARD_COUNT) + " " + std::to_string(m_block_size) +
+           "-byte blocks cached, " + std::to_string(m_hits.load()) + " hits, " + std::to_string(m_misses.load()) +
+           " misses, " + std::to_string(m_write_backs.load()) + " write-backs" +
+           (m_held_count.load() != 0 ? ", " + std::to_string(m_held_count.load()) + " held" : "");
+}
+
+void CachedBlockDevice::writeBackRange(uint64_t offset, uint64_t length)
+{
+    for (uint64_t block_number = offset / m_block_size; block_number * m_block_size < offset + length; block_number++)
+    {
+        Shard& shard = getShard(block_number);
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        std::unordered_map<uint64_t, std::list<Block>::iterator>::iterator cached = shard.index.find(block_number);
+        if (cached != shard.index.end() && cached->second->dirty && !cached->second->held)
+            writeBack(*cached->second);
+    }
+}
+
+void CachedBlockDevice::updateCachedRange(uint64_t offset, const uint8_t* data, uint64_t length)
+{
+    uint64_t end = offset + length;
+    for (uint64_t block_number = offset / m_block_size; block_number * m_block_size < end; block_number++)
+    {
+        Shard& shard = getShard(block_number);
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        std::unordered_map<uint64_t, std::list<Block>::iterator>::iterator cached = shard.index.find(block_number);
+        if (cached == shard.index.end())
+            continue;
+
+        uint64_t start = std::max(offset, block_number * m_block_size);
+        uint64_t stop = std::min(end, (block_number + 1) * m_block_size);
+        memcpy(cached->second->data.get() + (start - block_number * m_block_size), data + (start - offset), stop - start);
+    }
+}
+
+bool CachedBlockDevice::isHeld(uint64_t offset, uint64_t length)
+{
+    if (m_held_count.load(std::memory_order_relaxed) == 0)
+        return false;
+
+    for (uint64_t block_number = offset / m_block_size; block_number * m_block_size < offset + length; block_number++)
+        if (m_held_blocks[block_number / 64].load(std::memory_order_relaxed) & (1ULL << (block_number % 64)))
+            return true;
+
+    return false;
+}
+
+void CachedBlockDevice::readHeldRange(uint64_t offset, uint8_t* data, uint64_t length)
+{
+    if (m_held_count.load(std::memory_order_relaxed) == 0)
+        return;
+
+    uint64_t end = offset + length;
+    uint64_t last_block = (end - 1) / m_block_size;
+    for (uint64_t block_number = offset / m_block_size; block_number <= last_block; block_number++)
+    {
+        // Skip whole words of blocks that are not held
+        uint64_t held = m_held_blocks[block_number / 64].load(std::memory_order_relaxed) >> (block_number % 64);
+        if (held == 0)
+        {
+            block_number |= 63;
+            continue;
+        }
+        if ((held & 1) == 0)
+            continue;
+
+        Shard& shard = getShard(block_number);
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        // A flush may have released the block since its bit was read
+        std::unordered_map<uint64_t, std::list<Block>::iterator>::iterator cached = shard.index.find(block_number);
+        if (cached == shard.index.end() || !cached->second->dirty)
+            continue;
+
+        uint64_t start = std::max(offset, block_number * m_block_size);
+        uint64_t stop = std::min(end, (block_number + 1) * m_block_size);
+        memcpy(data + (start - offset), cached->second->data.get() + (start - block_number * m_block_size), stop - start);
+    }
+}
+
+CachedBlockDevice::Block& CachedBlockDevice::getBlock(Shard& shard, uint64_t block_number)
+{
+    std::unordered_map<uint64_t, std::list<Block>::iterator>::iterator cached = shard.index.find(block_number);
+    if (cached != shard.index.end())
+    {
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        shard.blocks.splice(shard.blocks.begin(), shard.blocks, cached->second);
+        return shard.blocks.front();
+    }
+
+    // Evict the least recently used block, writing it back first if it changed. Held blocks
+    // found at the end go back to the front; with nothing else to evict the shard grows.
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    if (shard.blocks.size() >= m_shard_capacity)
+    {
+        size_t skipped = 0;
+        while (shard.blocks.back().held && ++skipped < shard.blocks.size())
+            shard.blocks.splice(shard.blocks.begin(), shard.blocks, std::prev(shard.blocks.end()));
+
+        Block& victim = shard.blocks.back();
+        if (!victim.held)
+        {
+            if (victim.dirty)
+                writeBack(victim);
+
+            shard.index.erase(victim.number);
+            shard.blocks.pop_back();
+        }
+    }
+
+    Block block;
+    block.number = block_number;
+    block.data.reset(new uint8_t[m_block_size]());
+    block.dirty = false;
+    block.held = false;
+
+    // The last block of the image may be short; the bytes past the end stay zero
+    uint64_t start = block_number * m_block_size;
+    transferRange(m_file_descriptor, block.data.get(), std::min<uint64_t>(m_block_size, m_size - start), start, false);
+
+    shard.blocks.push_front(std::move(block));
+    shard.index[block_number] = shard.blocks.begin();
+    return shard.blocks.front();
+}
+
+void CachedBlockDevice::writeBack(Block& block)
+{
+    uint64_t start = block.number * m_block_size;
+    transferRange(m_file_descriptor, block.data.get(), std::min<uint64_t>(m_block_size, m_size - start), start, true);
+
+    block.dirty = false;
+    m_write_backs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// *********************************************************
+// *********************************************************
+// *                   IO_URING DEVICE                     *
+// *********************************************************
+// *********************************************************
+
+IORing::IORing(uint32_t depth)
+    : m_ring_descriptor(-1), m_unsubmitted(0), m_submission_ring((uint8_t*)MAP_FAILED),
+      m_completion_ring((uint8_t*)MAP_FAILED), m_entries((io_uring_sqe*)MAP_FAILED)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int ring_descriptor = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_descriptor < 0)
+        return;
+
+    // Older kernels map the two rings separately
+    m_submission_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_completion_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        m_submission_ring_size = m_completion_ring_size = std::max(m_submission_ring_size, m_completion_ring_size);
+
+    m_submission_ring = (uint8_t*)mmap(0, m_submission_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring_descriptor, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        m_completion_ring = m_submission_ring;
+    else
+        m_completion_ring = (uint8_t*)mmap(0, m_completion_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring_descriptor, IORING_OFF_CQ_RING);
+
+    m_entries_size = params.sq_entries * sizeof(io_uring_sqe);
+    m_entries = (io_uring_sqe*)mmap(0, m_entries_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring_descriptor, IORING_OFF_SQES);
+
+    if (m_submission_ring == MAP_FAILED || m_completion_ring == MAP_FAILED || m_entries == MAP_FAILED)
+    {
+        ::close(ring_descriptor);
+        return;
+    }
+
+    m_submission_tail = (uint32_t*)(m_submission_ring + params.sq_off.tail);
+    m_submission_mask = *(uint32_t*)(m_submission_ring + params.sq_off.ring_mask);
+    m_submission_array = (uint32_t*)(m_submission_ring + params.sq_off.array);
+    m_completion_head = (uint32_t*)(m_completion_ring + params.cq_off.head);
+    m_completion_tail = (uint32_t*)(m_completion_ring + params.cq_off.tail);
+    m_completion_mask = *(uint32_t*)(m_completion_ring + params.cq_off.ring_mask);
+    m_completions = (io_uring_cqe*)(m_completion_ring + params.cq_off.cqes);
+    m_ring_descriptor = ring_descriptor;
+}
+
+IORing::~IORing()
+{
+    if (m_entries != MAP_FAILED)
+        munmap(m_entries, m_entries_size);
+    if (m_completion_ring != MAP_FAILED && m_completion_ring != m_submission_ring)
+        munmap(m_completion_ring, m_completion_ring_size);
+    if (m_submission_ring != MAP_FAILED)
+        munmap(m_submission_ring, m_submission_ring_size);
+    if (m_ring_descriptor >= 0)
+        ::close(m_ring_descriptor);
+}
+
+void IORing::prepare(uint8_t opcode, int file_descriptor, uint8_t* data, uint32_t length, uint64_t offset,
+                     uint64_t user_data)
+{
+    // Only this thread moves the tail, so it is read plainly and published with a release store
+    uint32_t tail = *m_submission_tail;
+    uint32_t index = tail & m_submission_mask;
+
+    io_uring_sqe& entry = m_entries[index];
+    memset(&entry, 0, sizeof(entry));
+    entry.opcode = opcode;
+    entry.fd = file_descriptor;
+    entry.addr = (uint64_t)data;
+    entry.len = length;
+    entry.off = offset;
+    entry.user_data = user_data;
+
+    m_submission_array[index] = index;
+    __atomic_store_n(m_submission_tail, tail + 1, __ATOMIC_RELEASE);
+    m_unsubmitted++;
+}
+
+bool IORing::enter(uint32_t wait_count)
+{
+    for (;;)
+    {
+        int submitted = syscall(__NR_io_uring_enter, m_ring_descriptor, m_unsubmitted, wait_count,
+                                wait_count ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0)
+        {
+            m_unsubmitted -= submitted;
+            return true;
+        }
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+    }
+}
+
+uint32_t IORing::discardUnsubmitted()
+{
+    // The kernel reads no entry past the head until it is submitted, so the tail can move back
+    uint32_t discarded = m_unsubmitted;
+    __atomic_store_n(m_submission_tail, *m_submission_tail - discarded, __ATOMIC_RELEASE);
+    m_unsubmitted = 0;
+    return discarded;
+}
+
+void IORing::waitForCompletion()
+{
+    // Completions reach the ring without enter too, as the kernel runs its work on our way back
+    // from any system call, so a ring that no longer accepts enter is polled instead
+    if (syscall(__NR_io_uring_enter, m_ring_descriptor, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        usleep(100);
+}
+
+bool IORing::popCompletion(uint64_t& user_data, int32_t& result)
+{
+    uint32_t head = *m_completion_head;
+    if (head == __atomic_load_n(m_completion_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const io_uring_cqe& completion = m_completions[head & m_completion_mask];
+    user_data = completion.user_data;
+    result = completion.res;
+
+    __atomic_store_n(m_completion_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+UringBlockDevice::UringBlockDevice(int file_descriptor, uint64_t size, uint32_t block_size, uint64_t cache_size)
+    : CachedBlockDevice(file_descriptor, size, block_size, cache_size), m_ring(new IORing(URING_QUEUE_DEPTH)),
+      m_batches(0), m_operations(0)
+{
+    // Kernels without io_uring, or with it disabled, get the pread/pwrite fallback
+    if (!m_ring->isReady())
+        m_ring.reset();
+}
+
+UringBlockDevice::~UringBlockDevice()
+{
+}
+
+void UringBlockDevice::readBatch(const std::vector<BlockIO>& requests)
+{
+    std::vector<BlockIO>::const_iterator request;
+    for (request = requests.begin(); request != requests.end(); request++)
+        writeBackRange(request->offset, request->length);
+
+    transfer(requests, false);
+
+    for (request = requests.begin(); request != requests.end(); request++)
+        readHeldRange(request->offset, request->data, request->length);
+}
+
+void UringBlockDevice::writeBatch(const std::vector<BlockIO>& requests)
+{
+    // A block the request only partly covers can be cached by a metadata change next to it
+    // between the cache update and the write, and later written back over the new data, so
+    // the ends of a request go through the cache and only whole blocks go straight to the file
+    std::vector<BlockIO> direct_requests;
+    std::vector<BlockIO>::const_iterator request;
+    uint64_t length = 0;
+    for (request = requests.begin(); request != requests.end(); request++)
+    {
+        uint64_t end = request->offset + request->length;
+        uint64_t head_end = std::min(end, (request->offset + m_block_size - 1) / m_block_size * m_block_size);
+        uint64_t tail_start = std::max(head_end, end / m_block_size * m_block_size);
+
+        if (head_end > request->offset)
+            CachedBlockDevice::writeBlocks(request->offset, request->data, head_end - request->offset);
+        if (end > tail_start)
+            CachedBlockDevice::writeBlocks(tail_start, request->data + (tail_start - request->offset), end - tail_start);
+        if (tail_start == head_end)
+            continue;
+
+        // Cached copies of whole blocks take the new data first, so a later write-back cannot undo the write
+        BlockIO direct_request = { head_end, request->data + (head_end - request->offset), tail_start - head_end };
+        updateCachedRange(direct_request.offset, direct_request.data, direct_request.length);
+        direct_requests.push_back(direct_request);
+        length += direct_request.length;
+    }
+
+    if (!direct_requests.empty())
+        transfer(direct_requests, true);
+    addDirtyBytes(length);
+}
+
+std::string UringBlockDevice::describe()
+{
+    std::string ring;
+    {
+        std::lock_guard<std::mutex> lock(m_ring_lock);
+        ring = m_ring ? "io_uring, queue depth " + std::to_string(URING_QUEUE_DEPTH) : "io_uring unavailable, pread/pwrite";
+    }
+
+    return ring + ", " + std::to_string(m_batches.load()) + " batches of " + std::to_string(m_operations.load()) +
+           " operations; block cache " + CachedBlockDevice::describe();
+}
+
+void UringBlockDevice::readBlocks(uint64_t offset, uint8_t* data, uint64_t length)
+{
+    if (length < URING_DIRECT_BYTES)
+    {
+        CachedBlockDevice::readBlocks(offset, data, length);
+        return;
+    }
+
+    BlockIO request = { offset, data, length };
+    readBatch(std::vector<BlockIO>(1, request));
+}
+
+void UringBlockDevice::writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length)
+{
+    if (length < URING_DIRECT_BYTES)
+    {
+        CachedBlockDevice::writeBlocks(offset, data, length);
+        return;
+    }
+
+    BlockIO request = { offset, (uint8_t*)data, length };
+    writeBatch(std::vector<BlockIO>(1, request));
+}
+
+void UringBlockDevice::transfer(const std::vector<BlockIO>& requests, bool write)
+{
+    // Split large requests so that their pieces are in flight together
+    std::vector<BlockIO> pieces;
+    std::vector<BlockIO>::const_iterator request;
+    for (request = requests.begin(); request != requests.end(); request++)
+    {
+        for (uint64_t done = 0; done < request->length; done += URING_IO_BYTES)
+        {
+            BlockIO piece = { request->offset + done, request->data + done,
+                              std::min<uint64_t>(URING_IO_BYTES, request->length - done) };
+            pieces.push_back(piece);
+        }
+    }
+
+    m_batches.fetch_add(1, std::memory_order_relaxed);
+    m_operations.fetch_add(pieces.size(), std::memory_order_relaxed);
+
+    std::vector<uint64_t> completed(pieces.size(), 0);
+    {
+        // A ring the kernel stops accepting is torn down once nothing is left in flight on it
+        std::lock_guard<std::mutex> lock(m_ring_lock);
+        if (m_ring && !runRing(pieces, completed, write))
+            m_ring.reset();
+    }
+
+    // Whatever the ring did not move, or all of it without a ring, is moved synchronously
+    for (size_t i = 0; i < pieces.size(); i++)
+        if (completed[i] < pieces[i].length)
+            transferRange(m_file_descriptor, pieces[i].data + completed[i], pieces[i].length - completed[i],
+                          pieces[i].offset + completed[i], write);
+}
+
+bool UringBlockDevice::runRing(const std::vector<BlockIO>& pieces, std::vector<uint64_t>& completed, bool write)
+{
+    std::deque<size_t> pending;
+    for (size_t i = 0; i < pieces.size(); i++)
+        pending.push_back(i);
+
+    uint32_t in_flight = 0;
+    while (!pending.empty() || in_flight > 0)
+    {
+        // Keep the queue full, then wait for whatever finishes first
+        for (; !pending.empty() && in_flight < URING_QUEUE_DEPTH; in_flight++)
+        {
+            size_t i = pending.front();
+            pending.pop_front();
+            m_ring->prepare(write ? IORING_OP_WRITE : IORING_OP_READ, m_file_descriptor, pieces[i].data + completed[i],
+                            pieces[i].length - completed[i], pieces[i].offset + completed[i], i);
+        }
+
+        uint64_t i;
+        int32_t result;
+        if (!m_ring->enter(1))
+        {
+            // Closing the ring does not wait for what it has in flight, and a late read would land in
+            // a buffer the caller has moved on from while a late write could overwrite the redo, so
+            // every submitted piece is collected first. Reads and writes of a file always complete.
+            for (in_flight -= m_ring->discardUnsubmitted(); in_flight > 0; )
+            {
+                if (!m_ring->popCompletion(i, result))
+                {
+                    m_ring->waitForCompletion();
+                    continue;
+                }
+
+                in_flight--;
+                if (result > 0)
+                    completed[i] += result;
+            }
+            return false;
+        }
+
+        while (m_ring->popCompletion(i, result))
+        {
+            in_flight--;
+
+            // Short transfers continue where they stopped; errors and the end of the file are left to the caller
+            if (result == -EINTR || result == -EAGAIN)
+                pending.push_back(i);
+            else if (result > 0 && (completed[i] += result) < pieces[i].length)
+                pending.push_back(i);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,244 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+namespace FAT_FS
+{
+    enum BlockDeviceType
+    {
+        BLOCK_DEVICE_MMAP,
+        BLOCK_DEVICE_CACHED,
+        BLOCK_DEVICE_URING
+    };
+
+    // Blocks of a cached device are spread over this many independently locked shards
+    const uint32_t BLOCK_CACHE_SHARD_COUNT = 16;
+
+    // Reads and writes an io_uring device keeps in flight, and the most bytes one of them moves
+    const uint32_t URING_QUEUE_DEPTH = 64;
+    const uint64_t URING_IO_BYTES = 256 << 10;
+
+    // Single accesses this large skip the block cache of an io_uring device
+    const uint64_t URING_DIRECT_BYTES = 64 << 10;
+
+    // One range of a batched read or write
+    struct BlockIO
+    {
+        uint64_t offset;
+        uint8_t* data;
+        uint64_t length;
+    };
+
+    // Defined in blockdevice.cpp
+    class IORing;
+
+    // Byte-addressed access to the image. A mapped device exposes the whole
+    // image as memory and copies straight from it; other devices copy
+    // through blocks of their own.
+    class BlockDevice
+    {
+        public:
+            virtual ~BlockDevice() {}
+
+            uint64_t getSize() const { return m_size; }
+            bool isMapped() const { return m_mapping != NULL; }
+
+            void read(uint64_t offset, void* data, uint64_t length)
+            {
+                if (m_mapping)
+                    memcpy(data, m_mapping + offset, length);
+                else
+                    readBlocks(offset, (uint8_t*)data, length);
+            }
+
+            void write(uint64_t offset, const void* data, uint64_t length)
+            {
+                if (m_mapping)
+                {
+                    memcpy(m_mapping + offset, data, length);
+                    markDirty(offset, length);
+                }
+                else
+                    writeBlocks(offset, (const uint8_t*)data, length);
+            }
+
+            void fill(uint64_t offset, uint8_t value, uint64_t length);
+            void copy(uint64_t destination, uint64_t source, uint64_t length);
+
+            // Bytes at offset, pointing into the mapping when there is one and into buffer otherwise
+            const uint8_t* view(uint64_t offset, uint64_t length, std::vector<uint8_t>& buffer);
+
+            // The structure at offset, laid over the mapping when there is one and read into copy otherwise
+            template <typename T>
+            const T* overlay(uint64_t offset, T& copy)
+            {
+                if (m_mapping)
+                    return reinterpret_cast<const T*>(m_mapping + offset);
+
+                readBlocks(offset, reinterpret_cast<uint8_t*>(&copy), sizeof(T));
+                return &copy;
+            }
+
+            // Move several ranges at once, overlapping them on devices that can
+            virtual void readBatch(const std::vector<BlockIO>& requests);
+            virtual void writeBatch(const std::vector<BlockIO>& requests);
+
+            // Make a range durable on disk, or everything written since the last flush,
+            // which returns how many bytes were waiting
+            virtual void sync(uint64_t offset, uint64_t length) = 0;
+            virtual uint64_t flush() = 0;
+
+            // Bytes written since the last flush, and a callback made when they first reach limit
+            uint64_t getDirtyBytes() const { return m_dirty_bytes.load(std::memory_order_relaxed); }
+            void setDirtyLimit(uint64_t limit, std::function<void()> callback);
+
+            // Access hints and pinning, ignored by devices they do not apply to
+            virtual void advise(uint64_t offset, uint64_t length, int advice) {}
+            virtual bool lockInMemory(uint64_t offset, uint64_t length) { return false; }
+
+            // Keep the blocks of a range from being written back before the next flush, so that
+            // a journal can reach the disk ahead of them; only devices that canHold do this
+            virtual bool canHold() const { return false; }
+            virtual void holdRange(uint64_t offset, uint64_t length) {}
+            virtual bool isHeld(uint64_t offset, uint64_t length) { return false; }
+
+            virtual std::string describe() = 0;
+        protected:
+            BlockDevice() : m_mapping(NULL), m_size(0), m_dirty_page_words(0), m_dirty_bytes(0), m_dirty_limit(0) {}
+
+            virtual void readBlocks(uint64_t offset, uint8_t* data, uint64_t length) = 0;
+            virtual void writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length) = 0;
+
+            void markDirty(uint64_t offset, uint64_t length);
+            void addDirtyBytes(uint64_t bytes);
+
+            uint8_t* m_mapping;
+            uint64_t m_size;
+
+            // One bit per page of the mapping written since it was last flushed
+            std::unique_ptr<std::atomic<uint64_t>[]> m_dirty_pages;
+            size_t m_dirty_page_words;
+
+            std::atomic<uint64_t> m_dirty_bytes;
+            uint64_t m_dirty_limit;
+            std::function<void()> m_dirty_callback;
+        private:
+            BlockDevice(const BlockDevice&);
+            BlockDevice& operator=(const BlockDevice&);
+    };
+
+    // The whole image mapped shared, as fmod always used it
+    class MappedBlockDevice : public BlockDevice
+    {
+        public:
+            MappedBlockDevice(int file_descriptor, uint64_t size, bool populate, bool huge_pages);
+            ~MappedBlockDevice();
+
+            void sync(uint64_t offset, uint64_t length);
+            uint64_t flush();
+            void advise(uint64_t offset, uint64_t length, int advice);
+            bool lockInMemory(uint64_t offset, uint64_t length);
+            std::string describe();
+        protected:
+            void readBlocks(uint64_t offset, uint8_t* data, uint64_t length) {}
+            void writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length) {}
+    };
+
+    // pread/pwrite through an LRU cache of fixed-size blocks. Dirty blocks are
+    // written back when evicted, on sync and flush, and when the device closes;
+    // only sync and flush wait for the disk. Held blocks stay cached and are
+    // written back by flush alone.
+    class CachedBlockDevice : public BlockDevice
+    {
+        public:
+            CachedBlockDevice(int file_descriptor, uint64_t size, uint32_t block_size, uint64_t cache_size);
+            ~CachedBlockDevice();
+
+            void sync(uint64_t offset, uint64_t length);
+            uint64_t flush();
+            bool canHold() const { return true; }
+            void holdRange(uint64_t offset, uint64_t length);
+            bool isHeld(uint64_t offset, uint64_t length);
+            std::string describe();
+        protected:
+            void readBlocks(uint64_t offset, uint8_t* data, uint64_t length);
+            void writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length);
+
+            // Keep the cache coherent with reads and writes that bypass it: write back the
+            // dirty blocks of a range before it is read, and copy new data into cached blocks.
+            // Held blocks cannot be written back, so reads copy them over what the file had.
+            void writeBackRange(uint64_t offset, uint64_t length);
+            void updateCachedRange(uint64_t offset, const uint8_t* data, uint64_t length);
+            void readHeldRange(uint64_t offset, uint8_t* data, uint64_t length);
+
+            int m_file_descriptor;
+            uint32_t m_block_size;
+        private:
+            struct Block
+            {
+                uint64_t number;
+                std::unique_ptr<uint8_t[]> data;
+                bool dirty;
+                bool held;
+            };
+
+            struct Shard
+            {
+                std::mutex lock;
+                std::list<Block> blocks;
+                std::unordered_map<uint64_t, std::list<Block>::iterator> index;
+            };
+
+            Shard& getShard(uint64_t block_number) { return m_shards[block_number % BLOCK_CACHE_SHARD_COUNT]; }
+            Block& getBlock(Shard& shard, uint64_t block_number);
+            void writeBack(Block& block);
+
+            size_t m_shard_capacity;
+            Shard m_shards[BLOCK_CACHE_SHARD_COUNT];
+
+            // One bit per held block, so holding a block again costs no lock; held blocks are never evicted
+            std::unique_ptr<std::atomic<uint64_t>[]> m_held_blocks;
+            size_t m_held_block_words;
+            std::atomic<uint64_t> m_held_count;
+
+            std::atomic<uint64_t> m_hits;
+            std::atomic<uint64_t> m_misses;
+            std::atomic<uint64_t> m_write_backs;
+    };
+
+    // A cached device whose batches and large accesses go straight to the file
+    // through io_uring, up to URING_QUEUE_DEPTH at a time. Without io_uring the
+    // same requests are made one by one with pread and pwrite.
+    class UringBlockDevice : public CachedBlockDevice
+    {
+        public:
+            UringBlockDevice(int file_descriptor, uint64_t size, uint32_t block_size, uint64_t cache_size);
+            ~UringBlockDevice();
+
+            void readBatch(const std::vector<BlockIO>& requests);
+            void writeBatch(const std::vector<BlockIO>& requests);
+            std::string describe();
+        protected:
+            void readBlocks(uint64_t offset, uint8_t* data, uint64_t length);
+            void writeBlocks(uint64_t offset, const uint8_t* data, uint64_t length);
+        private:
+            void transfer(const std::vector<BlockIO>& requests, bool write);
+            bool runRing(const std::vector<BlockIO>& pieces, std::vector<uint64_t>& completed, bool write);
+
+            std::unique_ptr<IORing> m_ring;
+            std::mutex m_ring_lock;
+            std::atomic<uint64_t> m_batches;
+            std::atomic<uint64_t> m_operations;
+    };
+}
+
+#endif
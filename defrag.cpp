@@ -0,0 +1,463 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <iomanip>
+#include <algorithm>
+
+using namespace FAT_FS;
+
+namespace FAT_FS
+{
+    // Clusters of the FAT each fraginfo task scans for free runs
+    const uint32_t FRAGINFO_CHUNK_SIZE = 1 << 20;
+
+    // Free runs are counted in power-of-two length buckets, the last bucket holding 2^31 and up
+    const uint32_t FREE_RUN_BUCKET_COUNT = 32;
+
+    struct FileFragmentation
+    {
+        std::string path;
+        uint32_t cluster_count;
+        uint32_t extent_count;
+    };
+
+    // Free runs of part of the FAT. A run touching either end of the part is kept
+    // apart in leading_run or trailing_run, as it may go on in the next part.
+    struct FreeRunChunk
+    {
+        FreeRunChunk() : all_free(false), leading_run(0), trailing_run(0), largest_run(0)
+        {
+            std::fill(run_counts, run_counts + FREE_RUN_BUCKET_COUNT, 0);
+            std::fill(run_clusters, run_clusters + FREE_RUN_BUCKET_COUNT, 0);
+        }
+
+        void addRun(uint64_t length)
+        {
+            if (length == 0)
+                return;
+
+            uint32_t bucket = 0;
+            while (bucket + 1 < FREE_RUN_BUCKET_COUNT && (length >> (bucket + 1)) != 0)
+                bucket++;
+
+            run_counts[bucket]++;
+            run_clusters[bucket] += length;
+            largest_run = std::max(largest_run, length);
+        }
+
+        bool all_free;
+        uint64_t leading_run;
+        uint64_t trailing_run;
+        uint64_t largest_run;
+        uint64_t run_counts[FREE_RUN_BUCKET_COUNT];
+        uint64_t run_clusters[FREE_RUN_BUCKET_COUNT];
+    };
+
+    uint32_t getFragInfoFATEntry(const uint8_t* FAT, uint32_t cluster)
+    {
+        return reinterpret_cast<const LittleEndian<uint32_t>*>(FAT)[cluster] & FAT_MASK;
+    }
+
+    // Count a chain's clusters and contiguous extents straight from the FAT. The
+    // walk takes no locks, so a chain changing underneath it is bounded by the
+    // cluster count rather than trusted to end.
+    void measureChain(const uint8_t* FAT, uint32_t total_cluster_count, uint32_t cluster,
+                      uint32_t& cluster_count, uint32_t& extent_count)
+    {
+        cluster_count = 0;
+        extent_count = 0;
+
+        uint32_t previous = 0;
+        while (cluster >= 2 && cluster < total_cluster_count && cluster_count < total_cluster_count)
+        {
+            if (cluster != previous + 1)
+                extent_count++;
+            cluster_count++;
+
+            previous = cluster;
+            cluster = getFragInfoFATEntry(FAT, cluster);
+        }
+    }
+
+    void scanFreeRuns(const uint8_t* FAT, uint32_t first_cluster, uint32_t last_cluster, FreeRunChunk& chunk)
+    {
+        uint64_t run = 0;
+        bool leading = true;
+        for (uint32_t cluster = first_cluster; cluster < last_cluster; cluster++)
+        {
+            if (getFragInfoFATEntry(FAT, cluster) == FREE_CLUSTER)
+            {
+                run++;
+                continue;
+            }
+
+            if (leading)
+                chunk.leading_run = run;
+            else
+                chunk.addRun(run);
+
+            leading = false;
+            run = 0;
+        }
+
+        chunk.all_free = leading;
+        if (leading)
+            chunk.leading_run = run;
+        else
+            chunk.trailing_run = run;
+    }
+}
+
+// *********************************************************
+// *********************************************************
+// *                    DEFRAGMENTATION                    *
+// *********************************************************
+// *********************************************************
+
+bool FileSystem::defrag(std::string path, uint32_t max_MB_per_second)
+{
+    CommandTimer timer(STAT_DEFRAG);
+    DirectoryEntry entry;
+    if (!resolvePath(path, entry))
+    {
+        cout << "Error: '" << path << "' not found." << endl;
+        return false;
+    }
+
+    // Collect the files first and move them one at a time, so only one file is locked at once
+    std::vector<std::pair<uint32_t, std::string> > files;
+    if (isDirectory(entry))
+    {
+        std::mutex files_lock;
+        TreeWalkVisitor visitor;
+        visitor.visit_directory = [&](const TreeWalkNode& node, const std::list<DirectoryEntry>& entries) {
+            std::lock_guard<std::mutex> lock(files_lock);
+
+            std::list<DirectoryEntry>::const_iterator iterator;
+            for (iterator = entries.begin(); iterator != entries.end(); iterator++)
+                if (isFile(*iterator))
+                    files.push_back(std::make_pair(node.cluster, iterator->name));
+        };
+
+        walkTree(entry, normalizePath(path), visitor);
+    }
+    else
+    {
+        uint32_t parent_cluster;
+        std::string file_name;
+        if (!resolveParentDirectory(path, parent_cluster, file_name))
+        {
+            cout << "Error: '" << path << "' not found." << endl;
+            return false;
+        }
+        files.push_back(std::make_pair(parent_cluster, file_name));
+    }
+
+    uint32_t moved_file_count = 0;
+    uint32_t skipped_file_count = 0;
+    uint64_t moved_cluster_count = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::pair<uint32_t, std::string> >::iterator file;
+    for (file = files.begin(); file != files.end(); file++)
+    {
+        uint32_t moved_clusters = 0;
+        if (!defragFile(file->first, file->second, moved_clusters))
+            skipped_file_count++;
+        else if (moved_clusters > 0)
+        {
+            moved_file_count++;
+            moved_cluster_count += moved_clusters;
+        }
+
+        // Pause between files, with no locks held, to keep the copy rate under the limit
+        if (max_MB_per_second > 0 && moved_clusters > 0)
+        {
+            double target_seconds = (double)moved_cluster_count * m_bytes_per_cluster / ((double)max_MB_per_second * (1 << 20));
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed.count() < target_seconds)
+                std::this_thread::sleep_for(std::chrono::duration<double>(target_seconds - elapsed.count()));
+        }
+    }
+
+    cout << "Defragmented " << moved_file_count << " of " << files.size() << " files, moving "
+         << moved_cluster_count << " clusters";
+    if (skipped_file_count > 0)
+        cout << "; " << skipped_file_count << " files had no free run large enough or changed while moving";
+    cout << "." << endl;
+
+    return true;
+}
+
+// *********************************************************
+// *********************************************************
+// *                DEFRAGMENTATION HELPERS                *
+// *********************************************************
+// *********************************************************
+
+bool FileSystem::defragFile(uint32_t parent_cluster, std::string file_name, uint32_t& moved_clusters)
+{
+    TraceSpan span("defrag_file");
+    JournalTransaction transaction(m_journal.get());
+    moved_clusters = 0;
+
+    // Keep the entry from being removed or looked up while its first cluster changes
+    WriteLock lock(getDirectoryLock(parent_cluster));
+
+    DirectoryEntry file;
+    if (!isLiveDirectory(parent_cluster) || !findDirectoryEntry(file_name, parent_cluster, file) || !isFile(file))
+        return true;
+
+    // An open file is moved under its own lock, so no read or write sees the chain change
+    std::shared_ptr<OpenFile> open_file;
+    {
+        std::lock_guard<std::mutex> table_lock(m_open_file_table_lock);
+        std::map<DirectoryEntry, std::shared_ptr<OpenFile> >::iterator iterator = m_open_file_table.find(file);
+        if (iterator != m_open_file_table.end())
+            open_file = iterator->second;
+    }
+
+    std::unique_ptr<WriteLock> file_lock(open_file ? new WriteLock(open_file->lock) : NULL);
+    if (open_file)
+        file = open_file->file;
+
+    if (file.cluster == 0)
+        return true;
+
+    std::vector<ClusterExtent> extents = getClusterExtents(file.cluster);
+    if (extents.size() <= 1)
+        return true;
+
+    uint32_t cluster_count = getChainLength(extents);
+
+    // Reserve a single free run and link it as a chain of its own; a crash now only leaves a lost chain
+    std::vector<uint32_t> clusters;
+    {
+        std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+
+        std::vector<FreeRun> runs;
+        if (!findFreeRuns(cluster_count, runs) || runs.size() != 1)
+            return false;
+
+        // With a run that fits, the reservation takes exactly that run
+        clusters = reserveClusters(cluster_count);
+        if (clusters.empty())
+            return false;
+
+        linkClusters(0, clusters);
+        writeFSInfo();
+    }
+
+    // Copy the data, then make the copy and the new chain durable before switching to them
+    uint64_t new_offset = (uint64_t)getFirstDataSector(clusters.front()) * m_bpb.bytes_per_sector;
+    uint64_t copy_length = (uint64_t)cluster_count * m_bytes_per_cluster;
+    {
+        TraceSpan copy_span("data_copy");
+
+        uint64_t copied_length = 0;
+        std::vector<DataSpan> spans = getDataSpans(file.cluster, 0, copy_length);
+        std::vector<DataSpan>::iterator iterator;
+        for (iterator = spans.begin(); iterator != spans.end(); iterator++)
+        {
+            m_device->copy(new_offset + copied_length, iterator->offset, iterator->length);
+            copied_length += iterator->length;
+        }
+    }
+
+    m_device->sync(new_offset, copy_length);
+    uint8_t FAT_count = getUpdatedFATCount();
+    for (uint8_t i = 0; i < FAT_count; i++)
+    {
+        uint64_t FAT_offset = ((uint64_t)m_bpb.reserved_sector_count + (uint64_t)i * m_bpb.FATSz) * m_bpb.bytes_per_sector;
+        m_device->sync(FAT_offset + (uint64_t)clusters.front() * 4, (uint64_t)cluster_count * 4);
+    }
+
+    // Switch the entry under the table lock, so a file opened meanwhile is never left on the old chain
+    {
+        std::lock_guard<std::mutex> table_lock(m_open_file_table_lock);
+        if (!open_file && m_open_file_table.find(file) != m_open_file_table.end())
+        {
+            std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+            for (uint32_t i = 0; i < cluster_count; i++)
+                setFATEntry(clusters[i], FREE_CLUSTER);
+            writeFSInfo();
+            return false;
+        }
+
+        updateFile(open_file ? open_file->file : file, file.size, clusters.front());
+        m_device->sync(file.mem_location, DIR_ENTRY_SIZE);
+    }
+
+    // Release the old chain last; a crash before this point only leaves it lost
+    {
+        std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+
+        std::vector<ClusterExtent>::iterator iterator;
+        for (iterator = extents.begin(); iterator != extents.end(); iterator++)
+            for (uint32_t i = 0; i < iterator->length; i++)
+                setFATEntry(iterator->start_cluster + i, FREE_CLUSTER);
+
+        writeFSInfo();
+        Statistics::count(STAT_CLUSTERS_FREED, cluster_count);
+    }
+
+    moved_clusters = cluster_count;
+    return true;
+}
+
+// *********************************************************
+// *********************************************************
+// *                 FRAGMENTATION REPORT                  *
+// *********************************************************
+// *********************************************************
+
+bool FileSystem::fraginfo(uint32_t worst_file_count)
+{
+    CommandTimer timer(STAT_FRAGINFO);
+    uint64_t FAT_offset = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector;
+    std::vector<uint8_t> FAT_buffer;
+    const uint8_t* FAT;
+    {
+        // Devices without a mapping copy the FAT once, under the allocator so the copy is a single state of it
+        std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+        FAT = m_device->view(FAT_offset, (uint64_t)m_total_cluster_count * 4, FAT_buffer);
+    }
+
+    // Measure every file's chain while the tree walk reads the directories; files
+    // written meanwhile may be counted before or after the change
+    std::mutex files_lock;
+    std::vector<FileFragmentation> files;
+    TreeWalkVisitor visitor;
+    visitor.visit_directory = [&](const TreeWalkNode& node, const std::list<DirectoryEntry>& entries) {
+        std::vector<FileFragmentation> directory_files;
+
+        std::list<DirectoryEntry>::const_iterator iterator;
+        for (iterator = entries.begin(); iterator != entries.end(); iterator++)
+        {
+            if (!isFile(*iterator) || iterator->cluster == 0)
+                continue;
+
+            FileFragmentation file = { joinTreePath(node.path, iterator->name), 0, 0 };
+            measureChain(FAT, m_total_cluster_count, iterator->cluster, file.cluster_count, file.extent_count);
+            directory_files.push_back(file);
+        }
+
+        std::lock_guard<std::mutex> lock(files_lock);
+        files.insert(files.end(), directory_files.begin(), directory_files.end());
+    };
+
+    walkTree(getRootDirectoryEntry(), ROOT, visitor);
+
+    // Count free runs in chunks of the FAT in parallel, joining runs that cross chunk boundaries afterwards
+    WorkStealingPool<uint32_t> pool;
+    uint32_t chunk_count = (m_total_cluster_count + FRAGINFO_CHUNK_SIZE - 1) / FRAGINFO_CHUNK_SIZE;
+    std::vector<FreeRunChunk> chunks(chunk_count);
+    for (uint32_t i = 0; i < chunk_count; i++)
+        pool.push(0, i);
+
+    {
+        // A mapped FAT is live, so hold off allocation for the scan only and the free total matches a single state of it
+        TraceSpan span("free_run_scan");
+        std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+
+        pool.run([&](uint32_t, uint32_t& chunk) {
+            uint32_t first_cluster = std::max<uint32_t>(2, chunk * FRAGINFO_CHUNK_SIZE);
+            uint32_t last_cluster = std::min<uint32_t>(m_total_cluster_count, (chunk + 1) * FRAGINFO_CHUNK_SIZE);
+            scanFreeRuns(FAT, first_cluster, last_cluster, chunks[chunk]);
+        });
+    }
+
+    FreeRunChunk volume;
+    uint64_t open_run = 0;
+    for (uint32_t i = 0; i < chunk_count; i++)
+    {
+        if (chunks[i].all_free)
+        {
+            open_run += chunks[i].leading_run;
+            continue;
+        }
+
+        volume.addRun(open_run + chunks[i].leading_run);
+        for (uint32_t j = 0; j < FREE_RUN_BUCKET_COUNT; j++)
+        {
+            volume.run_counts[j] += chunks[i].run_counts[j];
+            volume.run_clusters[j] += chunks[i].run_clusters[j];
+        }
+        volume.largest_run = std::max(volume.largest_run, chunks[i].largest_run);
+        open_run = chunks[i].trailing_run;
+    }
+    volume.addRun(open_run);
+
+    uint64_t cluster_count = 0;
+    uint64_t extent_count = 0;
+    uint64_t fragmented_count = 0;
+    std::vector<FileFragmentation>::iterator file;
+    for (file = files.begin(); file != files.end(); file++)
+    {
+        cluster_count += file->cluster_count;
+        extent_count += file->extent_count;
+        if (file->extent_count > 1)
+            fragmented_count++;
+    }
+
+    std::ios_base::fmtflags flags = cout.flags();
+    std::streamsize precision = cout.precision();
+    cout << std::fixed << std::setprecision(2);
+
+    cout << "Files: " << files.size() << ", " << fragmented_count << " fragmented" << endl;
+    cout << "File clusters: " << cluster_count << " in " << extent_count << " extents, average extent "
+         << (extent_count ? (double)cluster_count / extent_count : 0.0) << " clusters" << endl;
+
+    uint64_t free_run_count = 0;
+    uint64_t free_cluster_count = 0;
+    for (uint32_t i = 0; i < FREE_RUN_BUCKET_COUNT; i++)
+    {
+        free_run_count += volume.run_counts[i];
+        free_cluster_count += volume.run_clusters[i];
+    }
+
+    cout << "Free clusters: " << free_cluster_count << " in " << free_run_count << " runs, largest run "
+         << volume.largest_run << " clusters" << endl;
+
+    cout << std::left << std::setw(24) << "free run length" << std::right << std::setw(12) << "runs"
+         << std::setw(14) << "clusters" << endl;
+    for (uint32_t i = 0; i < FREE_RUN_BUCKET_COUNT; i++)
+    {
+        if (volume.run_counts[i] == 0)
+            continue;
+
+        uint64_t low = 1ULL << i;
+        uint64_t high = (1ULL << (i + 1)) - 1;
+        std::string range = (low == high) ? std::to_string(low) : std::to_string(low) + "-" + std::to_string(high);
+        cout << std::left << std::setw(24) << range << std::right << std::setw(12) << volume.run_counts[i]
+             << std::setw(14) << volume.run_clusters[i] << endl;
+    }
+
+    // The most extents first, and of those the shortest extents first
+    size_t worst_count = std::min<size_t>(worst_file_count, files.size());
+    std::partial_sort(files.begin(), files.begin() + worst_count, files.end(),
+                      [](const FileFragmentation& left, const FileFragmentation& right) {
+        if (left.extent_count != right.extent_count)
+            return left.extent_count > right.extent_count;
+        return left.cluster_count < right.cluster_count;
+    });
+
+    if (worst_count > 0 && files[0].extent_count > 1)
+    {
+        cout << "Most fragmented files:" << endl;
+        cout << std::setw(10) << "extents" << std::setw(12) << "clusters" << std::setw(14) << "avg extent" << "  path" << endl;
+        for (size_t i = 0; i < worst_count && files[i].extent_count > 1; i++)
+            cout << std::setw(10) << files[i].extent_count << std::setw(12) << files[i].cluster_count
+                 << std::setw(14) << (double)files[i].cluster_count / files[i].extent_count << "  " << files[i].path << endl;
+    }
+
+    cout.flags(flags);
+    cout.precision(precision);
+    return true;
+}
@@ -0,0 +1,193 @@
+#include <cctype>
+#include <cstring>
+#include "filesystem.h"
+#include "dirscan.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace FAT_FS
+{
+    const uint32_t SHORT_NAME_LENGTH = 11;
+    const uint32_t ATTRIBUTE_OFFSET = 11;
+    const uint32_t SHORT_NAME_BITS = (1 << SHORT_NAME_LENGTH) - 1;
+
+    namespace
+    {
+        void resizeMasks(std::vector<uint64_t>& mask, uint32_t slot_count)
+        {
+            mask.assign((slot_count + 63) / 64, 0);
+        }
+
+        void setSlot(std::vector<uint64_t>& mask, uint32_t slot, bool value)
+        {
+            mask[slot / 64] |= (uint64_t)value << (slot % 64);
+        }
+
+#if defined(__SSE2__)
+        // The first 16 bytes of a slot hold the name and the attribute byte,
+        // so one load and a few byte compares classify a slot
+        inline uint32_t foldCase(__m128i head, __m128i short_name)
+        {
+            __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(head, _mm_set1_epi8('a' - 1)),
+                                          _mm_cmplt_epi8(head, _mm_set1_epi8('z' + 1)));
+            __m128i folded = _mm_sub_epi8(head, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(folded, short_name));
+        }
+
+        void scanSlotsSSE2(const uint8_t* slots, uint32_t slot_count, DirectorySlotMasks& masks)
+        {
+            const __m128i free_marker = _mm_set1_epi8((char)FREE_DIR_ENTRY);
+            const __m128i last_free_marker = _mm_set1_epi8((char)LAST_FREE_DIR_ENTRY);
+            const __m128i long_name = _mm_set1_epi8(ATTR_LONG);
+
+            for (uint32_t i = 0; i < slot_count; i++)
+            {
+                __m128i head = _mm_loadu_si128((const __m128i*)(slots + (uint64_t)i * DIR_ENTRY_SIZE));
+
+                uint32_t free_bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(head, free_marker),
+                                                                    _mm_cmpeq_epi8(head, last_free_marker)));
+                uint32_t long_name_bit = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(head, long_name), long_name));
+
+                setSlot(masks.free, i, free_bits & 1);
+                setSlot(masks.long_name, i, (long_name_bit >> ATTRIBUTE_OFFSET) & 1);
+            }
+        }
+
+        void matchSlotsSSE2(const uint8_t* slots, uint32_t first_slot, uint32_t slot_count, const uint8_t* short_name,
+                            std::vector<uint64_t>& matches)
+        {
+            uint8_t padded_name[16] = { 0 };
+            memcpy(padded_name, short_name, SHORT_NAME_LENGTH);
+            __m128i name = _mm_loadu_si128((const __m128i*)padded_name);
+
+            for (uint32_t i = first_slot; i < slot_count; i++)
+            {
+                __m128i head = _mm_loadu_si128((const __m128i*)(slots + (uint64_t)i * DIR_ENTRY_SIZE));
+                setSlot(matches, i, (foldCase(head, name) & SHORT_NAME_BITS) == SHORT_NAME_BITS);
+            }
+        }
+
+        // With AVX2 two slot heads share a register, halving the compares per slot
+        __attribute__((target("avx2")))
+        uint32_t matchSlotsAVX2(const uint8_t* slots, uint32_t slot_count, const uint8_t* short_name,
+                                std::vector<uint64_t>& matches)
+        {
+            uint8_t padded_name[16] = { 0 };
+            memcpy(padded_name, short_name, SHORT_NAME_LENGTH);
+            __m128i half_name = _mm_loadu_si128((const __m128i*)padded_name);
+            __m256i name = _mm256_inserti128_si256(_mm256_castsi128_si256(half_name), half_name, 1);
+
+            const __m256i before_a = _mm256_set1_epi8('a' - 1);
+            const __m256i after_z = _mm256_set1_epi8('z' + 1);
+            const __m256i case_bit = _mm256_set1_epi8(0x20);
+
+            uint32_t i = 0;
+            for (; i + 2 <= slot_count; i += 2)
+            {
+                const uint8_t* slot = slots + (uint64_t)i * DIR_ENTRY_SIZE;
+                __m256i heads = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)slot)),
+                                                        _mm_loadu_si128((const __m128i*)(slot + DIR_ENTRY_SIZE)), 1);
+
+                __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(heads, before_a), _mm256_cmpgt_epi8(after_z, heads));
+                __m256i folded = _mm256_sub_epi8(heads, _mm256_and_si256(lower, case_bit));
+                uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, name));
+
+                setSlot(matches, i, (equal & SHORT_NAME_BITS) == SHORT_NAME_BITS);
+                setSlot(matches, i + 1, ((equal >> 16) & SHORT_NAME_BITS) == SHORT_NAME_BITS);
+            }
+
+            return i;
+        }
+
+        bool hasAVX2()
+        {
+            static const bool has_avx2 = __builtin_cpu_supports("avx2");
+            return has_avx2;
+        }
+#else
+        // Byte-at-a-time versions for targets without SSE2
+        void scanSlotsScalar(const uint8_t* slots, uint32_t slot_count, DirectorySlotMasks& masks)
+        {
+            for (uint32_t i = 0; i < slot_count; i++)
+            {
+                const uint8_t* slot = slots + (uint64_t)i * DIR_ENTRY_SIZE;
+                uint8_t attribute = slot[ATTRIBUTE_OFFSET];
+
+                setSlot(masks.free, i, slot[0] == FREE_DIR_ENTRY || slot[0] == LAST_FREE_DIR_ENTRY);
+                setSlot(masks.long_name, i, (attribute & ATTR_LONG) == ATTR_LONG);
+            }
+        }
+
+        void matchSlotsScalar(const uint8_t* slots, uint32_t slot_count, const uint8_t* short_name,
+                              std::vector<uint64_t>& matches)
+        {
+            for (uint32_t i = 0; i < slot_count; i++)
+            {
+                const uint8_t* slot = slots + (uint64_t)i * DIR_ENTRY_SIZE;
+
+                uint32_t j = 0;
+                while (j < SHORT_NAME_LENGTH && (uint8_t)std::toupper(slot[j]) == short_name[j])
+                    j++;
+                setSlot(matches, i, j == SHORT_NAME_LENGTH);
+            }
+        }
+#endif
+    }
+
+    void scanDirectorySlots(const uint8_t* slots, uint32_t slot_count, DirectorySlotMasks& masks)
+    {
+        resizeMasks(masks.free, slot_count);
+        resizeMasks(masks.long_name, slot_count);
+
+#if defined(__SSE2__)
+        scanSlotsSSE2(slots, slot_count, masks);
+#else
+        scanSlotsScalar(slots, slot_count, masks);
+#endif
+    }
+
+    void matchShortName(const uint8_t* slots, uint32_t slot_count, const std::string& short_name,
+                        std::vector<uint64_t>& matches)
+    {
+        resizeMasks(matches, slot_count);
+        const uint8_t* name = (const uint8_t*)short_name.data();
+
+#if defined(__SSE2__)
+        uint32_t matched_slots = hasAVX2() ? matchSlotsAVX2(slots, slot_count, name, matches) : 0;
+        matchSlotsSSE2(slots, matched_slots, slot_count, name, matches);
+#else
+        matchSlotsScalar(slots, slot_count, name, matches);
+#endif
+    }
+
+    std::string decodeShortName(const uint8_t* slot)
+    {
+        // Drop characters readDirectoryEntry never kept, and put a dot after the space padding
+        std::string name;
+        bool add_dot = false;
+        bool added_dot = false;
+
+        for (uint32_t i = 0; i < SHORT_NAME_LENGTH; i++)
+        {
+            char character = slot[i];
+            if (!std::isspace(character) && !std::ispunct(character) && !std::isalnum(character))
+                continue;
+
+            if (character == SHORT_NAME_SPACE_PAD)
+                add_dot = true;
+            else
+            {
+                if (add_dot && !added_dot)
+                {
+                    name.push_back('.');
+                    added_dot = true;
+                }
+                name.push_back(tolower(character));
+            }
+        }
+
+        return name;
+    }
+}
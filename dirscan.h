@@ -0,0 +1,30 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+#include <string>
+#include <cstdint>
+#include <vector>
+
+namespace FAT_FS
+{
+    // Bit (i % 64) of word (i / 64) describes slot i of the scanned clusters.
+    // Free slots start with 0xE5 or 0x00; this tree also writes 0x00 when
+    // deleting, so a 0x00 slot does not end the directory.
+    struct DirectorySlotMasks
+    {
+        std::vector<uint64_t> free;
+        std::vector<uint64_t> long_name;
+    };
+
+    // Classify slot_count 32-byte directory slots without decoding any of them
+    void scanDirectorySlots(const uint8_t* slots, uint32_t slot_count, DirectorySlotMasks& masks);
+
+    // Mark the slots whose 11-byte name equals short_name, an upper-case name as
+    // written by convertToShortName, with lower-case slot letters folded to upper case
+    void matchShortName(const uint8_t* slots, uint32_t slot_count, const std::string& short_name,
+                        std::vector<uint64_t>& matches);
+
+    // The name of a slot as readDirectoryEntry decodes it
+    std::string decodeShortName(const uint8_t* slot);
+}
+
+#endif
@@ -0,0 +1,463 @@
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fatimage.h"
+
+using namespace std;
+
+namespace FAT_FS
+{
+    const uint16_t RESERVED_SECTOR_COUNT = 32;
+    const uint8_t IMAGE_FAT_COUNT = 2;
+    const uint16_t FSINFO_SECTOR = 1;
+    const uint16_t BACKUP_BOOT_SECTOR = 6;
+    const uint32_t IMAGE_ROOT_CLUSTER = 2;
+
+    const uint32_t IMAGE_EOC = 0x0FFFFFFF;
+    const uint8_t IMAGE_ATTR_DIRECTORY = 0x10;
+    const uint8_t IMAGE_ATTR_ARCHIVE = 0x20;
+    const uint32_t IMAGE_DIR_ENTRY_SIZE = 32;
+
+    struct ImageDirectory
+    {
+        std::string path;
+        std::vector<uint32_t> clusters;
+        uint32_t entry_count;
+    };
+
+    class ImageGenerator
+    {
+        public:
+            ImageGenerator(const ImageOptions& options);
+            ~ImageGenerator();
+
+            bool generate(std::string image_path, ImageLayout& layout);
+        private:
+            bool createImage(std::string image_path);
+            void writeBootSector(uint32_t sector);
+            void writeFSInfo();
+            void writeFATs();
+
+            bool allocateChain(uint32_t count, std::vector<uint32_t>& chain);
+            uint32_t findFreeCluster(uint32_t start_cluster);
+            uint8_t* getClusterData(uint32_t cluster);
+
+            bool createDirectory(ImageDirectory& parent, std::string name, ImageDirectory& directory);
+            bool createFile(ImageDirectory& parent, std::string name, uint32_t size, uint8_t fill);
+            bool addEntry(ImageDirectory& directory, std::string name, uint8_t attribute, uint32_t cluster, uint32_t size);
+            void writeEntry(uint8_t* location, std::string name, uint8_t attribute, uint32_t cluster, uint32_t size);
+            uint32_t getFileSize();
+
+            ImageOptions m_options;
+            std::mt19937 m_random;
+
+            int m_file_descriptor;
+            uint8_t* m_image_data;
+            uint64_t m_image_size;
+
+            uint32_t m_total_sectors;
+            uint32_t m_FATSz;
+            uint32_t m_first_data_sector;
+            uint32_t m_bytes_per_cluster;
+            uint32_t m_cluster_count;
+            uint32_t m_allocation_cursor;
+            std::vector<uint32_t> m_FAT;
+    };
+
+    bool generateImage(std::string image_path, const ImageOptions& options, ImageLayout& layout)
+    {
+        ImageGenerator generator(options);
+        return generator.generate(image_path, layout);
+    }
+
+    ImageGenerator::ImageGenerator(const ImageOptions& options) : m_options(options), m_random(options.seed)
+    {
+        m_file_descriptor = -1;
+        m_image_data = NULL;
+        m_image_size = 0;
+
+        // Size the FAT to cover every cluster of the volume, which slightly overestimates it
+        m_total_sectors = m_options.volume_size / m_options.bytes_per_sector;
+        uint32_t estimated_clusters = m_total_sectors / m_options.sectors_per_cluster + 2;
+        m_FATSz = (estimated_clusters * 4 + m_options.bytes_per_sector - 1) / m_options.bytes_per_sector;
+        m_first_data_sector = RESERVED_SECTOR_COUNT + IMAGE_FAT_COUNT * m_FATSz;
+        m_bytes_per_cluster = m_options.bytes_per_sector * m_options.sectors_per_cluster;
+
+        m_cluster_count = 0;
+        if (m_total_sectors > m_first_data_sector)
+            m_cluster_count = (m_total_sectors - m_first_data_sector) / m_options.sectors_per_cluster + 2;
+
+        m_allocation_cursor = IMAGE_ROOT_CLUSTER;
+    }
+
+    ImageGenerator::~ImageGenerator()
+    {
+        if (m_image_data)
+            munmap(m_image_data, m_image_size);
+        if (m_file_descriptor >= 0)
+            ::close(m_file_descriptor);
+    }
+
+    bool ImageGenerator::generate(std::string image_path, ImageLayout& layout)
+    {
+        if (m_cluster_count <= IMAGE_ROOT_CLUSTER + 1)
+        {
+            cout << "Error: volume is too small for the requested cluster size." << endl;
+            return false;
+        }
+
+        if (!createImage(image_path))
+            return false;
+
+        layout = ImageLayout();
+
+        // The root directory always occupies the first data cluster
+        ImageDirectory root;
+        root.path = "";
+        root.entry_count = 0;
+        m_FAT[IMAGE_ROOT_CLUSTER] = IMAGE_EOC;
+        root.clusters.push_back(IMAGE_ROOT_CLUSTER);
+        m_allocation_cursor = IMAGE_ROOT_CLUSTER + 1;
+
+        // Build the directory tree breadth first
+        std::vector<ImageDirectory> directories;
+        directories.push_back(root);
+        for (size_t parent = 0; parent < directories.size() && directories.size() <= m_options.directory_count; parent++)
+        {
+            for (uint32_t i = 0; i < m_options.directory_fan_out && directories.size() <= m_options.directory_count; i++)
+            {
+                ImageDirectory directory;
+                if (!createDirectory(directories[parent], "d" + std::to_string(directories.size()), directory))
+                    return false;
+
+                directories.push_back(directory);
+                layout.directories.push_back(directory.path);
+            }
+        }
+
+        // Spread files across directories in turn so data and directory clusters interleave
+        uint32_t file_number = 0;
+        for (uint32_t i = 0; i < m_options.files_per_directory; i++)
+        {
+            for (size_t j = 0; j < directories.size(); j++)
+            {
+                std::string name = "f" + std::to_string(file_number) + ".dat";
+                if (!createFile(directories[j], name, getFileSize(), file_number++ & 0xFF))
+                    return false;
+
+                layout.files.push_back(directories[j].path + "/" + name);
+            }
+        }
+
+        // A single directory with many entries for lookup benchmarks
+        if (m_options.large_directory_entries > 0)
+        {
+            ImageDirectory big;
+            if (!createDirectory(directories[0], "big", big))
+                return false;
+
+            for (uint32_t i = 0; i < m_options.large_directory_entries; i++)
+            {
+                std::string name = "e" + std::to_string(i);
+                if (!createFile(big, name, m_options.min_file_size, i & 0xFF))
+                    return false;
+
+                layout.large_directory_files.push_back(big.path + "/" + name);
+            }
+        }
+
+        // A chain of nested directories for path walk benchmarks
+        if (m_options.deep_path_depth > 0)
+        {
+            ImageDirectory parent;
+            if (!createDirectory(directories[0], "deep", parent))
+                return false;
+
+            for (uint32_t i = 1; i < m_options.deep_path_depth; i++)
+            {
+                ImageDirectory child;
+                if (!createDirectory(parent, "l" + std::to_string(i), child))
+                    return false;
+                parent = child;
+            }
+
+            layout.deep_directory = parent.path;
+        }
+
+        // One large file for sequential and random I/O
+        if (m_options.large_file_size > 0)
+        {
+            if (!createFile(directories[0], "large.dat", m_options.large_file_size, 0x5A))
+                return false;
+
+            layout.large_file = "/large.dat";
+        }
+
+        writeBootSector(0);
+        writeBootSector(BACKUP_BOOT_SECTOR);
+        writeFSInfo();
+        writeFATs();
+
+        layout.cluster_count = m_cluster_count - 2;
+        layout.free_cluster_count = 0;
+        for (uint32_t cluster = IMAGE_ROOT_CLUSTER; cluster < m_cluster_count; cluster++)
+            if (m_FAT[cluster] == 0)
+                layout.free_cluster_count++;
+
+        return msync(m_image_data, m_image_size, MS_SYNC) == 0;
+    }
+
+    bool ImageGenerator::createImage(std::string image_path)
+    {
+        m_image_size = (uint64_t)m_total_sectors * m_options.bytes_per_sector;
+
+        m_file_descriptor = ::open(image_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_file_descriptor < 0 || ftruncate(m_file_descriptor, m_image_size) != 0)
+        {
+            cout << "Error: cannot create image '" << image_path << "'." << endl;
+            return false;
+        }
+
+        m_image_data = (uint8_t*) mmap(0, m_image_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file_descriptor, 0);
+        if (m_image_data == MAP_FAILED)
+        {
+            m_image_data = NULL;
+            cout << "Error: cannot map image '" << image_path << "'." << endl;
+            return false;
+        }
+
+        m_FAT.assign(m_cluster_count, 0);
+        m_FAT[0] = 0x0FFFFFF8;
+        m_FAT[1] = IMAGE_EOC;
+        return true;
+    }
+
+    void ImageGenerator::writeBootSector(uint32_t sector)
+    {
+        uint8_t* boot = m_image_data + sector * m_options.bytes_per_sector;
+
+        boot[0] = 0xEB;
+        boot[1] = 0x58;
+        boot[2] = 0x90;
+        memcpy(boot + 3, "MSWIN4.1", 8);
+        memcpy(boot + 11, &m_options.bytes_per_sector, 2);
+        boot[13] = m_options.sectors_per_cluster;
+        memcpy(boot + 14, &RESERVED_SECTOR_COUNT, 2);
+        boot[16] = IMAGE_FAT_COUNT;
+        boot[21] = 0xF8;
+        memcpy(boot + 32, &m_total_sectors, 4);
+        memcpy(boot + 36, &m_FATSz, 4);
+        memcpy(boot + 44, &IMAGE_ROOT_CLUSTER, 4);
+        memcpy(boot + 48, &FSINFO_SECTOR, 2);
+        memcpy(boot + 50, &BACKUP_BOOT_SECTOR, 2);
+        boot[66] = 0x29;
+        memcpy(boot + 71, "NO NAME    ", 11);
+        memcpy(boot + 82, "FAT32   ", 8);
+        boot[510] = 0x55;
+        boot[511] = 0xAA;
+    }
+
+    void ImageGenerator::writeFSInfo()
+    {
+        uint8_t* fsinfo = m_image_data + FSINFO_SECTOR * m_options.bytes_per_sector;
+        uint32_t lead_signature = 0x41615252;
+        uint32_t struct_signature = 0x61417272;
+        uint32_t trail_signature = 0xAA550000;
+
+        uint32_t free_cluster_count = 0;
+        for (uint32_t cluster = IMAGE_ROOT_CLUSTER; cluster < m_cluster_count; cluster++)
+            if (m_FAT[cluster] == 0)
+                free_cluster_count++;
+
+        uint32_t next_free_cluster = findFreeCluster(IMAGE_ROOT_CLUSTER);
+
+        memcpy(fsinfo, &lead_signature, 4);
+        memcpy(fsinfo + 484, &struct_signature, 4);
+        memcpy(fsinfo + 488, &free_cluster_count, 4);
+        memcpy(fsinfo + 492, &next_free_cluster, 4);
+        memcpy(fsinfo + 508, &trail_signature, 4);
+    }
+
+    void ImageGenerator::writeFATs()
+    {
+        size_t FAT_size = (size_t)m_FATSz * m_options.bytes_per_sector;
+        for (uint8_t i = 0; i < IMAGE_FAT_COUNT; i++)
+        {
+            uint8_t* FAT = m_image_data + (RESERVED_SECTOR_COUNT + (size_t)i * m_FATSz) * m_options.bytes_per_sector;
+            memcpy(FAT, &m_FAT[0], std::min(FAT_size, m_FAT.size() * sizeof(uint32_t)));
+        }
+    }
+
+    bool ImageGenerator::allocateChain(uint32_t count, std::vector<uint32_t>& chain)
+    {
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        std::uniform_int_distribution<uint32_t> position(IMAGE_ROOT_CLUSTER, m_cluster_count - 1);
+
+        // Continue an existing chain from its last cluster
+        uint32_t previous_cluster = chain.empty() ? 0 : chain.back();
+        if (previous_cluster != 0)
+            m_allocation_cursor = previous_cluster + 1;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            // Jump to a random spot to break the chain into fragments
+            if (previous_cluster != 0 && chance(m_random) < m_options.fragmentation)
+                m_allocation_cursor = position(m_random);
+
+            uint32_t cluster = findFreeCluster(m_allocation_cursor);
+            if (cluster == 0)
+            {
+                cout << "Error: image is full." << endl;
+                return false;
+            }
+
+            m_FAT[cluster] = IMAGE_EOC;
+            if (previous_cluster != 0)
+                m_FAT[previous_cluster] = cluster;
+
+            chain.push_back(cluster);
+            previous_cluster = cluster;
+            m_allocation_cursor = cluster + 1;
+        }
+
+        return true;
+    }
+
+    uint32_t ImageGenerator::findFreeCluster(uint32_t start_cluster)
+    {
+        if (start_cluster < IMAGE_ROOT_CLUSTER || start_cluster >= m_cluster_count)
+            start_cluster = IMAGE_ROOT_CLUSTER;
+
+        for (uint32_t cluster = start_cluster; cluster < m_cluster_count; cluster++)
+            if (m_FAT[cluster] == 0)
+                return cluster;
+
+        for (uint32_t cluster = IMAGE_ROOT_CLUSTER; cluster < start_cluster; cluster++)
+            if (m_FAT[cluster] == 0)
+                return cluster;
+
+        return 0;
+    }
+
+    uint8_t* ImageGenerator::getClusterData(uint32_t cluster)
+    {
+        uint64_t sector = m_first_data_sector + (uint64_t)(cluster - 2) * m_options.sectors_per_cluster;
+        return m_image_data + sector * m_options.bytes_per_sector;
+    }
+
+    bool ImageGenerator::createDirectory(ImageDirectory& parent, std::string name, ImageDirectory& directory)
+    {
+        directory.path = parent.path + "/" + name;
+        directory.entry_count = 0;
+        directory.clusters.clear();
+
+        if (!allocateChain(1, directory.clusters))
+            return false;
+
+        // Match FileSystem::mkdir, which records the parent cluster in '..' even for the root
+        if (!addEntry(directory, ".", IMAGE_ATTR_DIRECTORY, directory.clusters[0], 0) ||
+            !addEntry(directory, "..", IMAGE_ATTR_DIRECTORY, parent.clusters[0], 0))
+            return false;
+
+        return addEntry(parent, name, IMAGE_ATTR_DIRECTORY, directory.clusters[0], 0);
+    }
+
+    bool ImageGenerator::createFile(ImageDirectory& parent, std::string name, uint32_t size, uint8_t fill)
+    {
+        // Empty files still get one cluster, as FileSystem::create gives them
+        uint32_t cluster_count = std::max<uint32_t>(1, (size + m_bytes_per_cluster - 1) / m_bytes_per_cluster);
+
+        std::vector<uint32_t> chain;
+        if (!allocateChain(cluster_count, chain))
+            return false;
+
+        // Fill the data with a per-file byte so reads can be told apart
+        uint32_t remaining = size;
+        std::vector<uint32_t>::iterator iterator;
+        for (iterator = chain.begin(); iterator != chain.end() && remaining > 0; iterator++)
+        {
+            uint32_t length = std::min(remaining, m_bytes_per_cluster);
+            memset(getClusterData(*iterator), fill, length);
+            remaining -= length;
+        }
+
+        return addEntry(parent, name, IMAGE_ATTR_ARCHIVE, chain[0], size);
+    }
+
+    bool ImageGenerator::addEntry(ImageDirectory& directory, std::string name, uint8_t attribute, uint32_t cluster, uint32_t size)
+    {
+        uint32_t entries_per_cluster = m_bytes_per_cluster / IMAGE_DIR_ENTRY_SIZE;
+        uint32_t cluster_index = directory.entry_count / entries_per_cluster;
+
+        // Grow the directory by a zeroed cluster when its last one is full
+        if (cluster_index >= directory.clusters.size())
+        {
+            if (!allocateChain(1, directory.clusters))
+                return false;
+            memset(getClusterData(directory.clusters.back()), 0, m_bytes_per_cluster);
+        }
+
+        uint8_t* location = getClusterData(directory.clusters[cluster_index]);
+        location += (directory.entry_count % entries_per_cluster) * IMAGE_DIR_ENTRY_SIZE;
+        writeEntry(location, name, attribute, cluster, size);
+
+        directory.entry_count++;
+        return true;
+    }
+
+    void ImageGenerator::writeEntry(uint8_t* location, std::string name, uint8_t attribute, uint32_t cluster, uint32_t size)
+    {
+        // Pad the 8.3 name with spaces, keeping '.' and '..' as they are
+        char short_name[11];
+        memset(short_name, ' ', sizeof(short_name));
+
+        size_t dot_sep_loc = name.find('.');
+        if (name == "." || name == "..")
+            memcpy(short_name, name.data(), name.length());
+        else if (dot_sep_loc != std::string::npos)
+        {
+            for (size_t i = 0; i < dot_sep_loc && i < 8; i++)
+                short_name[i] = toupper(name[i]);
+            for (size_t i = dot_sep_loc + 1; i < name.length() && i - dot_sep_loc - 1 < 3; i++)
+                short_name[8 + i - dot_sep_loc - 1] = toupper(name[i]);
+        }
+        else
+        {
+            for (size_t i = 0; i < name.length() && i < 11; i++)
+                short_name[i] = toupper(name[i]);
+        }
+
+        uint16_t high_cluster = cluster >> 16;
+        uint16_t low_cluster = cluster & 0x0000FFFF;
+
+        memset(location, 0, IMAGE_DIR_ENTRY_SIZE);
+        memcpy(location, short_name, sizeof(short_name));
+        location[11] = attribute;
+        memcpy(location + 20, &high_cluster, 2);
+        memcpy(location + 26, &low_cluster, 2);
+        memcpy(location + 28, &size, 4);
+    }
+
+    uint32_t ImageGenerator::getFileSize()
+    {
+        uint32_t min_size = m_options.min_file_size;
+        uint32_t max_size = std::max(m_options.min_file_size, m_options.max_file_size);
+
+        if (m_options.size_distribution == SIZE_FIXED || min_size == max_size)
+            return min_size;
+
+        if (m_options.size_distribution == SIZE_UNIFORM)
+        {
+            std::uniform_int_distribution<uint32_t> size(min_size, max_size);
+            return size(m_random);
+        }
+
+        // Log-uniform sizes give many small files and a long tail of large ones
+        std::uniform_real_distribution<double> exponent(log(std::max<uint32_t>(min_size, 1)), log(max_size));
+        return std::min<uint32_t>(max_size, exp(exponent(m_random)));
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef FATIMAGE_H
+#define FATIMAGE_H
+#include <string>
+#include <cstdint>
+#include <vector>
+
+namespace FAT_FS
+{
+    enum FileSizeDistribution
+    {
+        SIZE_FIXED,
+        SIZE_UNIFORM,
+        SIZE_LOG_UNIFORM
+    };
+
+    struct ImageOptions
+    {
+        ImageOptions() : volume_size(64 << 20), bytes_per_sector(512), sectors_per_cluster(8),
+                         directory_count(32), directory_fan_out(4), files_per_directory(32),
+                         large_directory_entries(4096), deep_path_depth(16), large_file_size(8 << 20),
+                         size_distribution(SIZE_LOG_UNIFORM), min_file_size(512), max_file_size(64 << 10),
+                         fragmentation(0.0), seed(1) {}
+
+        uint64_t volume_size;
+        uint16_t bytes_per_sector;
+        uint8_t sectors_per_cluster;
+
+        // Directory tree below the root, filled breadth first with directory_fan_out children each
+        uint32_t directory_count;
+        uint32_t directory_fan_out;
+        uint32_t files_per_directory;
+
+        // Fixed fixtures: /big with many entries, a /deep chain of directories and /large.dat
+        uint32_t large_directory_entries;
+        uint32_t deep_path_depth;
+        uint32_t large_file_size;
+
+        FileSizeDistribution size_distribution;
+        uint32_t min_file_size;
+        uint32_t max_file_size;
+
+        // Probability in [0, 1] that the next cluster of a chain is not adjacent to the previous one
+        double fragmentation;
+        uint32_t seed;
+    };
+
+    // Paths created in the image, all absolute and in lower case
+    struct ImageLayout
+    {
+        std::vector<std::string> directories;
+        std::vector<std::string> files;
+        std::vector<std::string> large_directory_files;
+        std::string deep_directory;
+        std::string large_file;
+
+        uint32_t cluster_count;
+        uint32_t free_cluster_count;
+    };
+
+    // Writes a populated FAT32 image to image_path, deterministic for a given seed
+    bool generateImage(std::string image_path, const ImageOptions& options, ImageLayout& layout);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include <cstring>
+#include "filesystem.h"
+#include "fatscan.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace FAT_FS
+{
+    namespace
+    {
+        // Free bits of up to 64 entries, one entry at a time
+        uint64_t getFreeBitsScalar(const uint8_t* entries, uint32_t entry_count)
+        {
+            const LittleEndian<uint32_t>* values = reinterpret_cast<const LittleEndian<uint32_t>*>(entries);
+
+            uint64_t bits = 0;
+            for (uint32_t i = 0; i < entry_count; i++)
+                bits |= (uint64_t)((values[i] & FAT_MASK) == FREE_CLUSTER) << i;
+            return bits;
+        }
+
+#if defined(__SSE2__)
+        // Free bits of 64 entries, four to a compare
+        uint64_t getFreeBitsSSE2(const uint8_t* entries)
+        {
+            const __m128i mask = _mm_set1_epi32(FAT_MASK);
+            const __m128i zero = _mm_setzero_si128();
+
+            uint64_t bits = 0;
+            for (uint32_t i = 0; i < 64; i += 4)
+            {
+                __m128i values = _mm_and_si128(_mm_loadu_si128((const __m128i*)(entries + i * 4)), mask);
+                uint64_t free_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, zero)));
+                bits |= free_bits << i;
+            }
+            return bits;
+        }
+
+        // Free bits of 64 entries, eight to a compare
+        __attribute__((target("avx2")))
+        uint32_t scanFreeWordsAVX2(const uint8_t* FAT, uint32_t word_count, uint64_t* words)
+        {
+            const __m256i mask = _mm256_set1_epi32(FAT_MASK);
+            const __m256i zero = _mm256_setzero_si256();
+
+            uint32_t free_count = 0;
+            for (uint32_t word = 0; word < word_count; word++)
+            {
+                const uint8_t* entries = FAT + (uint64_t)word * 64 * 4;
+
+                uint64_t bits = 0;
+                for (uint32_t i = 0; i < 64; i += 8)
+                {
+                    __m256i values = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(entries + i * 4)), mask);
+                    uint64_t free_bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(values, zero)));
+                    bits |= free_bits << i;
+                }
+
+                words[word] = bits;
+                free_count += __builtin_popcountll(bits);
+            }
+            return free_count;
+        }
+
+        bool hasAVX2()
+        {
+            static const bool has_avx2 = __builtin_cpu_supports("avx2");
+            return has_avx2;
+        }
+#endif
+    }
+
+    uint32_t scanFreeFATEntries(const uint8_t* FAT, uint32_t entry_count, std::vector<uint64_t>& bitmap)
+    {
+        uint32_t full_word_count = entry_count / 64;
+        uint32_t free_count = 0;
+        bitmap.assign((entry_count + 63) / 64, 0);
+
+#if defined(__SSE2__)
+        if (hasAVX2())
+            free_count = scanFreeWordsAVX2(FAT, full_word_count, bitmap.data());
+        else
+        {
+            for (uint32_t word = 0; word < full_word_count; word++)
+            {
+                bitmap[word] = getFreeBitsSSE2(FAT + (uint64_t)word * 64 * 4);
+                free_count += __builtin_popcountll(bitmap[word]);
+            }
+        }
+#else
+        for (uint32_t word = 0; word < full_word_count; word++)
+        {
+            bitmap[word] = getFreeBitsScalar(FAT + (uint64_t)word * 64 * 4, 64);
+            free_count += __builtin_popcountll(bitmap[word]);
+        }
+#endif
+
+        // The entries after the last whole word
+        if (entry_count % 64 != 0)
+        {
+            bitmap[full_word_count] = getFreeBitsScalar(FAT + (uint64_t)full_word_count * 64 * 4, entry_count % 64);
+            free_count += __builtin_popcountll(bitmap[full_word_count]);
+        }
+
+        return free_count;
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+#include <cstdint>
+#include <vector>
+
+namespace FAT_FS
+{
+    // Mark free entries among the first entry_count 32-bit entries of a FAT in
+    // bitmap, bit (i % 64) of word (i / 64) for entry i, and return their count.
+    // Entries 0 and 1 are reserved and left for the caller to clear.
+    uint32_t scanFreeFATEntries(const uint8_t* FAT, uint32_t entry_count, std::vector<uint64_t>& bitmap);
+}
+
+#endif
@@ -13,6 +13,10 @@
 #include <cmath>
 #include <ctime>
 #include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <chrono>
+#include <queue>
 
 using namespace FAT_FS;
 
@@ -22,8 +26,13 @@ using namespace FAT_FS;
 // *********************************************************
 // *********************************************************
 
-FileSystem::FileSystem(std::string file_system_image)
+FileSystem::FileSystem(std::string file_system_image, MountOptions options)
 {
+    m_options = options;
+    m_stats_stopping = false;
+    m_flush_stopping = false;
+    m_flush_requested = false;
+
     // Setup file descriptor
     m_file_descriptor = ::open(file_system_image.c_str(), O_RDWR);
 
@@ -38,37 +47,182 @@ FileSystem::FileSystem(std::string file_system_image)
     // Get file size
     struct stat file_status;
     stat(file_system_image.c_str(), &file_status);
-    m_file_system_size = file_status.st_size;
 
-    // Map the fat system
-    m_file_system_data = (uint8_t*) mmap(0, m_file_system_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file_descriptor, 0);
+    // Reach the image through the chosen backend
+    if (m_options.backend == BLOCK_DEVICE_CACHED || m_options.backend == BLOCK_DEVICE_URING)
+    {
+        // Cache whole clusters, sized from the boot sector
+        uint8_t boot_sector[512] = { 0 };
+        uint32_t block_size = 4096;
+        if (pread(m_file_descriptor, boot_sector, sizeof(boot_sector), 0) == sizeof(boot_sector))
+        {
+            uint32_t cluster_size = (boot_sector[11] | (boot_sector[12] << 8)) * boot_sector[13];
+            if (cluster_size >= 512 && (cluster_size & (cluster_size - 1)) == 0)
+                block_size = cluster_size;
+        }
+
+        uint64_t cache_size = (uint64_t)m_options.cache_MB << 20;
+        if (m_options.backend == BLOCK_DEVICE_URING)
+            m_device.reset(new UringBlockDevice(m_file_descriptor, file_status.st_size, block_size, cache_size));
+        else
+            m_device.reset(new CachedBlockDevice(m_file_descriptor, file_status.st_size, block_size, cache_size));
+    }
+    else
+    {
+        MappedBlockDevice* device = new MappedBlockDevice(m_file_descriptor, file_status.st_size,
+                                                          m_options.populate, m_options.huge_pages);
+        m_device.reset(device);
+
+        if (!device->isMapped())
+        {
+            m_error = true;
+            return;
+        }
+    }
+
+    // Replay what a crash left in the journal before anything is read from the image
+    if (!m_options.journal_file.empty())
+    {
+        m_journal.reset(new Journal(*m_device));
+        BootSectorView boot_sector_copy;
+        const BootSectorView* boot_sector = m_device->overlay(0, boot_sector_copy);
+        if (!m_device->canHold() || !m_journal->open(m_options.journal_file, boot_sector->volume_id))
+        {
+            m_error = true;
+            return;
+        }
+    }
 
     // Read bios parameter block
-    m_bpb.bytes_per_sector = readFromFileSystem<uint16_t>(11, 2);
-    m_bpb.sectors_per_cluster = readFromFileSystem<uint8_t>(13, 1);
-    m_bpb.reserved_sector_count = readFromFileSystem<uint16_t>(14, 2);
-    m_bpb.num_FATS = readFromFileSystem<uint8_t>(16, 1);
-    m_bpb.total_sectors = readFromFileSystem<uint32_t>(32, 4);
-    m_bpb.FATSz = readFromFileSystem<uint32_t>(36, 4);
-    m_bpb.root_cluster = readFromFileSystem<uint32_t>(44, 4);
-    m_bpb.fsinfo = readFromFileSystem<uint32_t>(48, 2);
+    BootSectorView boot_sector_copy;
+    const BootSectorView* boot_sector = m_device->overlay(0, boot_sector_copy);
+    m_bpb.bytes_per_sector = boot_sector->bytes_per_sector;
+    m_bpb.sectors_per_cluster = boot_sector->sectors_per_cluster;
+    m_bpb.reserved_sector_count = boot_sector->reserved_sector_count;
+    m_bpb.num_FATS = boot_sector->num_FATS;
+    m_bpb.total_sectors = boot_sector->total_sectors;
+    m_bpb.FATSz = boot_sector->FATSz;
+    m_bpb.root_cluster = boot_sector->root_cluster;
+    m_bpb.fsinfo = boot_sector->fsinfo;
 
     // Read fsinfo
-    m_fsinfo.free_cluster_count = readFromFileSystem<uint32_t>(m_bpb.fsinfo * m_bpb.bytes_per_sector + 488, 4);
-    m_fsinfo.first_free_cluster = readFromFileSystem<uint32_t>(m_bpb.fsinfo * m_bpb.bytes_per_sector + 492, 4);
+    FSInfoSectorView fsinfo_copy;
+    const FSInfoSectorView* fsinfo = m_device->overlay(m_bpb.fsinfo * m_bpb.bytes_per_sector, fsinfo_copy);
+    m_fsinfo.free_cluster_count = fsinfo->free_cluster_count;
+    m_fsinfo.first_free_cluster = fsinfo->first_free_cluster;
 
     // Calculate other necessary information
     m_bytes_per_cluster = m_bpb.bytes_per_sector * m_bpb.sectors_per_cluster;
     m_first_data_sector = m_bpb.reserved_sector_count + (m_bpb.num_FATS * m_bpb.FATSz);
+    m_total_cluster_count = ((m_bpb.total_sectors - m_first_data_sector) / m_bpb.sectors_per_cluster) + 2;
+
+    // A FAT can describe no more clusters than fit in its sectors
+    uint32_t FAT_cluster_count = (m_bpb.FATSz * m_bpb.bytes_per_sector) / 4;
+    if (m_total_cluster_count > FAT_cluster_count)
+        m_total_cluster_count = FAT_cluster_count;
+
+    // Every lookup and allocation reads the FAT, so keep it resident: pinned if asked, otherwise read in ahead of use
+    uint64_t FAT_offset = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector;
+    uint64_t FAT_length = (uint64_t)m_bpb.num_FATS * m_bpb.FATSz * m_bpb.bytes_per_sector;
+    m_FAT_locked = false;
+    if (m_options.lock_FAT)
+        m_FAT_locked = m_device->lockInMemory(FAT_offset, FAT_length);
+    if (!m_FAT_locked)
+        m_device->advise(FAT_offset, FAT_length, MADV_WILLNEED);
+
+    // Build the in-memory free cluster bitmap from the FAT, which also counts
+    // the free clusters; FSInfo is only a hint and crashed tools leave it stale
+    std::chrono::steady_clock::time_point scan_start = std::chrono::steady_clock::now();
+    m_stored_free_cluster_count = m_fsinfo.free_cluster_count;
+    m_scanned_free_cluster_count = buildFreeClusterBitmap();
+    m_fsinfo.free_cluster_count = m_scanned_free_cluster_count;
+    m_free_cluster_scan_time = std::chrono::steady_clock::now() - scan_start;
+
+    // Start from the first free cluster when the hint is unset, out of range or has nothing free after it
+    uint32_t stored_first_free_cluster = m_fsinfo.first_free_cluster;
+    if (m_fsinfo.first_free_cluster < 2 || m_fsinfo.first_free_cluster >= m_total_cluster_count ||
+        findFreeCluster(m_fsinfo.first_free_cluster) == 0)
+    {
+        uint32_t first_free_cluster = findFreeCluster(2);
+        m_fsinfo.first_free_cluster = (first_free_cluster != 0) ? first_free_cluster : 2;
+    }
+
+    // Write what was corrected back, so later mounts and fsck see it too. Frees reach FSInfo
+    // only once committed, so a crash and replay can also leave the count short.
+    if (m_stored_free_cluster_count != m_fsinfo.free_cluster_count || stored_first_free_cluster != m_fsinfo.first_free_cluster)
+        writeFSInfo();
+
+    m_extent_cache_generation = 0;
+
+    // No FAT sectors are waiting to be copied to the mirrors yet
+    m_FAT_dirty_first_sector = UINT32_MAX;
+    m_FAT_dirty_last_sector = 0;
+
+    // A volume left dirty may have stopped with its mirrors behind the primary FAT
+    if (!isVolumeClean())
+    {
+        JournalTransaction transaction(m_journal.get());
+        m_FAT_dirty_first_sector = 0;
+        m_FAT_dirty_last_sector = m_bpb.FATSz - 1;
+        syncFATMirrors();
+    }
 
     // Set current directory information
     m_current_directory_cluster = m_bpb.root_cluster;
     m_current_directory_name = ROOT;
+
+    // Start the periodic statistics dump
+    if (!m_options.stats_file.empty())
+        m_stats_thread = std::thread(&FileSystem::runStatisticsDump, this);
+
+    // Start the background flusher, woken early once enough data is dirty
+    if (m_options.flush_dirty_MB != 0)
+    {
+        m_device->setDirtyLimit((uint64_t)m_options.flush_dirty_MB << 20, [this]() {
+            std::lock_guard<std::mutex> lock(m_flush_lock);
+            m_flush_requested = true;
+            m_flush_condition.notify_one();
+        });
+    }
+    if (m_options.flush_interval != 0 || m_options.flush_dirty_MB != 0)
+        m_flush_thread = std::thread(&FileSystem::runFlusher, this);
 }
 
 FileSystem::~FileSystem()
 {
-    munmap(m_file_system_data, m_file_system_size);
+    if (m_stats_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_stats_lock);
+            m_stats_stopping = true;
+        }
+        m_stats_condition.notify_all();
+        m_stats_thread.join();
+    }
+
+    if (m_flush_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_flush_lock);
+            m_flush_stopping = true;
+        }
+        m_flush_condition.notify_all();
+        m_flush_thread.join();
+    }
+
+    if (!m_error)
+    {
+        {
+            JournalTransaction transaction(m_journal.get());
+            std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+            syncFATMirrors();
+        }
+        flushDevice();
+    }
+
+    // Closing the device writes back whatever it still holds, so the journal goes first
+    m_journal.reset();
+    m_device.reset();
     if (m_file_descriptor > 0)
         ::close(m_file_descriptor);
 }
@@ -79,24 +233,42 @@ FileSystem::~FileSystem()
 // *********************************************************
 // *********************************************************
 
-void FileSystem::fsinfo()
+std::string FileSystem::getCurrentDirectoryName()
+{
+    std::lock_guard<std::mutex> lock(m_current_directory_lock);
+    return m_current_directory_name;
+}
+
+bool FileSystem::fsinfo()
 {
+    CommandTimer timer(STAT_FSINFO);
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+
     cout << "Bytes Per Sector: " << m_bpb.bytes_per_sector << endl;
     cout << "Sectors Per Cluster: " << (uint32_t)m_bpb.sectors_per_cluster << endl;
     cout << "Total Sectors: " << m_bpb.total_sectors << endl;
     cout << "Number of FATS: " << (uint32_t)m_bpb.num_FATS << endl;
     cout << "Sectors per FAT: " << m_bpb.FATSz << endl;
     cout << "Number of Free Sectors: " << m_fsinfo.free_cluster_count * m_bpb.sectors_per_cluster << endl;
+    cout << "Block Device: " << m_device->describe() << endl;
+    cout << "Bytes Awaiting Flush: " << m_device->getDirtyBytes() << endl;
+    if (m_journal)
+        cout << "Journal: " << m_journal->describe() << endl;
+
+    if (m_options.lock_FAT)
+        cout << "FAT Locked in Memory: " << (m_FAT_locked ? "yes" : "no, mlock failed") << endl;
+
+    std::chrono::duration<double, std::milli> scan_time = m_free_cluster_scan_time;
+    cout << "Free Cluster Scan at Mount: " << m_total_cluster_count << " clusters in " << scan_time.count() << " ms" << endl;
+    if (m_stored_free_cluster_count != m_scanned_free_cluster_count)
+        cout << "FSInfo free cluster count was " << m_stored_free_cluster_count << ", corrected to "
+             << m_scanned_free_cluster_count << " from the FAT at mount." << endl;
+    return true;
 }
 
-void FileSystem::open(std::string file_name, std::string mode)
+bool FileSystem::open(std::string file_name, std::string mode)
 {
-    if (!isValidEntryName(file_name))
-    {
-        cout << "Error: file name may not contain /." << endl;
-        return;
-    }
-
+    CommandTimer timer(STAT_OPEN);
     string mode_type;
     if (mode == READ)
         mode_type = "read-only";
@@ -107,18 +279,33 @@ void FileSystem::open(std::string file_name, std::string mode)
     else
     {
         cout << "Error: Invalid mode. Valid modes are r, w, and rw." << endl;
-        return;
+        return false;
     }
 
     DirectoryEntry file;
-    if (findDirectoryEntry(file_name, m_current_directory_cluster, file))
+    if (resolvePath(file_name, file))
     {
         if (isFile(file))
         {
+            std::lock_guard<std::mutex> lock(m_open_file_table_lock);
+
+            // Read the entry again under the table lock, since defrag may have moved the file or rm removed it
+            file = readDirectoryEntry(file.mem_location);
+            if (isFreeEntry(file))
+            {
+                cout << "Error: '" << file_name << "' not found." << endl;
+                return false;
+            }
+
             if (m_open_file_table.find(file) == m_open_file_table.end())
             {
-                m_open_file_table[file] = mode;
+                std::shared_ptr<OpenFile> open_file(new OpenFile());
+                open_file->file = file;
+                open_file->mode = mode;
+
+                m_open_file_table[file] = open_file;
                 cout << "'" << file_name << "' has been opened with " << mode_type << " permission."<< endl;
+                return true;
             }
             else
                 cout << "Error: '" << file_name << "' is already open." << endl;
@@ -128,38 +315,45 @@ void FileSystem::open(std::string file_name, std::string mode)
     }
     else
         cout << "Error: '" << file_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::close(std::string file_name)
+bool FileSystem::close(std::string file_name)
 {
-    if (!isValidEntryName(file_name))
+    CommandTimer timer(STAT_CLOSE);
+    std::shared_ptr<OpenFile> open_file = findOpenFile(file_name);
+    if (open_file)
     {
-        cout << "Error: file name may not contain /." << endl;
-        return;
-    }
+        {
+            std::lock_guard<std::mutex> lock(m_open_file_table_lock);
+            m_open_file_table.erase(open_file->file);
+        }
 
-    std::map<DirectoryEntry, std::string>::iterator iterator;
-    for (iterator = m_open_file_table.begin(); iterator != m_open_file_table.end(); iterator++)
-    {
-        if (iterator->first.name == file_name)
         {
-            m_open_file_table.erase(iterator);
-            cout << "'" << file_name << "' is now closed." << endl;
-            return;
+            JournalTransaction transaction(m_journal.get());
+            std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+            syncFATMirrors();
         }
+        cout << "'" << file_name << "' is now closed." << endl;
+        return true;
     }
 
     cout << "'" << file_name << "' not found in the open file table" << endl;
-    return;
+    return false;
 }
 
-void FileSystem::create(std::string file_name)
+bool FileSystem::create(std::string file_name)
 {
-    // Ensure valid entry name
-    if (!isValidEntryName(file_name))
+    CommandTimer timer(STAT_CREATE);
+    JournalTransaction transaction(m_journal.get());
+    // Resolve the parent directory of the new entry
+    std::string path = file_name;
+    uint32_t parent_cluster;
+    if (!resolveParentDirectory(path, parent_cluster, file_name))
     {
-        cout << "Error: file name may not contain /." << endl;
-        return;
+        cout << "Error: '" << path << "' not found." << endl;
+        return false;
     }
 
     // Ensure valid file name
@@ -168,7 +362,7 @@ void FileSystem::create(std::string file_name)
         if (file_name[i] == SPECIAL_INVALID_CHAR && i != 0)
         {
             cout << "Error: file name cannot contain '" << file_name[i] << "'" << endl;
-            return;
+            return false;
         }
 
         for (int j = 0; j < INVALID_CHAR_LIST_SIZE; j++)
@@ -176,15 +370,15 @@ void FileSystem::create(std::string file_name)
             if (file_name[i] == INVALID_CHAR_LIST[j])
             {
                 cout << "Error: file name cannot contain '" << file_name[i] << "'" << endl;
-                return;
+                return false;
             }
         }
     }
 
-    if (file_name == "." || file_name == "..")
+    if (file_name.empty() || file_name == "." || file_name == "..")
     {
-       cout << "Error: cannot create '" << file_name << "'" << endl;
-       return;
+       cout << "Error: cannot create '" << path << "'" << endl;
+       return false;
     }
 
     size_t dot_sep_loc = file_name.find(".");
@@ -197,243 +391,321 @@ void FileSystem::create(std::string file_name)
         if (main.length() > 8 || extension.length() > 3  )
         {
             cout << "Error: main or extension is too long" << endl;
-            return;
+            return false;
         }
     }
     else if (file_name.length() > 11)
     {
         cout << "Error: file name is too long" << endl;
-        return;
+        return false;
     }
 
-    // Ensure file doesn't already exists
-    if (directoryEntryExists(file_name, m_current_directory_cluster))
+    WriteLock lock(getDirectoryLock(parent_cluster));
+
+    // Make sure the parent was not removed while its path was resolved
+    if (!isLiveDirectory(parent_cluster))
     {
-        cout << "'" << file_name << "' already exists." << endl;
-        return;
+        cout << "Error: '" << path << "' not found." << endl;
+        return false;
     }
 
-    createDirectoryEntry(file_name, m_current_directory_cluster, FILE);
-}
+    // Ensure file doesn't already exists
+    if (directoryEntryExists(file_name, parent_cluster))
+    {
+        cout << "'" << path << "' already exists." << endl;
+        return false;
+    }
 
-void FileSystem::read(std::string file_name, uint32_t start_pos, uint32_t num_bytes)
-{
-    if (!isValidEntryName(file_name))
+    if (!createDirectoryEntry(file_name, parent_cluster, FILE))
     {
-        cout << "Error: file name may not contain /." << endl;
-        return;
+        cout << "Error: insufficient space to create '" << path << "'." << endl;
+        return false;
     }
+    return true;
+}
 
-    // Search for file in open file table
-    std::map<DirectoryEntry, std::string>::iterator iterator;
-    for (iterator = m_open_file_table.begin(); iterator != m_open_file_table.end(); iterator++)
+bool FileSystem::read(std::string file_name, uint32_t start_pos, uint32_t num_bytes)
+{
+    CommandTimer timer(STAT_READ);
+    std::shared_ptr<OpenFile> open_file = findOpenFile(file_name);
+    if (open_file)
     {
-        DirectoryEntry file = iterator->first;
-        std::string file_mode = iterator->second;
+        ReadLock lock(open_file->lock);
+        DirectoryEntry file = open_file->file;
+        std::string file_mode = open_file->mode;
 
-        if (file.name == file_name)
+        // Make sure file is readable
+        if(file_mode != READ && file_mode != READ_WRITE)
         {
-            // Make sure file is readable
-            if(file_mode != READ && file_mode != READ_WRITE)
-            {
-                cout << "'" << file_name << "' is not open for reading." << endl;
-                return;
-            }
-            else if (!isFile(file))
-            {
-                cout << "'" << file_name << "' is not a file." << endl;
-                return;
-            }
-            // Make sure the start position is not greater than the file size
-            else if (start_pos > file.size)
-            {
-                cout << start_pos << " is greater than the file size." << endl;
-                return;
-            }
-            // Read the file
-            else
-            {
-                if (num_bytes > file.size)
-                    num_bytes = file.size;
-
-                std::vector<uint32_t> cluster_chain = getClusterChain(file.cluster);
-                uint32_t bytes_read = 0;
+            cout << "'" << file_name << "' is not open for reading." << endl;
+            return false;
+        }
+        else if (!isFile(file))
+        {
+            cout << "'" << file_name << "' is not a file." << endl;
+            return false;
+        }
+        // Make sure the start position is not greater than the file size
+        else if (start_pos > file.size)
+        {
+            cout << start_pos << " is greater than the file size." << endl;
+            return false;
+        }
+        // Read the file
+        else
+        {
+            if (num_bytes > file.size - start_pos)
+                num_bytes = file.size - start_pos;
 
-                for (size_t i = (start_pos / m_bytes_per_cluster); i < cluster_chain.size() && bytes_read <= num_bytes; i++)
-                {
-                    uint32_t cluster_pos = getFirstDataSector(cluster_chain[i]) * m_bpb.bytes_per_sector;
-                    uint32_t cluster_end = cluster_pos + m_bytes_per_cluster;
+            readAhead(*open_file, file, start_pos, num_bytes);
 
-                    if (i == (start_pos / m_bytes_per_cluster))
-                        cluster_pos += start_pos % m_bytes_per_cluster;
+            // Write each contiguous run of clusters out as one block
+            std::vector<DataSpan> spans = getDataSpans(file.cluster, start_pos, num_bytes);
+            {
+                TraceSpan copy_span("data_copy");
 
-                    for (size_t j = cluster_pos; j < cluster_end && bytes_read <= num_bytes; bytes_read++, j++)
-                        cout << readFromFileSystem<char>(j, 1);
+                std::vector<DataSpan>::iterator span;
+                if (m_device->isMapped())
+                {
+                    std::vector<uint8_t> buffer;
+                    for (span = spans.begin(); span != spans.end(); span++)
+                        cout.write(reinterpret_cast<const char*>(m_device->view(span->offset, span->length, buffer)), span->length);
                 }
+                else
+                {
+                    // Fill a window of the output with one batch covering every span in it
+                    std::vector<uint8_t> buffer(std::min<size_t>(num_bytes, READ_CHUNK_BYTES));
+                    std::vector<BlockIO> requests;
+                    size_t window_length = 0;
 
-                cout << endl;
-                return;
+                    for (span = spans.begin(); span != spans.end(); span++)
+                    {
+                        for (size_t done = 0; done < span->length; )
+                        {
+                            size_t length = std::min<size_t>(span->length - done, buffer.size() - window_length);
+                            BlockIO request = { span->offset + done, buffer.data() + window_length, length };
+                            requests.push_back(request);
+                            window_length += length;
+                            done += length;
+
+                            if (window_length == buffer.size() || (done == span->length && span + 1 == spans.end()))
+                            {
+                                m_device->readBatch(requests);
+                                cout.write(reinterpret_cast<const char*>(buffer.data()), window_length);
+                                requests.clear();
+                                window_length = 0;
+                            }
+                        }
+                    }
+                }
             }
+            Statistics::count(STAT_BYTES_READ, num_bytes);
+
+            cout << endl;
+            return true;
         }
     }
 
     cout << "'" << file_name << "' not found in the open file table" << endl;
-    return;
+    return false;
 }
 
-void FileSystem::write(std::string file_name, uint32_t start_pos, std::string quoted_data)
+bool FileSystem::write(std::string file_name, uint32_t start_pos, std::string quoted_data)
 {
-    if (!isValidEntryName(file_name))
-    {
-        cout << "Error: file name may not contain /." << endl;
-        return;
-    }
-
-    std::map<DirectoryEntry, std::string>::iterator iterator;
-    for (iterator = m_open_file_table.begin(); iterator != m_open_file_table.end(); iterator++)
+    CommandTimer timer(STAT_WRITE);
+    JournalTransaction transaction(m_journal.get());
+    std::shared_ptr<OpenFile> open_file = findOpenFile(file_name);
+    if (open_file)
     {
-        DirectoryEntry file = iterator->first;
-        std::string file_mode = iterator->second;
+        WriteLock lock(open_file->lock);
+        DirectoryEntry& file = open_file->file;
+        std::string file_mode = open_file->mode;
 
-        if (file.name == file_name)
+        if(file_mode != WRITE && file_mode != READ_WRITE)
         {
-            if(file_mode != WRITE && file_mode != READ_WRITE)
-            {
-                cout << "'" << file_name << "' is not open for writing." << endl;
-                return;
-            }
-            else
-            {
-                std::vector<uint32_t> cluster_chain = getClusterChain(file.cluster);
+            cout << "'" << file_name << "' is not open for writing." << endl;
+            return false;
+        }
+        else
+        {
+            uint32_t first_cluster = file.cluster;
+            uint32_t chain_length = (first_cluster == 0) ? 0 : getChainLength(getClusterExtents(first_cluster));
 
-                uint32_t write_request_size = start_pos + quoted_data.length();
-                uint32_t file_alloc_size = cluster_chain.size() * m_bytes_per_cluster;
+            uint32_t write_request_size = start_pos + quoted_data.length();
+            uint32_t file_alloc_size = chain_length * m_bytes_per_cluster;
 
-                // Ensure sufficient space in cluster chain for write request, allocate space if necessary
-                if (write_request_size > file_alloc_size)
-                {
-                    uint32_t cluster_alloc_size = ceil(static_cast<double>(write_request_size - file_alloc_size) / m_bytes_per_cluster);
+            // Ensure sufficient space in cluster chain for write request, allocate space if necessary
+            if (write_request_size > file_alloc_size)
+            {
+                uint32_t cluster_alloc_size = ceil(static_cast<double>(write_request_size - file_alloc_size) / m_bytes_per_cluster);
 
-                    if (m_fsinfo.free_cluster_count < cluster_alloc_size)
-                    {
-                        cout << "Error: insufficient space for write request."<< endl;
-                        return;
-                    }
-                    else
-                        resizeClusterChain(cluster_chain.size() + cluster_alloc_size, cluster_chain);
+                // Hold the allocator across the space check so the count cannot change before the resize
+                std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+                if (m_fsinfo.free_cluster_count < cluster_alloc_size)
+                {
+                    cout << "Error: insufficient space for write request."<< endl;
+                    return false;
                 }
 
-                if (write_request_size > file.size)
-                    updateFile(file, write_request_size, cluster_chain);
-
-
-                // Write the data to the file system
-                uint32_t bytes_written = 0;
-
-                for (size_t i = (start_pos / m_bytes_per_cluster); i < cluster_chain.size() && bytes_written < quoted_data.length(); i++)
+                first_cluster = resizeClusterChain(first_cluster, chain_length + cluster_alloc_size);
+                if (first_cluster == 0)
                 {
-                    uint32_t cluster_pos = getFirstDataSector(cluster_chain[i]) * m_bpb.bytes_per_sector;
-                    uint32_t cluster_end = cluster_pos + m_bytes_per_cluster;
+                    cout << "Error: insufficient space for write request."<< endl;
+                    return false;
+                }
+            }
 
-                    if (i == (start_pos / m_bytes_per_cluster))
-                        cluster_pos += start_pos % m_bytes_per_cluster;
+            // Copy the data into each contiguous run of clusters, as one batch
+            std::vector<DataSpan> spans = getDataSpans(first_cluster, start_pos, quoted_data.length());
+            size_t bytes_written = 0;
+            {
+                TraceSpan copy_span("data_copy");
 
-                    for (size_t j = cluster_pos; j < cluster_end && bytes_written < quoted_data.length(); bytes_written++, j++)
-                        writeToFileSystem<char>(quoted_data[bytes_written], j, 1);
+                std::vector<BlockIO> requests;
+                std::vector<DataSpan>::iterator span;
+                for (span = spans.begin(); span != spans.end(); span++)
+                {
+                    BlockIO request = { span->offset, (uint8_t*)quoted_data.data() + bytes_written, span->length };
+                    requests.push_back(request);
+                    bytes_written += span->length;
                 }
+                m_device->writeBatch(requests);
+            }
+            Statistics::count(STAT_BYTES_WRITTEN, bytes_written);
 
-                cout << "Wrote \"" << quoted_data << "\" to " << start_pos << ":" << file_name << " of length " << quoted_data.length() << endl;
-                return;
+            // Update the metadata once the data is in place
+            if (write_request_size > file_alloc_size)
+            {
+                std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+                writeFSInfo();
             }
+
+            if (write_request_size > file.size || first_cluster != file.cluster)
+                updateFile(file, std::max(write_request_size, file.size), first_cluster);
+
+            cout << "Wrote \"" << quoted_data << "\" to " << start_pos << ":" << file_name << " of length " << quoted_data.length() << endl;
+            return true;
         }
     }
 
     cout << "'" << file_name << "' not found in the open file table." << endl;
-    return;
-
+    return false;
 }
 
-void FileSystem::rm(std::string file_name)
+bool FileSystem::rm(std::string file_name)
 {
-    if (!isValidEntryName(file_name))
+    CommandTimer timer(STAT_RM);
+    JournalTransaction transaction(m_journal.get());
+    uint32_t parent_cluster;
+    std::string entry_name;
+    if (!resolveParentDirectory(file_name, parent_cluster, entry_name))
     {
-        cout << "Error: file name may not contain /." << endl;
-        return;
+        cout << "Error: '" << file_name << "' not found." << endl;
+        return false;
     }
 
+    WriteLock lock(getDirectoryLock(parent_cluster));
+
     DirectoryEntry file;
-    if (findDirectoryEntry(file_name, m_current_directory_cluster, file))
+    if (isLiveDirectory(parent_cluster) && findDirectoryEntry(entry_name, parent_cluster, file))
     {
         if (isFile(file))
         {
-            if (m_open_file_table.find(file) != m_open_file_table.end())
-                m_open_file_table.erase(file);
-            deleteDirectoryEntry(file_name, m_current_directory_cluster, file);
+            std::shared_ptr<OpenFile> open_file;
+            {
+                std::lock_guard<std::mutex> table_lock(m_open_file_table_lock);
+                std::map<DirectoryEntry, std::shared_ptr<OpenFile> >::iterator iterator = m_open_file_table.find(file);
+
+                if (iterator != m_open_file_table.end())
+                {
+                    open_file = iterator->second;
+                    m_open_file_table.erase(iterator);
+                }
+            }
+
+            // Wait for reads and writes already in progress on the file
+            if (open_file)
+            {
+                WriteLock file_lock(open_file->lock);
+                file = open_file->file;
+            }
+
+            deleteDirectoryEntry(entry_name, parent_cluster, file);
+            return true;
         }
         else
            cout << "Error: '" << file_name << "' is not a file." << endl;
     }
     else
         cout << "Error: '" << file_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::cd(std::string dir_name)
+bool FileSystem::cd(std::string dir_name)
 {
-    if (!isValidEntryName(dir_name))
-    {
-        cout << "Error: directory name may not contain /." << endl;
-        return;
-    }
-
+    CommandTimer timer(STAT_CD);
     DirectoryEntry directory;
-    if (findDirectoryEntry(dir_name, m_current_directory_cluster, directory))
+    if (resolvePath(dir_name, directory))
     {
         if (isDirectory(directory))
         {
+            std::string directory_name = normalizePath(dir_name);
+
+            std::lock_guard<std::mutex> lock(m_current_directory_lock);
             m_current_directory_cluster = directory.cluster;
-            m_current_directory_name = dir_name;
+            m_current_directory_name = directory_name;
+            return true;
         }
         else
            cout << "Error: '" << dir_name << "' is not a directory." << endl;
     }
     else
         cout << "Error: '" << dir_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::ls(std::string dir_name)
+bool FileSystem::ls(std::string dir_name)
 {
-    if (!isValidEntryName(dir_name))
-    {
-        cout << "Error: directory name may not contain /." << endl;
-        return;
-    }
-
+    CommandTimer timer(STAT_LS);
     DirectoryEntry directory;
-    if (findDirectoryEntry(dir_name, m_current_directory_cluster, directory))
+    if (resolvePath(dir_name, directory))
     {
         if (isDirectory(directory))
         {
-            std::list<DirectoryEntry> dir_entry_list = getDirectoryEntries(directory.cluster);
+            std::list<DirectoryEntry> dir_entry_list;
+            {
+                ReadLock lock(getDirectoryLock(directory.cluster));
+                dir_entry_list = getDirectoryEntries(directory.cluster);
+            }
 
             std::list<DirectoryEntry>::iterator iterator;
             for (iterator = dir_entry_list.begin(); iterator != dir_entry_list.end(); iterator++)
                 cout << iterator->name << " ";
             cout << endl;
+            return true;
         }
         else
            cout << "Error: '" << dir_name << "' is not a directory." << endl;
     }
     else
         cout << "Error: '" << dir_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::mkdir(std::string dir_name)
+bool FileSystem::mkdir(std::string dir_name)
 {
-    // Ensure valid entry name
-    if (!isValidEntryName(dir_name))
+    CommandTimer timer(STAT_MKDIR);
+    JournalTransaction transaction(m_journal.get());
+    // Resolve the parent directory of the new entry
+    std::string path = dir_name;
+    uint32_t parent_cluster;
+    if (!resolveParentDirectory(path, parent_cluster, dir_name))
     {
-        cout << "Error: directory name may not contain /." << endl;
-        return;
+        cout << "Error: '" << path << "' not found." << endl;
+        return false;
     }
 
     // Ensure valid dir name
@@ -442,7 +714,7 @@ void FileSystem::mkdir(std::string dir_name)
         if (dir_name[i] == SPECIAL_INVALID_CHAR && i != 0)
         {
             cout << "Error: directory name cannot contain '" << dir_name[i] << "'" << endl;
-            return;
+            return false;
         }
 
         for (int j = 0; j < INVALID_CHAR_LIST_SIZE; j++)
@@ -450,11 +722,17 @@ void FileSystem::mkdir(std::string dir_name)
             if (dir_name[i] == INVALID_CHAR_LIST[j])
             {
                 cout << "Error: directory name cannot contain '" << dir_name[i] << "'" << endl;
-                return;
+                return false;
             }
         }
     }
 
+    if (dir_name.empty() || dir_name == "." || dir_name == "..")
+    {
+       cout << "Error: cannot create '" << path << "'" << endl;
+       return false;
+    }
+
     size_t dot_sep_loc = dir_name.find(".");
 
     if (dot_sep_loc != std::string::npos)
@@ -465,38 +743,75 @@ void FileSystem::mkdir(std::string dir_name)
         if (main.length() > 8 || extension.length() > 3  )
         {
             cout << "Error: main or extension is too long" << endl;
-            return;
+            return false;
         }
     }
     else if (dir_name.length() > 11)
     {
         cout << "Error: directory name is too long" << endl;
-        return;
+        return false;
     }
 
-    // Ensure directory doesn't already exists
-    if (directoryEntryExists(dir_name, m_current_directory_cluster))
+    WriteLock lock(getDirectoryLock(parent_cluster));
+
+    // Make sure the parent was not removed while its path was resolved
+    if (!isLiveDirectory(parent_cluster))
     {
-        cout << "'"<< dir_name << "' already exists." << endl;
-        return;
+        cout << "Error: '" << path << "' not found." << endl;
+        return false;
     }
 
-    createDirectoryEntry(dir_name, m_current_directory_cluster, DIRECTORY);
-}
+    // Ensure directory doesn't already exists
+    if (directoryEntryExists(dir_name, parent_cluster))
+    {
+        cout << "'"<< path << "' already exists." << endl;
+        return false;
+    }
 
-void FileSystem::rmdir(std::string dir_name)
-{
-    if (!isValidEntryName(dir_name))
+    if (!createDirectoryEntry(dir_name, parent_cluster, DIRECTORY))
     {
-        cout << "Error: directory name may not contain /." << endl;
-        return;
+        cout << "Error: insufficient space to create '" << path << "'." << endl;
+        return false;
     }
+    return true;
+}
 
+bool FileSystem::rmdir(std::string dir_name)
+{
+    CommandTimer timer(STAT_RMDIR);
+    JournalTransaction transaction(m_journal.get());
+    uint32_t parent_cluster;
+    std::string entry_name;
     DirectoryEntry directory;
-    if (findDirectoryEntry(dir_name, m_current_directory_cluster, directory))
+    if (resolveParentDirectory(dir_name, parent_cluster, entry_name) && lookupDirectoryEntry(parent_cluster, entry_name, directory))
     {
+        if (entry_name == ROOT || entry_name == "." || entry_name == ".." || directory.cluster == m_bpb.root_cluster)
+        {
+            cout << "Error: cannot remove '" << dir_name << "'." << endl;
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_current_directory_lock);
+            if (directory.cluster == m_current_directory_cluster)
+            {
+                cout << "Error: cannot remove '" << dir_name << "'." << endl;
+                return false;
+            }
+        }
+
         if (isDirectory(directory))
         {
+            WriteLock lock(getDirectoryLock(parent_cluster), getDirectoryLock(directory.cluster));
+
+            // Look the entry up again now that both directories are locked
+            uint32_t dir_cluster = directory.cluster;
+            if (!isLiveDirectory(parent_cluster) || !findDirectoryEntry(entry_name, parent_cluster, directory) || directory.cluster != dir_cluster)
+            {
+                cout << "Error: '" << dir_name << "' not found." << endl;
+                return false;
+            }
+
             std::list<DirectoryEntry> dir_entry_list = getDirectoryEntries(directory.cluster);
 
             std::list<DirectoryEntry>::iterator iterator;
@@ -505,41 +820,51 @@ void FileSystem::rmdir(std::string dir_name)
                 if (iterator->name != "." && iterator->name != "..")
                 {
                     cout << "Error: '" << dir_name << "' is not empty." << endl;
-                    return;
+                    return false;
                 }
             }
 
-            deleteDirectoryEntry(dir_name, m_current_directory_cluster, directory);
+            deleteDirectoryEntry(entry_name, parent_cluster, directory);
+            return true;
         }
         else
            cout << "Error: '" << dir_name << "' is not a directory." << endl;
     }
     else
         cout << "Error: '" << dir_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::size(std::string entry_name)
+bool FileSystem::size(std::string entry_name)
 {
-    if (!isValidEntryName(entry_name))
-    {
-        cout << "Error: directory or file name may not contain /." << endl;
-        return;
-    }
-
+    CommandTimer timer(STAT_SIZE);
     DirectoryEntry dir_entry;
-    if (findDirectoryEntry(entry_name, m_current_directory_cluster, dir_entry))
+    if (resolvePath(entry_name, dir_entry))
     {
-        std::vector<uint32_t> cluster_chain = getClusterChain(dir_entry.cluster);
-        cout << "'"<< entry_name << "' has " << (cluster_chain.size() * m_bytes_per_cluster) << " allocated bytes." << endl;
+        uint32_t chain_length = getChainLength(getClusterExtents(dir_entry.cluster));
+        cout << "'"<< entry_name << "' has " << (chain_length * m_bytes_per_cluster) << " allocated bytes." << endl;
+        return true;
     }
     else
         cout << "Error: '" << entry_name << "' not found." << endl;
+
+    return false;
 }
 
-void FileSystem::undelete()
+bool FileSystem::undelete()
 {
+    CommandTimer timer(STAT_UNDELETE);
+    JournalTransaction transaction(m_journal.get());
     int file_recovered_count = 0;
-    std::vector<uint32_t> cluster_chain = getClusterChain(m_current_directory_cluster);
+    uint32_t directory_cluster;
+    {
+        std::lock_guard<std::mutex> lock(m_current_directory_lock);
+        directory_cluster = m_current_directory_cluster;
+    }
+
+    WriteLock lock(getDirectoryLock(directory_cluster));
+    std::vector<uint32_t> cluster_chain = getClusterChain(directory_cluster);
 
     std::vector<uint32_t>::iterator iterator;
     for (iterator = cluster_chain.begin(); iterator != cluster_chain.end(); iterator++)
@@ -552,8 +877,16 @@ void FileSystem::undelete()
 
             if (isFreeEntry(dir_entry) && isFile(dir_entry) && dir_entry.cluster != 0)
             {
-                setFATEntry(dir_entry.cluster, EOC);
-                setFreeClusterCount(m_fsinfo.free_cluster_count - 1);
+                // Only recover the first cluster if nothing has reused it since
+                {
+                    std::lock_guard<std::recursive_mutex> allocator_lock(m_allocator_lock);
+                    if (!isFreeCluster(dir_entry.cluster))
+                        continue;
+
+                    setFATEntry(dir_entry.cluster, EOC);
+                    setFreeClusterCount(m_fsinfo.free_cluster_count - 1);
+                    Statistics::count(STAT_CLUSTERS_ALLOCATED);
+                }
 
                 dir_entry.name = "undel." + std::to_string(++file_recovered_count);
                 if (dir_entry.size > m_bytes_per_cluster)
@@ -562,108 +895,524 @@ void FileSystem::undelete()
             }
         }
     }
-}
 
-// *********************************************************
-// *********************************************************
-// *                  PRIVATE FUNCTIONS                    *
-// *********************************************************
-// *********************************************************
+    // Recovered entries are not in the directory index yet
+    std::lock_guard<std::mutex> index_lock(m_directory_index_lock);
+    m_directory_index_cache.erase(directory_cluster);
+    return true;
+}
 
-template <typename T>
-T FileSystem::readFromFileSystem(size_t offset, size_t bytes)
+bool FileSystem::sync()
 {
-    T value = 0;
-    for(size_t i = 0; i < bytes; i++)
-        value |= (m_file_system_data[offset + i] << (i * 8));
+    CommandTimer timer(STAT_SYNC);
+    {
+        JournalTransaction transaction(m_journal.get());
+        std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+        syncFATMirrors();
+    }
 
-    return value;
+    // A checkpoint waits for open transactions, which may need the allocator
+    flushDevice();
+    cout << "File system synchronized." << endl;
+    return true;
 }
 
-template <typename T>
-void FileSystem::writeToFileSystem(T data, size_t offset, size_t bytes)
+bool FileSystem::fatcheck()
 {
-    T mask = 0xFF;
+    CommandTimer timer(STAT_FATCHECK);
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+    bool consistent = true;
 
-    for(size_t i = 0; i < bytes; i++)
+    // Report the first sector where each mirror differs from the primary FAT
+    for (uint8_t i = 1; i < m_bpb.num_FATS; i++)
     {
-        m_file_system_data[offset + i] =  (uint8_t)(data & mask) ;
-        data = data >> 8;
+        uint32_t sector = findFATMirrorDifference(i, 0);
+        if (sector < m_bpb.FATSz)
+        {
+            cout << "FAT " << (uint32_t)i << " differs from the primary FAT at sector " << sector << "." << endl;
+            consistent = false;
+        }
     }
+
+    if (consistent)
+        cout << "FAT mirrors are consistent." << endl;
+
+    return consistent;
 }
 
-std::list<DirectoryEntry> FileSystem::getDirectoryEntries(uint32_t cluster)
+bool FileSystem::trace(std::string action, std::string file_name)
 {
-    std::list<DirectoryEntry> dir_entry_list;
+    if (action == "start")
+    {
+        if (Tracer::isRunning())
+        {
+            cout << "Error: a trace is already running." << endl;
+            return false;
+        }
 
-    do
+        if (!Tracer::start(file_name))
+        {
+            cout << "Error: cannot write '" << file_name << "'." << endl;
+            return false;
+        }
+
+        cout << "Tracing to '" << file_name << "'." << endl;
+        return true;
+    }
+    else if (action == "stop")
     {
-        uint32_t sector = getFirstDataSector(cluster) * m_bpb.bytes_per_sector;
-        std::list<DirectoryEntry> cluster_entry_list;
+        uint64_t event_count;
+        uint64_t dropped_count;
 
-        for (int i = m_bytes_per_cluster - DIR_ENTRY_SIZE; i >= 0; i -= DIR_ENTRY_SIZE)
+        if (!Tracer::isRunning())
         {
-            DirectoryEntry dir_entry = readDirectoryEntry(sector + i);
+            cout << "Error: no trace is running." << endl;
+            return false;
+        }
 
-            if (!isLongName(dir_entry) && !isFreeEntry(dir_entry))
-               cluster_entry_list.push_front(dir_entry);
+        if (!Tracer::stop(event_count, dropped_count))
+        {
+            cout << "Error: cannot write the trace." << endl;
+            return false;
         }
 
-        dir_entry_list.insert(dir_entry_list.end(), cluster_entry_list.begin(), cluster_entry_list.end());
-    } while((cluster = getFATEntry(cluster)) < EOC);
+        cout << "Trace stopped: " << event_count << " events written, " << dropped_count << " dropped." << endl;
+        return true;
+    }
 
-    return dir_entry_list;
+    cout << "Error: invalid trace action. Valid actions are start and stop." << endl;
+    return false;
+}
+
+bool FileSystem::stats()
+{
+    Statistics::print(cout);
+
+    if (!m_options.stats_file.empty() && !Statistics::writePrometheus(m_options.stats_file))
+    {
+        cout << "Error: cannot write '" << m_options.stats_file << "'." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// *********************************************************
+// *********************************************************
+// *                  PRIVATE FUNCTIONS                    *
+// *********************************************************
+// *********************************************************
+
+void FileSystem::writeMetadata(uint64_t offset, const void* data, uint64_t length)
+{
+    if (m_journal)
+        m_journal->logWrite(offset, data, length);
+    m_device->write(offset, data, length);
+}
+
+void FileSystem::fillMetadata(uint64_t offset, uint8_t value, uint64_t length)
+{
+    if (m_journal)
+        m_journal->logFill(offset, value, length);
+    m_device->fill(offset, value, length);
+}
+
+template <typename T>
+void FileSystem::writeToFileSystem(T data, size_t offset)
+{
+    LittleEndian<T> field = data;
+    writeMetadata(offset, &field, sizeof(field));
+}
+
+std::list<DirectoryEntry> FileSystem::getDirectoryEntries(uint32_t cluster)
+{
+    TraceSpan span("directory_scan");
+    std::list<DirectoryEntry> dir_entry_list;
+    std::vector<ClusterExtent> extents = getClusterExtents(cluster);
+    uint32_t slot_count = m_bytes_per_cluster / DIR_ENTRY_SIZE;
+    DirectorySlotMasks masks;
+    std::vector<uint8_t> buffer;
+
+    std::vector<ClusterExtent>::const_iterator iterator;
+    for (iterator = extents.begin(); iterator != extents.end(); iterator++)
+    {
+        for (uint32_t j = 0; j < iterator->length; j++)
+        {
+            uint32_t sector = getFirstDataSector(iterator->start_cluster + j) * m_bpb.bytes_per_sector;
+            const uint8_t* slots = m_device->view(sector, m_bytes_per_cluster, buffer);
+            const ShortEntryView* entries = reinterpret_cast<const ShortEntryView*>(slots);
+            scanDirectorySlots(slots, slot_count, masks);
+
+            // Only slots holding a short entry are decoded, straight from the cluster
+            for (uint32_t i = 0; i < slot_count; i++)
+            {
+                if (((masks.free[i / 64] | masks.long_name[i / 64]) >> (i % 64)) & 1)
+                    continue;
+
+                DirectoryEntry dir_entry = decodeDirectoryEntry(entries[i], sector + i * DIR_ENTRY_SIZE);
+                if (!isFreeEntry(dir_entry))
+                    dir_entry_list.push_back(dir_entry);
+            }
+        }
+    }
+
+    return dir_entry_list;
 }
 
 std::vector<uint32_t> FileSystem::getClusterChain(uint32_t cluster)
 {
     std::vector<uint32_t> cluster_chain;
+    std::vector<ClusterExtent> extents = getClusterExtents(cluster);
+
+    std::vector<ClusterExtent>::const_iterator iterator;
+    for (iterator = extents.begin(); iterator != extents.end(); iterator++)
+        for (uint32_t i = 0; i < iterator->length; i++)
+            cluster_chain.push_back(iterator->start_cluster + i);
+
+    return cluster_chain;
+}
+
+std::vector<ClusterExtent> FileSystem::getClusterExtents(uint32_t cluster)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_extent_cache_lock);
+
+        std::unordered_map<uint32_t, std::vector<ClusterExtent> >::iterator cached = m_cluster_extent_cache.find(cluster);
+        if (cached != m_cluster_extent_cache.end())
+            return cached->second;
+
+        generation = m_extent_cache_generation;
+    }
+
+    // Follow the chain once, merging consecutive clusters into extents
+    TraceSpan span("chain_walk");
+    std::vector<ClusterExtent> extents;
+    uint32_t first_cluster = cluster;
+    uint32_t chain_index = 0;
 
     do
     {
-        cluster_chain.push_back(cluster);
-    } while ((cluster = getFATEntry(cluster)) < EOC);
+        if (!extents.empty() && extents.back().start_cluster + extents.back().length == cluster)
+            extents.back().length++;
+        else
+        {
+            ClusterExtent extent = { cluster, 1, chain_index };
+            extents.push_back(extent);
+        }
+        chain_index++;
+    } while ((cluster = getFATEntry(cluster)) < EOC && chain_index < m_total_cluster_count);
 
-    return cluster_chain;
+    // Only cache the chain if the FAT did not change while it was followed
+    std::lock_guard<std::mutex> lock(m_extent_cache_lock);
+    if (generation == m_extent_cache_generation)
+    {
+        if (m_cluster_extent_cache.size() >= MAX_CACHED_CLUSTER_CHAINS)
+            m_cluster_extent_cache.clear();
+        m_cluster_extent_cache[first_cluster] = extents;
+    }
+
+    return extents;
+}
+
+void FileSystem::invalidateClusterExtents()
+{
+    std::lock_guard<std::mutex> lock(m_extent_cache_lock);
+
+    m_extent_cache_generation++;
+    if (!m_cluster_extent_cache.empty())
+        m_cluster_extent_cache.clear();
+}
+
+uint32_t FileSystem::getChainLength(const std::vector<ClusterExtent>& extents)
+{
+    return extents.back().chain_index + extents.back().length;
 }
 
-uint32_t FileSystem::resizeClusterChain(uint32_t size, std::vector<uint32_t>& cluster_chain)
+uint32_t FileSystem::getClusterAt(const std::vector<ClusterExtent>& extents, uint32_t chain_index)
 {
-    if (size <= cluster_chain.size())
-        return cluster_chain.size();
+    size_t extent = findExtent(extents, chain_index);
+    return extents[extent].start_cluster + (chain_index - extents[extent].chain_index);
+}
 
-    if (cluster_chain[0] == 0)
+size_t FileSystem::findExtent(const std::vector<ClusterExtent>& extents, uint32_t chain_index)
+{
+    // Find the last extent starting at or before the chain index
+    size_t low = 0;
+    size_t high = extents.size();
+
+    while (high - low > 1)
     {
-        uint32_t alloc_cluster = allocateCluster();
+        size_t middle = (low + high) / 2;
+        if (extents[middle].chain_index <= chain_index)
+            low = middle;
+        else
+            high = middle;
+    }
 
-        cluster_chain.pop_back();
-        cluster_chain.push_back(alloc_cluster);
+    return low;
+}
+
+std::vector<DataSpan> FileSystem::getDataSpans(uint32_t first_cluster, uint32_t start_pos, uint32_t num_bytes)
+{
+    std::vector<DataSpan> spans;
+    std::vector<ClusterExtent> extents = getClusterExtents(first_cluster);
+
+    uint32_t chain_index = start_pos / m_bytes_per_cluster;
+    uint32_t cluster_offset = start_pos % m_bytes_per_cluster;
+
+    if (num_bytes == 0 || chain_index >= getChainLength(extents))
+        return spans;
+
+    // Each extent is contiguous in the image, so it maps to a single span
+    for (size_t i = findExtent(extents, chain_index); i < extents.size() && num_bytes > 0; i++)
+    {
+        uint32_t skipped_clusters = chain_index - extents[i].chain_index;
+        size_t offset = (size_t)getFirstDataSector(extents[i].start_cluster + skipped_clusters) * m_bpb.bytes_per_sector + cluster_offset;
+        size_t length = (size_t)(extents[i].length - skipped_clusters) * m_bytes_per_cluster - cluster_offset;
 
-        size--;
+        if (length > num_bytes)
+            length = num_bytes;
+
+        DataSpan span = { offset, length };
+        spans.push_back(span);
+
+        num_bytes -= length;
+        chain_index = extents[i].chain_index + extents[i].length;
+        cluster_offset = 0;
     }
 
-    for (int i = 0; i < (size - cluster_chain.size()); i++)
+    return spans;
+}
+
+void FileSystem::readAhead(OpenFile& open_file, const DirectoryEntry& file, uint32_t start_pos, uint32_t num_bytes)
+{
+    // Only a read starting where the previous one stopped counts as sequential
+    uint32_t end_pos = start_pos + num_bytes;
+    if (open_file.next_read_pos.exchange(end_pos, std::memory_order_relaxed) != start_pos)
+        return;
+
+    // Advise the part of the window not advised yet, once less than half of the window is left ahead
+    uint32_t advised_end = open_file.readahead_end.load(std::memory_order_relaxed);
+    uint32_t window_end = std::min<uint64_t>(file.size, (uint64_t)end_pos + READAHEAD_BYTES);
+    if (advised_end >= window_end || (advised_end > end_pos && advised_end - end_pos >= READAHEAD_BYTES / 2))
+        return;
+
+    uint32_t window_start = std::max(start_pos, advised_end);
+    open_file.readahead_end.store(window_end, std::memory_order_relaxed);
+
+    TraceSpan span("readahead");
+    std::vector<DataSpan> spans = getDataSpans(file.cluster, window_start, window_end - window_start);
+
+    std::vector<DataSpan>::iterator iterator;
+    for (iterator = spans.begin(); iterator != spans.end(); iterator++)
+        m_device->advise(iterator->offset, iterator->length, MADV_WILLNEED);
+}
+
+uint32_t FileSystem::resizeClusterChain(uint32_t first_cluster, uint32_t size)
+{
+    TraceSpan span("resize_chain");
+    uint32_t chain_length = 0;
+    uint32_t last_cluster = 0;
+
+    if (first_cluster != 0)
     {
-        uint32_t cluster = cluster_chain.back();
-        uint32_t alloc_cluster = allocateCluster(cluster);
+        std::vector<ClusterExtent> extents = getClusterExtents(first_cluster);
+        chain_length = getChainLength(extents);
+        last_cluster = extents.back().start_cluster + extents.back().length - 1;
+    }
+
+    if (size <= chain_length)
+        return first_cluster;
 
-        cluster_chain.pop_back();
-        cluster_chain.push_back(cluster);
-        cluster_chain.push_back(alloc_cluster);
+    // Reserve every cluster up front, then link them onto the chain in one pass
+    std::vector<uint32_t> clusters = reserveClusters(size - chain_length, last_cluster);
+    if (clusters.empty())
+        return 0;
+
+    linkClusters(last_cluster, clusters);
+
+    return (first_cluster == 0) ? clusters[0] : first_cluster;
+}
+
+std::vector<uint32_t> FileSystem::reserveClusters(uint32_t count, uint32_t last_cluster)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+    TraceSpan span("reserve_clusters");
+    std::vector<uint32_t> clusters;
+
+    if (count == 0 || count > m_fsinfo.free_cluster_count)
+        return clusters;
+
+    clusters.reserve(count);
+
+    // Extend the chain in place while the clusters following it are free
+    if (last_cluster != 0)
+    {
+        uint32_t run_length = std::min(getFreeRunLength(last_cluster + 1), count);
+        for (uint32_t i = 1; i <= run_length; i++)
+        {
+            markClusterFree(last_cluster + i, false);
+            clusters.push_back(last_cluster + i);
+        }
     }
 
-    return cluster_chain.size();
+    // Fill the remainder from the first free run after the hint that holds it whole, or else from
+    // the fewest largest runs
+    if (clusters.size() < count)
+    {
+        // The FSInfo count overstated the free space, so release what was taken
+        std::vector<FreeRun> runs;
+        if (!findFreeRuns(count - clusters.size(), runs))
+        {
+            std::vector<uint32_t>::iterator iterator;
+            for (iterator = clusters.begin(); iterator != clusters.end(); iterator++)
+                markClusterFree(*iterator, true);
+            clusters.clear();
+            return clusters;
+        }
+
+        std::vector<FreeRun>::iterator run;
+        for (run = runs.begin(); run != runs.end(); run++)
+        {
+            for (uint32_t i = 0; i < run->length; i++)
+            {
+                markClusterFree(run->start_cluster + i, false);
+                clusters.push_back(run->start_cluster + i);
+            }
+        }
+    }
+
+    // Only the in-memory FSInfo changes here, writeFSInfo() commits it
+    m_fsinfo.free_cluster_count -= count;
+    Statistics::count(STAT_CLUSTERS_ALLOCATED, count);
+    m_fsinfo.first_free_cluster = (clusters.back() + 1 < m_total_cluster_count) ? clusters.back() + 1 : 2;
+
+    return clusters;
+}
+
+bool FileSystem::findFreeRuns(uint32_t count, std::vector<FreeRun>& runs)
+{
+    TraceSpan span("find_free_run");
+    runs.clear();
+
+    // The largest runs seen so far, smallest on top, trimmed to the fewest that add up to count
+    typedef std::pair<uint32_t, uint32_t> LengthAndStart;
+    std::priority_queue<LengthAndStart, std::vector<LengthAndStart>, std::greater<LengthAndStart> > largest_runs;
+    uint64_t largest_total = 0;
+
+    // Walk the runs from the FSInfo hint, wrapping around once, and stop at the first that fits,
+    // so a search usually ends near where the last allocation did
+    uint32_t first_cluster = getFreeCluster();
+    bool wrapped = false;
+    for (uint32_t cluster = first_cluster; cluster != 0; )
+    {
+        uint32_t length = getFreeRunLength(cluster);
+        if (wrapped)
+            length = std::min(length, first_cluster - cluster);
+
+        if (length >= count)
+        {
+            FreeRun run = { cluster, count };
+            runs.push_back(run);
+            return true;
+        }
+
+        largest_runs.push(LengthAndStart(length, cluster));
+        largest_total += length;
+        while (largest_total - largest_runs.top().first >= count)
+        {
+            largest_total -= largest_runs.top().first;
+            largest_runs.pop();
+        }
+
+        cluster = findFreeCluster(cluster + length);
+        if (cluster == 0 && !wrapped)
+        {
+            cluster = findFreeCluster(2);
+            wrapped = true;
+        }
+        if (wrapped && cluster >= first_cluster)
+            break;
+    }
+
+    if (largest_total < count)
+        return false;
+
+    // Largest first, taking only what is needed of the smallest
+    for (; !largest_runs.empty(); largest_runs.pop())
+    {
+        FreeRun run = { largest_runs.top().second, largest_runs.top().first };
+        runs.push_back(run);
+    }
+    std::reverse(runs.begin(), runs.end());
+    runs.back().length -= largest_total - count;
+    return true;
+}
+
+uint32_t FileSystem::getFreeRunLength(uint32_t cluster)
+{
+    uint32_t length = 0;
+
+    while (cluster < m_total_cluster_count)
+    {
+        uint32_t bit = cluster % 64;
+        uint64_t used = (~m_free_cluster_bitmap[cluster / 64]) >> bit;
+
+        if (used != 0)
+            return length + __builtin_ctzll(used);
+
+        length += 64 - bit;
+        cluster += 64 - bit;
+    }
+
+    return length;
+}
+
+void FileSystem::linkClusters(uint32_t previous_cluster, const std::vector<uint32_t>& clusters)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+    TraceSpan span("link_clusters");
+
+    // Link the new clusters before attaching them, so a concurrent chain walk never sees a partial chain
+    uint8_t FAT_count = getUpdatedFATCount();
+    for (uint8_t i = 0; i < FAT_count; i++)
+    {
+        for (size_t j = 0; j < clusters.size(); j++)
+            writeFATEntry(i, clusters[j], (j + 1 < clusters.size()) ? clusters[j + 1] : EOC);
+
+        if (previous_cluster != 0)
+            writeFATEntry(i, previous_cluster, clusters[0]);
+    }
+
+    if (previous_cluster != 0)
+        markFATDirty(previous_cluster);
+
+    std::vector<uint32_t>::const_iterator iterator;
+    for (iterator = clusters.begin(); iterator != clusters.end(); iterator++)
+    {
+        markClusterFree(*iterator, false);
+        markFATDirty(*iterator);
+    }
+
+    invalidateClusterExtents();
 }
 
 uint32_t FileSystem::allocateCluster(uint32_t cluster)
 {
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+    TraceSpan span("allocate_cluster");
     uint32_t free_cluster = getFreeCluster();
+    if (free_cluster == 0)
+        return 0;
 
+    setFATEntry(free_cluster, EOC);
     if (cluster != 0)
         setFATEntry(cluster, free_cluster);
-    setFATEntry(free_cluster, EOC);
 
     setFreeClusterCount(m_fsinfo.free_cluster_count - 1);
+    setFirstFreeCluster(free_cluster + 1);
+    Statistics::count(STAT_CLUSTERS_ALLOCATED);
 
     return free_cluster;
 }
@@ -673,23 +1422,102 @@ uint32_t FileSystem::getDirectoryCluster(std::string dir_name)
     if (dir_name == ROOT)
         return m_bpb.root_cluster;
 
-    std::list<DirectoryEntry> dir_entry_list = getDirectoryEntries(m_current_directory_cluster);
-
-    std::list<DirectoryEntry>::iterator iterator;
-    for(iterator = dir_entry_list.begin(); iterator != dir_entry_list.end(); iterator++)
-        if (iterator->name == dir_name)
-            return iterator->cluster;
+    DirectoryEntry directory;
+    if (resolvePath(dir_name, directory))
+        return directory.cluster;
 
     return -1;
 }
 
+std::shared_ptr<DirectoryIndex> FileSystem::getDirectoryIndex(uint32_t cluster)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_directory_index_lock);
+
+        std::unordered_map<uint32_t, std::shared_ptr<DirectoryIndex> >::iterator cached = m_directory_index_cache.find(cluster);
+        if (cached != m_directory_index_cache.end())
+            return cached->second;
+    }
+
+    // Classify the slots a cluster at a time and decode only the names of short entries
+    TraceSpan span("directory_index_build");
+    std::shared_ptr<DirectoryIndex> index(new DirectoryIndex());
+    std::vector<ClusterExtent> extents = getClusterExtents(cluster);
+    uint32_t slot_count = m_bytes_per_cluster / DIR_ENTRY_SIZE;
+    DirectorySlotMasks masks;
+    std::vector<uint8_t> buffer;
+
+    std::vector<ClusterExtent>::const_iterator iterator;
+    for (iterator = extents.begin(); iterator != extents.end(); iterator++)
+    {
+        for (uint32_t j = 0; j < iterator->length; j++)
+        {
+            uint32_t sector = getFirstDataSector(iterator->start_cluster + j) * m_bpb.bytes_per_sector;
+            const uint8_t* slots = m_device->view(sector, m_bytes_per_cluster, buffer);
+            scanDirectorySlots(slots, slot_count, masks);
+
+            for (uint32_t i = 0; i < slot_count; i++)
+            {
+                uint32_t location = sector + i * DIR_ENTRY_SIZE;
+                if ((masks.free[i / 64] >> (i % 64)) & 1)
+                {
+                    index->free_slots.insert(location);
+                    continue;
+                }
+                if ((masks.long_name[i / 64] >> (i % 64)) & 1)
+                    continue;
+
+                // A name with nothing readDirectoryEntry keeps reads as a free entry
+                std::string name = decodeShortName(slots + i * DIR_ENTRY_SIZE);
+                Statistics::count(STAT_DIR_ENTRIES_DECODED);
+                if (name.empty())
+                    index->free_slots.insert(location);
+                else if (index->entries.find(name) == index->entries.end())
+                    index->entries[name] = location;
+            }
+        }
+    }
+
+    // Another reader of the same directory may have built the index first
+    std::lock_guard<std::mutex> lock(m_directory_index_lock);
+
+    std::unordered_map<uint32_t, std::shared_ptr<DirectoryIndex> >::iterator cached = m_directory_index_cache.find(cluster);
+    if (cached != m_directory_index_cache.end())
+        return cached->second;
+
+    if (m_directory_index_cache.size() >= MAX_INDEXED_DIRECTORIES)
+        m_directory_index_cache.clear();
+    m_directory_index_cache[cluster] = index;
+
+    return index;
+}
+
+ReadWriteLock& FileSystem::getDirectoryLock(uint32_t cluster)
+{
+    return m_directory_locks[cluster % DIRECTORY_LOCK_COUNT];
+}
+
+bool FileSystem::isLiveDirectory(uint32_t cluster)
+{
+    if (cluster == m_bpb.root_cluster)
+        return true;
+
+    // A removed directory has its '.' entry cleared
+    DirectoryEntry dot_dir_entry = readDirectoryEntry(getFirstDataSector(cluster) * m_bpb.bytes_per_sector);
+    return (dot_dir_entry.name == "." && dot_dir_entry.cluster == cluster);
+}
+
 uint32_t FileSystem::getFATEntry(uint32_t cluster)
 {
+    Statistics::count(STAT_FAT_READS);
     uint32_t FAT_sector = getFATSector(cluster);
     uint32_t FAT_ent_offset = getFATEntOffset(cluster);
-    uint32_t FAT_entry = readFromFileSystem<uint32_t>(FAT_sector * m_bpb.bytes_per_sector + FAT_ent_offset, 4);
 
-    return (FAT_MASK & FAT_entry);
+    LittleEndian<uint32_t> FAT_entry_copy;
+    const LittleEndian<uint32_t>* FAT_entry = m_device->overlay((uint64_t)FAT_sector * m_bpb.bytes_per_sector + FAT_ent_offset,
+                                                                FAT_entry_copy);
+
+    return (FAT_MASK & *FAT_entry);
 }
 
 uint32_t FileSystem::getFirstDataSector(uint32_t cluster)
@@ -709,92 +1537,326 @@ uint32_t FileSystem::getFATEntOffset(uint32_t cluster)
 
 uint32_t FileSystem::getFreeCluster()
 {
+    TraceSpan span("get_free_cluster");
     if (m_fsinfo.free_cluster_count == 0)
-        throw std::exception();
+        return 0;
+
+    // Search from the FSInfo hint, then wrap around to the start of the FAT; the bitmap
+    // decides, so 0 means the volume is full whatever the count says
+    uint32_t cluster = findFreeCluster(m_fsinfo.first_free_cluster);
+    if (cluster == 0)
+        cluster = findFreeCluster(2);
+
+    return cluster;
+}
+
+uint32_t FileSystem::findFreeCluster(uint32_t start_cluster)
+{
+    if (start_cluster >= m_total_cluster_count)
+        return 0;
+
+    // Check the remainder of the word holding the start cluster
+    uint32_t word_index = start_cluster / 64;
+    uint64_t word = m_free_cluster_bitmap[word_index] & (~0ULL << (start_cluster % 64));
+    if (word != 0)
+        return word_index * 64 + __builtin_ctzll(word);
+
+    // Use the summary to skip over words with no free clusters
+    uint32_t next_word_index = word_index + 1;
+    for (uint32_t summary_index = next_word_index / 64; summary_index < m_free_cluster_summary.size(); summary_index++)
+    {
+        uint64_t summary = m_free_cluster_summary[summary_index];
+        if (summary_index == next_word_index / 64)
+            summary &= (~0ULL << (next_word_index % 64));
+
+        if (summary != 0)
+        {
+            word_index = summary_index * 64 + __builtin_ctzll(summary);
+            return word_index * 64 + __builtin_ctzll(m_free_cluster_bitmap[word_index]);
+        }
+    }
 
-    uint32_t total_cluster_count = ((m_bpb.total_sectors - m_first_data_sector) / m_bpb.sectors_per_cluster) + 2;
-    for(uint32_t cluster = 2; cluster < total_cluster_count; cluster++)
-        if (isFreeCluster(cluster))
-            return cluster;
     return 0;
 }
 
+uint32_t FileSystem::buildFreeClusterBitmap()
+{
+    TraceSpan span("free_cluster_scan");
+    std::vector<uint8_t> buffer;
+    const uint8_t* FAT = m_device->view((uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector,
+                                        (uint64_t)m_total_cluster_count * 4, buffer);
+    uint32_t free_cluster_count = scanFreeFATEntries(FAT, m_total_cluster_count, m_free_cluster_bitmap);
+    Statistics::count(STAT_FAT_READS, m_total_cluster_count);
+
+    // Clusters 0 and 1 are reserved whatever their entries hold
+    free_cluster_count -= __builtin_popcountll(m_free_cluster_bitmap[0] & 3);
+    m_free_cluster_bitmap[0] &= ~3ULL;
+
+    m_free_cluster_summary.assign((m_free_cluster_bitmap.size() + 63) / 64, 0);
+    for (size_t i = 0; i < m_free_cluster_bitmap.size(); i++)
+        if (m_free_cluster_bitmap[i] != 0)
+            m_free_cluster_summary[i / 64] |= (1ULL << (i % 64));
+
+    return free_cluster_count;
+}
+
+void FileSystem::markClusterFree(uint32_t cluster, bool is_free)
+{
+    if (cluster < 2 || cluster >= m_total_cluster_count)
+        return;
+
+    uint32_t word_index = cluster / 64;
+    uint64_t& word = m_free_cluster_bitmap[word_index];
+    uint64_t& summary = m_free_cluster_summary[word_index / 64];
+
+    if (is_free)
+    {
+        word |= (1ULL << (cluster % 64));
+        summary |= (1ULL << (word_index % 64));
+    }
+    else
+    {
+        word &= ~(1ULL << (cluster % 64));
+        if (word == 0)
+            summary &= ~(1ULL << (word_index % 64));
+    }
+}
+
 void FileSystem::setFATEntry(uint32_t cluster, uint32_t value)
 {
+    std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
 
-    for (uint8_t i = 0; i < m_bpb.num_FATS; i++)
+    uint8_t FAT_count = getUpdatedFATCount();
+    for (uint8_t i = 0; i < FAT_count; i++)
+        writeFATEntry(i, cluster, value);
+    markFATDirty(cluster);
+
+    if ((value & FAT_MASK) != FREE_CLUSTER)
+        markClusterFree(cluster, false);
+    else if (!m_journal)
+        releaseCluster(cluster);
+    else
+    {
+        // A freed cluster is not handed out, or counted, until the free is in the journal, so a
+        // crash cannot leave it with a new owner while replay gives it back to the old one. A
+        // cluster whose metadata the journal still holds waits for the journal to be emptied,
+        // or replay could write that metadata over whatever the cluster holds next.
+        std::function<void()> release = [this, cluster]() {
+            std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+            if (getFATEntry(cluster) == FREE_CLUSTER && releaseCluster(cluster))
+                setFreeClusterCount(m_fsinfo.free_cluster_count);
+        };
+
+        if (m_device->isHeld((uint64_t)getFirstDataSector(cluster) * m_bpb.bytes_per_sector, m_bytes_per_cluster))
+            m_journal->deferUntilCheckpointed(release);
+        else
+            m_journal->deferUntilCommitted(release);
+    }
+
+    // Any cached chain may pass through the changed entry
+    invalidateClusterExtents();
+}
+
+bool FileSystem::releaseCluster(uint32_t cluster)
+{
+    // Only the in-memory count changes here, writeFSInfo() commits it
+    if (isFreeCluster(cluster))
+        return false;
+
+    markClusterFree(cluster, true);
+    m_fsinfo.free_cluster_count++;
+    return true;
+}
+
+void FileSystem::writeFATEntry(uint8_t FAT_index, uint32_t cluster, uint32_t value)
+{
+    uint32_t FAT_sector = getFATSector(cluster);
+    uint32_t FAT_ent_offset = getFATEntOffset(cluster);
+    uint32_t FAT_entry_location =  (FAT_sector + (FAT_index * m_bpb.FATSz)) * m_bpb.bytes_per_sector + FAT_ent_offset;
+
+    // Count each entry once, however many FATs are updated
+    if (FAT_index == 0)
+        Statistics::count(STAT_FAT_WRITES);
+
+    // The top four bits are reserved and kept as they are
+    LittleEndian<uint32_t> FAT_entry_copy;
+    uint32_t FAT_entry = *m_device->overlay(FAT_entry_location, FAT_entry_copy);
+
+    value &= FAT_MASK;
+    FAT_entry &= ~FAT_MASK;
+    FAT_entry |= value;
+
+    writeToFileSystem<uint32_t>(FAT_entry, FAT_entry_location);
+}
+
+void FileSystem::markFATDirty(uint32_t cluster)
+{
+    if (!m_options.deferred_FAT_sync)
+        return;
+
+    // The first change the mirrors miss marks the volume dirty until they catch up, so a
+    // mount after a crash knows to bring them up to date
+    if (m_FAT_dirty_first_sector > m_FAT_dirty_last_sector)
+        setVolumeClean(false);
+
+    uint32_t sector = (cluster * 4) / m_bpb.bytes_per_sector;
+    m_FAT_dirty_first_sector = std::min(m_FAT_dirty_first_sector, sector);
+    m_FAT_dirty_last_sector = std::max(m_FAT_dirty_last_sector, sector);
+}
+
+void FileSystem::syncFATMirrors()
+{
+    if (m_FAT_dirty_first_sector > m_FAT_dirty_last_sector)
+        return;
+
+    // Copy the dirty sector range of the primary FAT over each mirror
+    TraceSpan span("fat_mirror_sync");
+    size_t FAT_size = m_bpb.FATSz * m_bpb.bytes_per_sector;
+    size_t range_offset = m_FAT_dirty_first_sector * m_bpb.bytes_per_sector;
+    size_t range_size = (m_FAT_dirty_last_sector - m_FAT_dirty_first_sector + 1) * m_bpb.bytes_per_sector;
+    uint64_t primary_FAT = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector;
+
+    // Mirror sectors are metadata like any other, so the caller's transaction logs and holds them
+    std::vector<uint8_t> buffer;
+    const uint8_t* range = m_device->view(primary_FAT + range_offset, range_size, buffer);
+    for (uint8_t i = 1; i < m_bpb.num_FATS; i++)
+        writeMetadata(primary_FAT + i * FAT_size + range_offset, range, range_size);
+
+    m_FAT_dirty_first_sector = UINT32_MAX;
+    m_FAT_dirty_last_sector = 0;
+    setVolumeClean(true);
+}
+
+uint32_t FileSystem::findFATMirrorDifference(uint8_t FAT_index, uint32_t first_sector)
+{
+    // The first sector from first_sector on where the mirror differs from the primary FAT, or FATSz if none
+    size_t FAT_size = m_bpb.FATSz * m_bpb.bytes_per_sector;
+    uint64_t primary_FAT = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector;
+    uint64_t mirror_FAT = primary_FAT + FAT_index * FAT_size;
+    std::vector<uint8_t> primary_buffer;
+    std::vector<uint8_t> mirror_buffer;
+
+    for (uint32_t sector = first_sector; sector < m_bpb.FATSz; sector++)
     {
-        uint32_t FAT_sector = getFATSector(cluster);
-        uint32_t FAT_ent_offset = getFATEntOffset(cluster);
-        uint32_t FAT_entry_location =  (FAT_sector + (i * m_bpb.FATSz)) * m_bpb.bytes_per_sector + FAT_ent_offset;
+        size_t offset = sector * m_bpb.bytes_per_sector;
+        const uint8_t* primary_sector = m_device->view(primary_FAT + offset, m_bpb.bytes_per_sector, primary_buffer);
+        const uint8_t* mirror_sector = m_device->view(mirror_FAT + offset, m_bpb.bytes_per_sector, mirror_buffer);
+        if (memcmp(primary_sector, mirror_sector, m_bpb.bytes_per_sector) != 0)
+            return sector;
+    }
 
-        uint32_t FAT_entry = readFromFileSystem<uint32_t>(FAT_entry_location, 4);
+    return m_bpb.FATSz;
+}
 
-        value &= FAT_MASK;
-        FAT_entry &= ~FAT_MASK;
-        FAT_entry |= value;
+bool FileSystem::isVolumeClean()
+{
+    LittleEndian<uint32_t> FAT_entry_copy;
+    uint64_t FAT_entry_location = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector + 4;
+    return (*m_device->overlay(FAT_entry_location, FAT_entry_copy) & CLEAN_SHUTDOWN_BIT) != 0;
+}
 
-        writeToFileSystem<uint32_t>(FAT_entry, FAT_entry_location, 4);
+void FileSystem::setVolumeClean(bool clean)
+{
+    // The bit is written to every FAT, so it never makes a mirror differ from the primary FAT
+    size_t FAT_size = m_bpb.FATSz * m_bpb.bytes_per_sector;
+    uint64_t primary_FAT = (uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector;
+    for (uint8_t i = 0; i < m_bpb.num_FATS; i++)
+    {
+        LittleEndian<uint32_t> FAT_entry_copy;
+        uint64_t FAT_entry_location = primary_FAT + i * FAT_size + 4;
+        uint32_t FAT_entry = *m_device->overlay(FAT_entry_location, FAT_entry_copy);
+        uint32_t new_FAT_entry = clean ? (FAT_entry | CLEAN_SHUTDOWN_BIT) : (FAT_entry & ~CLEAN_SHUTDOWN_BIT);
+        if (new_FAT_entry != FAT_entry)
+            writeToFileSystem<uint32_t>(new_FAT_entry, FAT_entry_location);
     }
 }
 
+uint8_t FileSystem::getUpdatedFATCount()
+{
+    // With deferred synchronization only the primary FAT is kept current
+    return m_options.deferred_FAT_sync ? 1 : m_bpb.num_FATS;
+}
+
 void FileSystem::setFreeClusterCount(uint32_t count)
 {
     m_fsinfo.free_cluster_count = count;
-    writeToFileSystem<uint32_t>(count, m_bpb.fsinfo * m_bpb.bytes_per_sector + 488, 4);
+    writeToFileSystem<uint32_t>(count, m_bpb.fsinfo * m_bpb.bytes_per_sector + offsetof(FSInfoSectorView, free_cluster_count));
 }
 
-void FileSystem::updateFile(DirectoryEntry& file, uint32_t new_file_size, std::vector<uint32_t> cluster_chain)
+void FileSystem::setFirstFreeCluster(uint32_t cluster)
 {
-    uint16_t high_cluster = cluster_chain[0] >> 16;
-    uint16_t low_cluster = cluster_chain[0] & 0x0000FFFF;
+    if (cluster >= m_total_cluster_count)
+        cluster = 2;
 
-    // Create new file
-    DirectoryEntry new_file = file;
-    new_file.attribute |= ATTR_ARCHIVE;
-    new_file.cluster = formCluster(high_cluster, low_cluster);
-    new_file.size = new_file_size;
+    m_fsinfo.first_free_cluster = cluster;
+    writeToFileSystem<uint32_t>(cluster, m_bpb.fsinfo * m_bpb.bytes_per_sector + offsetof(FSInfoSectorView, first_free_cluster));
+}
 
-    // Remove old file and add new file to open file table
-    std::string mode = m_open_file_table[file];
-    m_open_file_table.erase(file);
-    m_open_file_table[new_file] = mode;
+void FileSystem::writeFSInfo()
+{
+    TraceSpan span("fsinfo_update");
+    setFreeClusterCount(m_fsinfo.free_cluster_count);
+    setFirstFreeCluster(m_fsinfo.first_free_cluster);
+}
+
+void FileSystem::updateFile(DirectoryEntry& file, uint32_t new_file_size, uint32_t first_cluster)
+{
+    TraceSpan span("update_entry");
+
+    // Update the open file, which is keyed by its unchanged slot location
+    file.attribute |= ATTR_ARCHIVE;
+    file.cluster = first_cluster;
+    file.size = new_file_size;
 
-    // Update file in memory
-    writeToFileSystem<uint16_t>(high_cluster, file.mem_location + 20, 2);
-    writeToFileSystem<uint16_t>(low_cluster, file.mem_location + 26, 2);
-    writeToFileSystem<uint32_t>(new_file.size, file.mem_location + 28, 4);
+    // Rewrite the entry from its first cluster field to its end in one write, keeping the time and date between
+    ShortEntryView entry;
+    m_device->read(file.mem_location, &entry, sizeof(entry));
+    entry.setCluster(file.cluster);
+    entry.size = file.size;
+
+    size_t start = offsetof(ShortEntryView, high_cluster);
+    writeMetadata(file.mem_location + start, reinterpret_cast<uint8_t*>(&entry) + start, sizeof(entry) - start);
 }
 
-void FileSystem::createDirectoryEntry(std::string entry_name, uint32_t cluster, uint8_t entry_type)
+bool FileSystem::createDirectoryEntry(std::string entry_name, uint32_t cluster, uint8_t entry_type)
 {
+    TraceSpan span("create_entry");
     // Get memory location to create directory entry
     uint32_t mem_location;
-    bool found_mem_location = false;
+
+    // The entry's own cluster comes first, so running out of space leaves nothing behind
+    uint32_t entry_cluster = allocateCluster();
+    if (entry_cluster == 0)
+        return false;
 
     if (entry_name != ROOT)
     {
-        // Find next available slot in directory to store file
-        std::vector<uint32_t> cluster_chain = getClusterChain(cluster);
+        std::shared_ptr<DirectoryIndex> index = getDirectoryIndex(cluster);
 
-        std::vector<uint32_t>::iterator iterator;
-        for (iterator = cluster_chain.begin(); iterator != cluster_chain.end(); iterator++)
+        // Grow the directory by a zeroed cluster when no slot is available
+        if (index->free_slots.empty())
         {
-            uint32_t sector = getFirstDataSector(*iterator) * m_bpb.bytes_per_sector;
-
-            for (int i = m_bytes_per_cluster - DIR_ENTRY_SIZE; i >= 0; i -= DIR_ENTRY_SIZE)
+            std::vector<ClusterExtent> extents = getClusterExtents(cluster);
+            uint32_t last_cluster = extents.back().start_cluster + extents.back().length - 1;
+            uint32_t directory_cluster = allocateCluster(last_cluster);
+            if (directory_cluster == 0)
             {
-                DirectoryEntry dir_entry = readDirectoryEntry(sector + i);
-                if (isFreeEntry(dir_entry))
-                {
-                    mem_location = sector + i;
-                    found_mem_location = true;
-                }
+                std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+                setFATEntry(entry_cluster, FREE_CLUSTER);
+                writeFSInfo();
+                return false;
             }
+
+            uint32_t sector = getFirstDataSector(directory_cluster) * m_bpb.bytes_per_sector;
+
+            fillMetadata(sector, 0, m_bytes_per_cluster);
+            for (uint32_t i = 0; i < m_bytes_per_cluster; i += DIR_ENTRY_SIZE)
+                index->free_slots.insert(sector + i);
         }
 
-        if (!found_mem_location)
-            mem_location = getFirstDataSector(allocateCluster(cluster_chain.back())) * m_bpb.bytes_per_sector;
+        mem_location = *index->free_slots.begin();
+        index->free_slots.erase(index->free_slots.begin());
+        index->entries[entry_name] = mem_location;
     }
 
     // Create directory entry
@@ -802,7 +1864,7 @@ void FileSystem::createDirectoryEntry(std::string entry_name, uint32_t cluster,
 
     dir_entry.name = entry_name;
     dir_entry.attribute = (entry_type == DIRECTORY) ? ATTR_DIRECTORY : ATTR_ARCHIVE;
-    dir_entry.cluster = allocateCluster();
+    dir_entry.cluster = entry_cluster;
     dir_entry.size = 0;
     dir_entry.mem_location = mem_location;
     setDirectoryEntryTime(dir_entry);
@@ -813,6 +1875,8 @@ void FileSystem::createDirectoryEntry(std::string entry_name, uint32_t cluster,
     //create . and .. files
     if (entry_type == DIRECTORY && entry_name != ROOT)
     {
+        fillMetadata((uint64_t)getFirstDataSector(dir_entry.cluster) * m_bpb.bytes_per_sector, 0, m_bytes_per_cluster);
+
         DirectoryEntry dot_dir_entry;
         DirectoryEntry dot_dot_dir_entry;
 
@@ -835,17 +1899,43 @@ void FileSystem::createDirectoryEntry(std::string entry_name, uint32_t cluster,
         writeDirectoryEntry(dot_dir_entry);
         writeDirectoryEntry(dot_dot_dir_entry);
     }
+
+    return true;
 }
 
 void FileSystem::deleteDirectoryEntry(std::string entry_name, uint32_t cluster, DirectoryEntry& dir_entry)
 {
-    std::vector<uint32_t> cluster_chain = getClusterChain(dir_entry.cluster);
+    TraceSpan span("delete_entry");
+    // Clear the '.' entry of a removed directory so it is no longer seen as live
+    if (isDirectory(dir_entry))
+        writeMetadata((uint64_t)getFirstDataSector(dir_entry.cluster) * m_bpb.bytes_per_sector, &FREE_DIR_ENTRY, 1);
 
-    std::vector<uint32_t>::reverse_iterator riterator;
-    for (riterator = cluster_chain.rbegin(); riterator != cluster_chain.rend(); riterator++)
+    std::vector<ClusterExtent> extents = getClusterExtents(dir_entry.cluster);
     {
-        setFATEntry(*riterator, FREE_CLUSTER);
-        setFreeClusterCount(m_fsinfo.free_cluster_count + 1);
+        std::lock_guard<std::recursive_mutex> lock(m_allocator_lock);
+
+        std::vector<ClusterExtent>::reverse_iterator riterator;
+        for (riterator = extents.rbegin(); riterator != extents.rend(); riterator++)
+        {
+            for (uint32_t i = riterator->length; i > 0; i--)
+                setFATEntry(riterator->start_cluster + i - 1, FREE_CLUSTER);
+        }
+        writeFSInfo();
+        Statistics::count(STAT_CLUSTERS_FREED, getChainLength(extents));
+    }
+
+    // Drop the index of a removed directory and free the slot in its parent's index
+    evictDentry(cluster, entry_name);
+    {
+        std::lock_guard<std::mutex> lock(m_directory_index_lock);
+        m_directory_index_cache.erase(dir_entry.cluster);
+
+        std::unordered_map<uint32_t, std::shared_ptr<DirectoryIndex> >::iterator indexed = m_directory_index_cache.find(cluster);
+        if (indexed != m_directory_index_cache.end())
+        {
+            indexed->second->entries.erase(entry_name);
+            indexed->second->free_slots.insert(dir_entry.mem_location);
+        }
     }
 
     dir_entry.name.clear();
@@ -922,13 +2012,14 @@ std::string FileSystem::convertFromShortName(std::string name)
 void FileSystem::setDirectoryEntryTime(DirectoryEntry& dir_entry)
 {
     time_t timer;
+    struct tm local_time_buffer;
     struct tm* local_time;
 
     uint16_t write_time;
     uint16_t write_date;
 
     time(&timer);
-    local_time = localtime(&timer);
+    local_time = localtime_r(&timer, &local_time_buffer);
 
     write_date = local_time->tm_mday;
     write_date |= ((local_time->tm_mon + 1) << 5);
@@ -945,22 +2036,19 @@ void FileSystem::setDirectoryEntryTime(DirectoryEntry& dir_entry)
 
 DirectoryEntry FileSystem::readDirectoryEntry(uint32_t location)
 {
-    DirectoryEntry dir_entry;
-
-    for (size_t j = 0; j < 11; j++)
-    {
-        char character = readFromFileSystem<char>(location + j, 1);
-            if (std::isspace(character) || std::ispunct(character) || std::isalnum(character))
-                dir_entry.name.push_back(character);
-    }
-    dir_entry.name = convertFromShortName(dir_entry.name);
-    dir_entry.attribute = readFromFileSystem<uint8_t>(location + 11, 1);
+    ShortEntryView entry_copy;
+    return decodeDirectoryEntry(*m_device->overlay(location, entry_copy), location);
+}
 
-    uint16_t high_cluster = readFromFileSystem<uint16_t>(location + 20, 2);
-    uint16_t low_cluster = readFromFileSystem<uint16_t>(location + 26, 2);
-    dir_entry.cluster = formCluster(high_cluster, low_cluster);
+DirectoryEntry FileSystem::decodeDirectoryEntry(const ShortEntryView& entry, uint32_t location)
+{
+    Statistics::count(STAT_DIR_ENTRIES_DECODED);
+    DirectoryEntry dir_entry;
 
-    dir_entry.size = readFromFileSystem<uint32_t>(location + 28, 4);
+    dir_entry.name = decodeShortName(entry.name);
+    dir_entry.attribute = entry.attribute;
+    dir_entry.cluster = entry.getCluster();
+    dir_entry.size = entry.size;
     dir_entry.mem_location = location;
 
     return dir_entry;
@@ -970,58 +2058,107 @@ void FileSystem::writeDirectoryEntry(DirectoryEntry& dir_entry)
 {
     std::string short_entry_name = convertToShortName(dir_entry.name);
 
-    for(int i = 0; i < 11; i++)
-        writeToFileSystem(short_entry_name[i], dir_entry.mem_location + i, 1);
-
-    writeToFileSystem(dir_entry.attribute, dir_entry.mem_location + 11, 1);
-    writeToFileSystem((uint8_t)0, dir_entry.mem_location + 13, 1);
-    writeToFileSystem((uint16_t)0, dir_entry.mem_location + 14, 2);
-    writeToFileSystem((uint16_t)0, dir_entry.mem_location + 16, 2);
-    writeToFileSystem((uint16_t)0, dir_entry.mem_location + 18, 2);
-    uint16_t high_cluster = (dir_entry.cluster & 0xFFFF0000) >> 4;
-    writeToFileSystem(high_cluster, dir_entry.mem_location + 20, 2);
-    writeToFileSystem(dir_entry.write_time, dir_entry.mem_location + 22, 2);
-    writeToFileSystem(dir_entry.write_date, dir_entry.mem_location + 24, 2);
-    uint16_t low_cluster = (dir_entry.cluster & 0x0000FFFF);
-    writeToFileSystem(low_cluster, dir_entry.mem_location + 26, 2);
-    writeToFileSystem(dir_entry.size, dir_entry.mem_location + 28, 4);
-}
-
-uint32_t FileSystem::formCluster(uint16_t high_cluster, uint16_t low_cluster)
-{
-    return (((uint32_t)low_cluster) | high_cluster << 16);
+    // Build the slot and write it at once; the reserved byte after the attribute is kept
+    ShortEntryView entry;
+    m_device->read(dir_entry.mem_location, &entry, sizeof(entry));
+
+    memcpy(entry.name, short_entry_name.data(), sizeof(entry.name));
+    entry.attribute = dir_entry.attribute;
+    entry.create_time_tenth = 0;
+    entry.create_time = 0;
+    entry.create_date = 0;
+    entry.access_date = 0;
+    entry.setCluster(dir_entry.cluster);
+    entry.write_time = dir_entry.write_time;
+    entry.write_date = dir_entry.write_date;
+    entry.size = dir_entry.size;
+
+    writeMetadata(dir_entry.mem_location, &entry, sizeof(entry));
 }
 
 bool FileSystem::findDirectoryEntry(std::string dir_entry_name, uint32_t cluster, DirectoryEntry& dir_entry)
 {
-    if (dir_entry_name == ROOT || dir_entry_name == "." || dir_entry_name == "..")
+    if (dir_entry_name == ROOT)
     {
-        dir_entry.name = ROOT;
-        dir_entry.attribute |= ATTR_DIRECTORY;
-        dir_entry.cluster = m_bpb.root_cluster;
-        dir_entry.size = 0;
+        dir_entry = getRootDirectoryEntry();
         return true;
     }
 
-    if (dir_entry_name == m_current_directory_name)
+    // The first lookup in a directory without an index compares the encoded name
+    // against every slot, decoding only the matches; a second lookup builds the index
+    std::shared_ptr<DirectoryIndex> index;
+    bool scan_slots = false;
     {
-        dir_entry.name = m_current_directory_name;
-        dir_entry.attribute |= ATTR_DIRECTORY;
-        dir_entry.cluster = m_current_directory_cluster;
-        return true;
+        std::lock_guard<std::mutex> lock(m_directory_index_lock);
+
+        std::unordered_map<uint32_t, std::shared_ptr<DirectoryIndex> >::iterator cached = m_directory_index_cache.find(cluster);
+        if (cached != m_directory_index_cache.end())
+            index = cached->second;
+        else
+        {
+            if (m_scanned_directories.size() >= MAX_INDEXED_DIRECTORIES)
+                m_scanned_directories.clear();
+            scan_slots = m_scanned_directories.insert(cluster).second;
+        }
     }
 
-    std::list<DirectoryEntry> dir_entry_list = getDirectoryEntries(cluster);
+    if (scan_slots && findShortName(dir_entry_name, cluster, dir_entry))
+        return true;
+
+    // Names not found by their encoded form may still decode to dir_entry_name, so the index decides
+    if (!index)
+        index = getDirectoryIndex(cluster);
 
-    std::list<DirectoryEntry>::iterator iterator;
-    for(iterator = dir_entry_list.begin(); iterator != dir_entry_list.end(); iterator++)
+    std::unordered_map<std::string, uint32_t>::iterator indexed = index->entries.find(dir_entry_name);
+    if (indexed == index->entries.end())
+        return false;
+
+    dir_entry = readDirectoryEntry(indexed->second);
+    return true;
+}
+
+bool FileSystem::findShortName(std::string dir_entry_name, uint32_t cluster, DirectoryEntry& dir_entry)
+{
+    TraceSpan span("directory_match");
+    std::string short_name = convertToShortName(dir_entry_name);
+    std::vector<ClusterExtent> extents = getClusterExtents(cluster);
+    uint32_t slot_count = m_bytes_per_cluster / DIR_ENTRY_SIZE;
+    std::vector<uint64_t> matches;
+    DirectorySlotMasks masks;
+    std::vector<uint8_t> buffer;
+
+    std::vector<ClusterExtent>::const_iterator iterator;
+    for (iterator = extents.begin(); iterator != extents.end(); iterator++)
     {
-        if (iterator->name == dir_entry_name)
+        for (uint32_t j = 0; j < iterator->length; j++)
         {
-            dir_entry = *iterator;
-            return true;
+            uint32_t sector = getFirstDataSector(iterator->start_cluster + j) * m_bpb.bytes_per_sector;
+            const uint8_t* slots = m_device->view(sector, m_bytes_per_cluster, buffer);
+
+            matchShortName(slots, slot_count, short_name, matches);
+            std::vector<uint64_t>::const_iterator word = std::find_if(matches.begin(), matches.end(),
+                                                                      [](uint64_t bits) { return bits != 0; });
+            if (word == matches.end())
+                continue;
+
+            scanDirectorySlots(slots, slot_count, masks);
+            for (size_t k = word - matches.begin(); k < matches.size(); k++)
+            {
+                uint64_t live_matches = matches[k] & ~masks.free[k] & ~masks.long_name[k];
+                for (uint32_t i = k * 64; live_matches != 0; i++, live_matches >>= 1)
+                {
+                    if (!(live_matches & 1))
+                        continue;
+
+                    // Case folding and padding can match names that decode differently
+                    dir_entry = decodeDirectoryEntry(reinterpret_cast<const ShortEntryView*>(slots)[i], sector + i * DIR_ENTRY_SIZE);
+                    if (dir_entry.name == dir_entry_name)
+                        return true;
+                }
+            }
         }
     }
+
     return false;
 }
 
@@ -1030,13 +2167,8 @@ bool FileSystem::directoryEntryExists(std::string dir_entry_name, uint32_t clust
     if (dir_entry_name == ROOT)
         return true;
 
-    std::list<DirectoryEntry> dir_entry_list = getDirectoryEntries(cluster);
-
-    std::list<DirectoryEntry>::iterator iterator;
-    for(iterator = dir_entry_list.begin(); iterator != dir_entry_list.end(); iterator++)
-        if (iterator->name == dir_entry_name)
-            return true;
-    return false;
+    std::shared_ptr<DirectoryIndex> index = getDirectoryIndex(cluster);
+    return (index->entries.find(dir_entry_name) != index->entries.end());
 }
 
 bool FileSystem::isFile(const DirectoryEntry& dir_entry) const
@@ -1061,12 +2193,272 @@ bool FileSystem::isFreeEntry(const DirectoryEntry& dir_entry) const
 
 bool FileSystem::isFreeCluster(uint32_t cluster)
 {
-    return (getFATEntry(cluster) == FREE_CLUSTER);
+    // The bitmap decides; a cluster whose free is waiting for the journal is not free yet
+    return (m_free_cluster_bitmap[cluster / 64] >> (cluster % 64)) & 1;
 }
 
-bool FileSystem::isValidEntryName(std::string entry_name)
+std::vector<std::string> FileSystem::splitPath(std::string path)
 {
-    return (entry_name.find("/") == std::string::npos || (entry_name.find( "/") == 0 && entry_name.length() == 1));
+    std::vector<std::string> components;
+    std::string component;
+
+    for (size_t i = 0; i <= path.length(); i++)
+    {
+        if (i == path.length() || path[i] == '/')
+        {
+            if (!component.empty())
+                components.push_back(component);
+            component.clear();
+        }
+        else
+            component.push_back(path[i]);
+    }
+
+    return components;
+}
+
+std::string FileSystem::normalizePath(std::string path)
+{
+    std::vector<std::string> components;
+    if (path.empty() || path[0] != '/')
+        components = splitPath(getCurrentDirectoryName());
+
+    std::vector<std::string> path_components = splitPath(path);
+    std::vector<std::string>::iterator iterator;
+    for (iterator = path_components.begin(); iterator != path_components.end(); iterator++)
+    {
+        if (*iterator == "..")
+        {
+            if (!components.empty())
+                components.pop_back();
+        }
+        else if (*iterator != ".")
+            components.push_back(*iterator);
+    }
+
+    std::string normalized_path;
+    for (iterator = components.begin(); iterator != components.end(); iterator++)
+        normalized_path += ROOT + *iterator;
+
+    return normalized_path.empty() ? ROOT : normalized_path;
+}
+
+bool FileSystem::resolveParentDirectory(std::string path, uint32_t& parent_cluster, std::string& entry_name)
+{
+    if (path.empty())
+        return false;
+
+    uint32_t cluster = m_bpb.root_cluster;
+    if (path[0] != '/')
+    {
+        std::lock_guard<std::mutex> lock(m_current_directory_lock);
+        cluster = m_current_directory_cluster;
+    }
+
+    std::vector<std::string> components = splitPath(path);
+
+    // A path made only of slashes names the root directory
+    if (components.empty())
+    {
+        parent_cluster = m_bpb.root_cluster;
+        entry_name = ROOT;
+        return true;
+    }
+
+    entry_name = components.back();
+    components.pop_back();
+
+    // Walk every intermediate component, each of which must be a directory
+    std::vector<std::string>::iterator iterator;
+    for (iterator = components.begin(); iterator != components.end(); iterator++)
+    {
+        DirectoryEntry directory;
+        if (!lookupDirectoryEntry(cluster, *iterator, directory) || !isDirectory(directory))
+            return false;
+        cluster = directory.cluster;
+    }
+
+    parent_cluster = cluster;
+    return true;
+}
+
+bool FileSystem::resolvePath(std::string path, DirectoryEntry& dir_entry)
+{
+    TraceSpan span("path_lookup");
+    uint32_t parent_cluster;
+    std::string entry_name;
+
+    if (!resolveParentDirectory(path, parent_cluster, entry_name))
+        return false;
+
+    return lookupDirectoryEntry(parent_cluster, entry_name, dir_entry);
+}
+
+bool FileSystem::lookupDirectoryEntry(uint32_t cluster, std::string dir_entry_name, DirectoryEntry& dir_entry)
+{
+    if (dir_entry_name == ROOT || (cluster == m_bpb.root_cluster && (dir_entry_name == "." || dir_entry_name == "..")))
+    {
+        dir_entry = getRootDirectoryEntry();
+        return true;
+    }
+
+    if (dir_entry_name == ".")
+    {
+        dir_entry.name = dir_entry_name;
+        dir_entry.attribute = ATTR_DIRECTORY;
+        dir_entry.cluster = cluster;
+        dir_entry.size = 0;
+        dir_entry.mem_location = 0;
+        return true;
+    }
+
+    ReadLock lock(getDirectoryLock(cluster));
+
+    if (dir_entry_name == "..")
+    {
+        if (!findDirectoryEntry(dir_entry_name, cluster, dir_entry))
+            return false;
+
+        // A '..' entry refers to the root directory with cluster 0
+        if (dir_entry.cluster == 0 || dir_entry.cluster == m_bpb.root_cluster)
+            dir_entry = getRootDirectoryEntry();
+        return true;
+    }
+
+    // Check the dentry cache, making sure the slot still holds the name
+    DentryKey key(cluster, dir_entry_name);
+    uint32_t cached_location = 0;
+    bool is_cached = false;
+    {
+        std::lock_guard<std::mutex> dentry_lock(m_dentry_cache_lock);
+        std::unordered_map<DentryKey, std::list<std::pair<DentryKey, uint32_t> >::iterator, DentryKeyHash>::iterator cached = m_dentry_cache.find(key);
+
+        if (cached != m_dentry_cache.end())
+        {
+            m_dentry_lru.splice(m_dentry_lru.begin(), m_dentry_lru, cached->second);
+            cached_location = cached->second->second;
+            is_cached = true;
+        }
+    }
+
+    if (is_cached)
+    {
+        dir_entry = readDirectoryEntry(cached_location);
+        if (!isFreeEntry(dir_entry) && dir_entry.name == dir_entry_name)
+            return true;
+
+        evictDentry(cluster, dir_entry_name);
+    }
+
+    if (!findDirectoryEntry(dir_entry_name, cluster, dir_entry))
+        return false;
+
+    // Remember the slot, evicting the least recently used entry if full
+    std::lock_guard<std::mutex> dentry_lock(m_dentry_cache_lock);
+    if (m_dentry_cache.find(key) != m_dentry_cache.end())
+        return true;
+
+    if (m_dentry_cache.size() >= MAX_CACHED_DENTRIES)
+    {
+        m_dentry_cache.erase(m_dentry_lru.back().first);
+        m_dentry_lru.pop_back();
+    }
+
+    m_dentry_lru.push_front(std::make_pair(key, dir_entry.mem_location));
+    m_dentry_cache[key] = m_dentry_lru.begin();
+
+    return true;
+}
+
+void FileSystem::evictDentry(uint32_t cluster, std::string dir_entry_name)
+{
+    std::lock_guard<std::mutex> lock(m_dentry_cache_lock);
+    std::unordered_map<DentryKey, std::list<std::pair<DentryKey, uint32_t> >::iterator, DentryKeyHash>::iterator cached = m_dentry_cache.find(DentryKey(cluster, dir_entry_name));
+
+    if (cached != m_dentry_cache.end())
+    {
+        m_dentry_lru.erase(cached->second);
+        m_dentry_cache.erase(cached);
+    }
+}
+
+std::shared_ptr<OpenFile> FileSystem::findOpenFile(std::string file_name)
+{
+    DirectoryEntry file;
+    if (!resolvePath(file_name, file))
+        return std::shared_ptr<OpenFile>();
+
+    std::lock_guard<std::mutex> lock(m_open_file_table_lock);
+
+    std::map<DirectoryEntry, std::shared_ptr<OpenFile> >::iterator iterator = m_open_file_table.find(file);
+    if (iterator == m_open_file_table.end())
+        return std::shared_ptr<OpenFile>();
+
+    return iterator->second;
+}
+
+DirectoryEntry FileSystem::getRootDirectoryEntry()
+{
+    DirectoryEntry dir_entry;
+
+    dir_entry.name = ROOT;
+    dir_entry.attribute = ATTR_DIRECTORY;
+    dir_entry.write_time = 0;
+    dir_entry.write_date = 0;
+    dir_entry.cluster = m_bpb.root_cluster;
+    dir_entry.size = 0;
+    dir_entry.mem_location = 0;
+
+    return dir_entry;
+}
+
+void FileSystem::runStatisticsDump()
+{
+    std::unique_lock<std::mutex> lock(m_stats_lock);
+    std::chrono::seconds interval(std::max<uint32_t>(1, m_options.stats_interval));
+
+    while (!m_stats_stopping)
+    {
+        m_stats_condition.wait_for(lock, interval);
+        Statistics::writePrometheus(m_options.stats_file);
+    }
+}
+
+void FileSystem::runFlusher()
+{
+    std::unique_lock<std::mutex> lock(m_flush_lock);
+
+    while (!m_flush_stopping)
+    {
+        // Without an interval only the dirty limit wakes the flusher
+        if (m_options.flush_interval != 0)
+            m_flush_condition.wait_for(lock, std::chrono::seconds(m_options.flush_interval),
+                                       [this]() { return m_flush_stopping || m_flush_requested; });
+        else
+            m_flush_condition.wait(lock, [this]() { return m_flush_stopping || m_flush_requested; });
+
+        if (m_flush_stopping)
+            break;
+        m_flush_requested = false;
+
+        // Writers keep going while the flush runs; if they are past the limit again by the
+        // end, the limit will not be crossed again, so flush again straight away
+        lock.unlock();
+        flushDevice();
+        lock.lock();
+
+        uint64_t dirty_limit = (uint64_t)m_options.flush_dirty_MB << 20;
+        if (dirty_limit != 0 && m_device->getDirtyBytes() >= dirty_limit)
+            m_flush_requested = true;
+    }
+}
+
+uint64_t FileSystem::flushDevice()
+{
+    TraceSpan span("flush");
+    uint64_t flushed_bytes = m_journal ? m_journal->checkpoint() : m_device->flush();
+    Statistics::count(STAT_BYTES_FLUSHED, flushed_bytes);
+    return flushed_bytes;
 }
 
 // *********************************************************
@@ -1077,5 +2469,11 @@ bool FileSystem::isValidEntryName(std::string entry_name)
 
 bool FAT_FS::operator<(const DirectoryEntry& left, const DirectoryEntry& right)
 {
-    return operator<(left.name, right.name);
+    // Entries are identified by their slot, since names repeat across directories
+    return (left.mem_location < right.mem_location);
+}
+
+size_t FAT_FS::DentryKeyHash::operator()(const DentryKey& key) const
+{
+    return (std::hash<std::string>()(key.second) * 31) ^ key.first;
 }
@@ -6,6 +6,24 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include "rwlock.h"
+#include "workpool.h"
+#include "dirscan.h"
+#include "fatscan.h"
+#include "blockdevice.h"
+#include "ondisk.h"
+#include "journal.h"
+#include "stats.h"
 
 using namespace std;
 
@@ -41,10 +59,24 @@ namespace FAT_FS
     const uint8_t ATTR_LONG = ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID;
 
     const uint32_t FAT_MASK = 0x0FFFFFFF;
+
+    // Set in FAT[1] while the volume is cleanly unmounted
+    const uint32_t CLEAN_SHUTDOWN_BIT = 0x08000000;
     const uint32_t FREE_CLUSTER = 0x00000000;
     const uint32_t EOC = 0x0FFFFFF8;
     const uint32_t DIR_ENTRY_SIZE = 0x20;
 
+    const size_t MAX_CACHED_CLUSTER_CHAINS = 1024;
+    const size_t MAX_INDEXED_DIRECTORIES = 256;
+    const size_t MAX_CACHED_DENTRIES = 4096;
+    const size_t DIRECTORY_LOCK_COUNT = 64;
+
+    // Bytes of a file advised ahead of a sequential reader
+    const uint32_t READAHEAD_BYTES = 1 << 20;
+
+    // Bytes read copies out per batch when the device has no mapping
+    const uint32_t READ_CHUNK_BYTES = 4 << 20;
+
     struct BIOSParameterBlock
     {
         uint8_t sectors_per_cluster;
@@ -57,6 +89,36 @@ namespace FAT_FS
         uint32_t root_cluster;
     };
 
+    struct MountOptions
+    {
+        MountOptions() : deferred_FAT_sync(false), stats_interval(10), populate(false), huge_pages(false), lock_FAT(false),
+                         backend(BLOCK_DEVICE_MMAP), cache_MB(64), flush_interval(0), flush_dirty_MB(0) {}
+
+        bool deferred_FAT_sync;
+
+        // Statistics are dumped in Prometheus text format every stats_interval seconds when stats_file is set
+        std::string stats_file;
+        uint32_t stats_interval;
+
+        // Fault the whole image in at mount, ask for transparent huge pages, and pin the FATs in memory
+        bool populate;
+        bool huge_pages;
+        bool lock_FAT;
+
+        // How the image is reached: mapped, or through pread/pwrite and a block cache of cache_MB megabytes
+        BlockDeviceType backend;
+        uint32_t cache_MB;
+
+        // Written data is flushed to disk in the background every flush_interval seconds and
+        // whenever flush_dirty_MB megabytes are waiting; zero turns either trigger off
+        uint32_t flush_interval;
+        uint32_t flush_dirty_MB;
+
+        // Metadata changes are logged to journal_file ahead of the image when it is set,
+        // and whatever a crash left there is replayed at mount; needs a cached backend
+        std::string journal_file;
+    };
+
     struct FSInfo
     {
         uint32_t free_cluster_count;
@@ -74,76 +136,253 @@ namespace FAT_FS
         uint32_t mem_location;
     };
 
+    struct OpenFile
+    {
+        OpenFile() : next_read_pos(0), readahead_end(0) {}
+
+        DirectoryEntry file;
+        std::string mode;
+        ReadWriteLock lock;
+
+        // Where a sequential read would start next, and how far ahead of it the data was advised
+        std::atomic<uint32_t> next_read_pos;
+        std::atomic<uint32_t> readahead_end;
+    };
+
+    struct ClusterExtent
+    {
+        uint32_t start_cluster;
+        uint32_t length;
+        uint32_t chain_index;
+    };
+
+    struct DirectoryIndex
+    {
+        std::unordered_map<std::string, uint32_t> entries;
+        std::set<uint32_t> free_slots;
+    };
+
+    struct FreeRun
+    {
+        uint32_t start_cluster;
+        uint32_t length;
+    };
+
+    struct DataSpan
+    {
+        uint64_t offset;
+        size_t length;
+    };
+
+    // A directory reached by a tree walk. Its totals cover everything below
+    // it once finish_directory is called for it.
+    struct TreeWalkNode
+    {
+        std::shared_ptr<TreeWalkNode> parent;
+        std::string path;
+        uint32_t cluster;
+        std::atomic<uint32_t> pending;
+        std::atomic<uint64_t> total_size;
+        std::atomic<uint64_t> total_usage;
+        std::atomic<uint64_t> file_count;
+        std::atomic<uint64_t> directory_count;
+    };
+
+    // Callbacks of a tree walk, called from any walker thread
+    struct TreeWalkVisitor
+    {
+        std::function<void(const TreeWalkNode& node, const std::list<DirectoryEntry>& entries)> visit_directory;
+        std::function<void(const TreeWalkNode& node)> finish_directory;
+    };
+
+    // Entries find reports; an entry must have every required attribute and none of the excluded ones
+    struct FindFilter
+    {
+        FindFilter() : min_size(0), max_size(UINT32_MAX), required_attributes(0), excluded_attributes(0) {}
+
+        std::string name_pattern;
+        uint64_t min_size;
+        uint64_t max_size;
+        uint8_t required_attributes;
+        uint8_t excluded_attributes;
+    };
+
+    typedef std::pair<uint32_t, std::string> DentryKey;
+
+    struct DentryKeyHash
+    {
+        size_t operator()(const DentryKey& key) const;
+    };
+
     bool operator<(const DirectoryEntry& left, const DirectoryEntry& right);
 
+    // Defined in treewalk.cpp
+    std::string joinTreePath(const std::string& path, const std::string& name);
+
+    // Defined in fsck.cpp
+    struct FsckState;
+    struct FsckChain;
+
     class FileSystem
     {
         public:
-            FileSystem(std::string file_system_image);
+            FileSystem(std::string file_system_image, MountOptions options = MountOptions());
             ~FileSystem();
 
-            std::string getCurrentDirectoryName() { return m_current_directory_name; };
+            std::string getCurrentDirectoryName();
             bool hasError() { return m_error; }
 
-            void fsinfo();
-            void open(std::string file_name, std::string mode);
-            void close(std::string file_name);
-            void create(std::string file_name);
-            void read(std::string file_name, uint32_t start_pos, uint32_t num_bytes);
-            void write(std::string file_name, uint32_t start_pos, std::string quoted_data);
-            void rm(std::string file_name);
-            void cd(std::string dir_name);
-            void ls(std::string dir_name);
-            void mkdir(std::string dir_name);
-            void rmdir(std::string dir_name);
-            void size(std::string entry_name);
-            void undelete();
+            bool fsinfo();
+            bool open(std::string file_name, std::string mode);
+            bool close(std::string file_name);
+            bool create(std::string file_name);
+            bool read(std::string file_name, uint32_t start_pos, uint32_t num_bytes);
+            bool write(std::string file_name, uint32_t start_pos, std::string quoted_data);
+            bool rm(std::string file_name);
+            bool cd(std::string dir_name);
+            bool ls(std::string dir_name);
+            bool mkdir(std::string dir_name);
+            bool rmdir(std::string dir_name);
+            bool size(std::string entry_name);
+            bool undelete();
+            bool sync();
+            bool fatcheck();
+            bool fsck(bool repair);
+            bool du(std::string dir_name, bool summary_only);
+            bool find(std::string dir_name, const FindFilter& filter);
+            bool defrag(std::string path, uint32_t max_MB_per_second);
+            bool fraginfo(uint32_t worst_file_count);
+            bool stats();
+            bool trace(std::string action, std::string file_name);
         private:
             template<typename T>
-            T readFromFileSystem(size_t offset, size_t bytes);
-            template<typename T>
-            void writeToFileSystem(T data, size_t offset, size_t bytes);
+            void writeToFileSystem(T data, size_t offset);
+            void writeMetadata(uint64_t offset, const void* data, uint64_t length);
+            void fillMetadata(uint64_t offset, uint8_t value, uint64_t length);
             std::list<DirectoryEntry> getDirectoryEntries(uint32_t cluster);
             std::vector<uint32_t> getClusterChain(uint32_t cluster);
-            uint32_t resizeClusterChain(uint32_t size, std::vector<uint32_t>& cluster_chain);
+            std::vector<ClusterExtent> getClusterExtents(uint32_t cluster);
+            void invalidateClusterExtents();
+            uint32_t getChainLength(const std::vector<ClusterExtent>& extents);
+            uint32_t getClusterAt(const std::vector<ClusterExtent>& extents, uint32_t chain_index);
+            size_t findExtent(const std::vector<ClusterExtent>& extents, uint32_t chain_index);
+            std::vector<DataSpan> getDataSpans(uint32_t first_cluster, uint32_t start_pos, uint32_t num_bytes);
+            void readAhead(OpenFile& open_file, const DirectoryEntry& file, uint32_t start_pos, uint32_t num_bytes);
+            uint32_t resizeClusterChain(uint32_t first_cluster, uint32_t size);
+            std::vector<uint32_t> reserveClusters(uint32_t count, uint32_t last_cluster = 0);
+            bool findFreeRuns(uint32_t count, std::vector<FreeRun>& runs);
+            uint32_t getFreeRunLength(uint32_t cluster);
+            void linkClusters(uint32_t previous_cluster, const std::vector<uint32_t>& clusters);
             uint32_t allocateCluster(uint32_t cluster = 0);
             uint32_t getDirectoryCluster(std::string dir_name);
+            std::shared_ptr<DirectoryIndex> getDirectoryIndex(uint32_t cluster);
+            ReadWriteLock& getDirectoryLock(uint32_t cluster);
+            bool isLiveDirectory(uint32_t cluster);
             uint32_t getFirstDataSector(uint32_t cluster);
             uint32_t getFATEntry(uint32_t cluster);
             uint32_t getFATSector(uint32_t cluster);
             uint32_t getFATEntOffset(uint32_t cluster);
             uint32_t getFreeCluster();
+            uint32_t findFreeCluster(uint32_t start_cluster);
+            uint32_t buildFreeClusterBitmap();
+            void markClusterFree(uint32_t cluster, bool is_free);
+            bool releaseCluster(uint32_t cluster);
             void setFATEntry(uint32_t cluster, uint32_t value);
+            void writeFATEntry(uint8_t FAT_index, uint32_t cluster, uint32_t value);
+            void markFATDirty(uint32_t cluster);
+            void syncFATMirrors();
+            uint32_t findFATMirrorDifference(uint8_t FAT_index, uint32_t first_sector);
+            bool isVolumeClean();
+            void setVolumeClean(bool clean);
+            uint8_t getUpdatedFATCount();
             void setFreeClusterCount(uint32_t count);
-            void updateFile(DirectoryEntry& dir_entry, uint32_t increased_file_size, std::vector<uint32_t> cluster_chain);
-            void createDirectoryEntry(std::string entry_name, uint32_t cluster, uint8_t entry_type);
+            void setFirstFreeCluster(uint32_t cluster);
+            void writeFSInfo();
+            void updateFile(DirectoryEntry& dir_entry, uint32_t increased_file_size, uint32_t first_cluster);
+            bool createDirectoryEntry(std::string entry_name, uint32_t cluster, uint8_t entry_type);
             void deleteDirectoryEntry(std::string entry_name, uint32_t cluster, DirectoryEntry& dir_entry);
 
             std::string convertToShortName(std::string name);
             std::string convertFromShortName(std::string name);
             DirectoryEntry readDirectoryEntry(uint32_t sector);
+            DirectoryEntry decodeDirectoryEntry(const ShortEntryView& entry, uint32_t location);
             void writeDirectoryEntry(DirectoryEntry& dir_entry);
             void setDirectoryEntryTime(DirectoryEntry& dir_entry);
-            uint32_t formCluster(uint16_t high_cluster, uint16_t low_cluster);
             bool findDirectoryEntry(std::string dir_entry_name, uint32_t cluster, DirectoryEntry& dir_entry);
+            bool findShortName(std::string dir_entry_name, uint32_t cluster, DirectoryEntry& dir_entry);
             bool directoryEntryExists(std::string dir_entry_name, uint32_t cluster);
             bool isFile(const DirectoryEntry& dir_entry) const;
             bool isDirectory(const DirectoryEntry& dir_entry) const;
             bool isLongName(const DirectoryEntry& dir_entry) const;
             bool isFreeEntry(const DirectoryEntry& dir_entry) const;
             bool isFreeCluster(uint32_t cluster);
-            bool isValidEntryName(std::string entry_name);
+            std::vector<std::string> splitPath(std::string path);
+            std::string normalizePath(std::string path);
+            bool resolveParentDirectory(std::string path, uint32_t& parent_cluster, std::string& entry_name);
+            bool resolvePath(std::string path, DirectoryEntry& dir_entry);
+            bool lookupDirectoryEntry(uint32_t cluster, std::string dir_entry_name, DirectoryEntry& dir_entry);
+            void evictDentry(uint32_t cluster, std::string dir_entry_name);
+            std::shared_ptr<OpenFile> findOpenFile(std::string file_name);
+            DirectoryEntry getRootDirectoryEntry();
+            void runStatisticsDump();
+            void runFlusher();
+            uint64_t flushDevice();
+            void walkTree(const DirectoryEntry& directory, std::string path, const TreeWalkVisitor& visitor);
+            void walkTreeDirectory(WorkStealingPool<std::shared_ptr<TreeWalkNode> >& pool, uint32_t worker_index,
+                                   const std::shared_ptr<TreeWalkNode>& node, const TreeWalkVisitor& visitor);
+            void finishTreeWalkNode(std::shared_ptr<TreeWalkNode> node, const TreeWalkVisitor& visitor);
+            bool defragFile(uint32_t parent_cluster, std::string file_name, uint32_t& moved_clusters);
+            void scanFsckFAT(FsckState& state, uint32_t worker_index);
+            void checkFsckDirectory(FsckState& state, uint32_t worker_index, uint32_t cluster, uint32_t length, std::string path);
+            bool walkFsckChain(FsckState& state, uint32_t worker_index, std::string path, FsckChain& chain);
+            void repairFsckErrors(FsckState& state, const std::vector<FsckChain>& repairs,
+                                  const std::set<uint32_t>& cross_linked_clusters, bool free_lost_clusters);
 
-            uint8_t* m_file_system_data;
-            size_t m_file_system_size;
+            std::unique_ptr<BlockDevice> m_device;
+            std::unique_ptr<Journal> m_journal;
             int m_file_descriptor;
             BIOSParameterBlock m_bpb;
             FSInfo m_fsinfo;
-            std::map<DirectoryEntry, std::string> m_open_file_table;
+            MountOptions m_options;
+            std::map<DirectoryEntry, std::shared_ptr<OpenFile> > m_open_file_table;
+            std::vector<uint64_t> m_free_cluster_bitmap;
+            std::vector<uint64_t> m_free_cluster_summary;
+            std::unordered_map<uint32_t, std::vector<ClusterExtent> > m_cluster_extent_cache;
+            std::unordered_map<uint32_t, std::shared_ptr<DirectoryIndex> > m_directory_index_cache;
+            std::unordered_set<uint32_t> m_scanned_directories;
+            std::list<std::pair<DentryKey, uint32_t> > m_dentry_lru;
+            std::unordered_map<DentryKey, std::list<std::pair<DentryKey, uint32_t> >::iterator, DentryKeyHash> m_dentry_cache;
+            uint64_t m_extent_cache_generation;
+
+            std::recursive_mutex m_allocator_lock;
+            std::mutex m_open_file_table_lock;
+            std::mutex m_extent_cache_lock;
+            std::mutex m_directory_index_lock;
+            std::mutex m_dentry_cache_lock;
+            std::mutex m_current_directory_lock;
+            ReadWriteLock m_directory_locks[DIRECTORY_LOCK_COUNT];
+
+            std::thread m_stats_thread;
+            std::mutex m_stats_lock;
+            std::condition_variable m_stats_condition;
+            bool m_stats_stopping;
+
+            std::thread m_flush_thread;
+            std::mutex m_flush_lock;
+            std::condition_variable m_flush_condition;
+            bool m_flush_stopping;
+            bool m_flush_requested;
 
             bool m_error;
+            bool m_FAT_locked;
             uint32_t m_bytes_per_cluster;
             uint32_t m_first_data_sector;
+            uint32_t m_total_cluster_count;
+            uint32_t m_stored_free_cluster_count;
+            uint32_t m_scanned_free_cluster_count;
+            std::chrono::steady_clock::duration m_free_cluster_scan_time;
+            uint32_t m_FAT_dirty_first_sector;
+            uint32_t m_FAT_dirty_last_sector;
             uint32_t m_current_directory_cluster;
             std::string m_current_directory_name;
     };
@@ -0,0 +1,471 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+using namespace FAT_FS;
+
+namespace FAT_FS
+{
+    const uint32_t BAD_CLUSTER = 0x0FFFFFF7;
+    const uint32_t UNKNOWN_FREE_COUNT = 0xFFFFFFFF;
+    const size_t MAX_REPORTED_FSCK_ERRORS = 1000;
+
+    // A directory waiting to be checked, and how many clusters of its chain are valid
+    struct FsckTask
+    {
+        uint32_t cluster;
+        uint32_t length;
+        std::string path;
+    };
+
+    // A cluster chain reached from the directory tree
+    struct FsckChain
+    {
+        uint64_t entry_location;
+        uint32_t id;
+        uint32_t first_cluster;
+        uint32_t length;
+        uint32_t keep_clusters;
+        uint32_t size;
+        uint32_t new_size;
+        bool complete;
+        bool cross_linked;
+    };
+
+    struct FsckWorker
+    {
+        std::vector<std::string> errors;
+        std::vector<FsckChain> repairs;
+        std::vector<uint32_t> cross_linked_clusters;
+        uint64_t free_cluster_count;
+        uint64_t entry_count;
+    };
+
+    struct FsckState
+    {
+        // The primary FAT as the check began; repairs never read back an entry they changed
+        const uint8_t* FAT;
+        std::vector<uint8_t> FAT_buffer;
+        uint32_t thread_count;
+        WorkStealingPool<FsckTask> pool;
+        std::unique_ptr<FsckWorker[]> workers;
+
+        // Per cluster: the chain that claimed it during the walk, and whether any FAT entry links to it
+        std::unique_ptr<std::atomic<uint32_t>[]> owners;
+        std::unique_ptr<std::atomic<bool>[]> linked;
+
+        std::atomic<uint32_t> next_chain_id;
+    };
+
+    uint32_t getFsckFATEntry(const FsckState& state, uint32_t cluster)
+    {
+        return reinterpret_cast<const LittleEndian<uint32_t>*>(state.FAT)[cluster] & FAT_MASK;
+    }
+}
+
+// *********************************************************
+// *********************************************************
+// *                  FILE SYSTEM CHECK                    *
+// *********************************************************
+// *********************************************************
+
+bool FileSystem::fsck(bool repair)
+{
+    CommandTimer timer(STAT_FSCK);
+
+    // Settle the frees the journal still defers, so the free count and bitmap match the FAT
+    // and a repair cannot hand out a cluster whose old metadata replay could still write
+    if (m_journal)
+        m_journal->checkpoint();
+
+    JournalTransaction transaction(repair ? m_journal.get() : NULL);
+
+    // Stop every other command while the image is checked, taking locks in the order commands do
+    for (size_t i = 0; i < DIRECTORY_LOCK_COUNT; i++)
+        m_directory_locks[i].lockWrite();
+
+    if (repair)
+    {
+        std::lock_guard<std::mutex> lock(m_open_file_table_lock);
+        if (!m_open_file_table.empty())
+        {
+            for (size_t i = DIRECTORY_LOCK_COUNT; i > 0; i--)
+                m_directory_locks[i - 1].unlock();
+
+            cout << "Error: close all files before repairing." << endl;
+            return false;
+        }
+    }
+
+    std::unique_lock<std::recursive_mutex> allocator_lock(m_allocator_lock);
+
+    FsckState state;
+    state.FAT = m_device->view((uint64_t)m_bpb.reserved_sector_count * m_bpb.bytes_per_sector,
+                               (uint64_t)m_total_cluster_count * 4, state.FAT_buffer);
+    state.thread_count = state.pool.getThreadCount();
+    state.workers.reset(new FsckWorker[state.thread_count]);
+    state.owners.reset(new std::atomic<uint32_t>[m_total_cluster_count]());
+    state.linked.reset(new std::atomic<bool>[m_total_cluster_count]());
+    state.next_chain_id = 1;
+
+    // Count free clusters and FAT links with one thread per chunk of the FAT
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < state.thread_count; i++)
+        threads.push_back(std::thread(&FileSystem::scanFsckFAT, this, std::ref(state), i));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    threads.clear();
+
+    // Claim the chain of every entry reachable from the root, stealing directories between threads
+    FsckChain root = FsckChain();
+    root.first_cluster = m_bpb.root_cluster;
+    walkFsckChain(state, 0, ROOT, root);
+    if (root.length > 0)
+    {
+        FsckTask task = { root.first_cluster, root.length, "" };
+        state.pool.push(0, task);
+
+        if (!root.complete)
+        {
+            root.keep_clusters = root.length;
+            state.workers[0].repairs.push_back(root);
+        }
+    }
+
+    {
+        TraceSpan span("fsck_walk_tree");
+        state.pool.run([this, &state](uint32_t worker_index, FsckTask& task) {
+            checkFsckDirectory(state, worker_index, task.cluster, task.length, task.path);
+        });
+    }
+
+    std::vector<std::string> errors;
+    std::vector<FsckChain> repairs;
+    std::set<uint32_t> cross_linked_clusters;
+    uint64_t free_cluster_count = 0;
+    uint64_t entry_count = 0;
+    for (uint32_t i = 0; i < state.thread_count; i++)
+    {
+        FsckWorker& worker = state.workers[i];
+        errors.insert(errors.end(), worker.errors.begin(), worker.errors.end());
+        repairs.insert(repairs.end(), worker.repairs.begin(), worker.repairs.end());
+        cross_linked_clusters.insert(worker.cross_linked_clusters.begin(), worker.cross_linked_clusters.end());
+        free_cluster_count += worker.free_cluster_count;
+        entry_count += worker.entry_count;
+    }
+
+    // Allocated clusters no chain claimed are lost; a lost cluster nothing links to starts a lost chain
+    uint64_t lost_cluster_count = 0;
+    uint64_t lost_chain_count = 0;
+    for (uint32_t cluster = 2; cluster < m_total_cluster_count; cluster++)
+    {
+        uint32_t value = getFsckFATEntry(state, cluster);
+        if (value == FREE_CLUSTER || value == BAD_CLUSTER || state.owners[cluster].load(std::memory_order_relaxed) != 0)
+            continue;
+
+        lost_cluster_count++;
+        if (!state.linked[cluster].load(std::memory_order_relaxed))
+            lost_chain_count++;
+    }
+
+    if (lost_cluster_count > 0)
+        errors.push_back("Error: " + std::to_string(lost_cluster_count) + " lost clusters in " +
+                         std::to_string(lost_chain_count) + " chains.");
+
+    FSInfoSectorView FSInfo_copy;
+    uint32_t FSInfo_free_count = m_device->overlay((uint64_t)m_bpb.fsinfo * m_bpb.bytes_per_sector, FSInfo_copy)->free_cluster_count;
+    bool FSInfo_wrong = (FSInfo_free_count != UNKNOWN_FREE_COUNT && FSInfo_free_count != free_cluster_count);
+    if (FSInfo_wrong)
+        errors.push_back("Error: FSInfo free cluster count is " + std::to_string(FSInfo_free_count) +
+                         " but " + std::to_string(free_cluster_count) + " clusters are free.");
+
+    // Sectors waiting for deferred synchronization differ from the mirrors until it runs
+    size_t stale_mirror_count = 0;
+    for (uint8_t i = 1; i < m_bpb.num_FATS; i++)
+    {
+        uint32_t sector = findFATMirrorDifference(i, 0);
+        if (sector >= m_FAT_dirty_first_sector && sector <= m_FAT_dirty_last_sector)
+            sector = findFATMirrorDifference(i, m_FAT_dirty_last_sector + 1);
+
+        if (sector < m_bpb.FATSz)
+        {
+            errors.push_back("Error: FAT " + std::to_string(i) + " differs from the primary FAT at sector " +
+                             std::to_string(sector) + ".");
+            stale_mirror_count++;
+        }
+    }
+
+    std::sort(errors.begin(), errors.end());
+    for (size_t i = 0; i < errors.size() && i < MAX_REPORTED_FSCK_ERRORS; i++)
+        cout << errors[i] << endl;
+    if (errors.size() > MAX_REPORTED_FSCK_ERRORS)
+        cout << "... and " << (errors.size() - MAX_REPORTED_FSCK_ERRORS) << " more errors." << endl;
+
+    size_t repaired_count = 0;
+    if (repair && !errors.empty())
+    {
+        // Clusters past a cross-link may belong to a directory that was not walked, so they are kept
+        bool free_lost_clusters = (lost_cluster_count > 0 && cross_linked_clusters.empty());
+        repairFsckErrors(state, repairs, cross_linked_clusters, free_lost_clusters);
+
+        // The primary FAT is the one checked and repaired, so it is copied over every mirror
+        if (stale_mirror_count > 0)
+        {
+            m_FAT_dirty_first_sector = 0;
+            m_FAT_dirty_last_sector = m_bpb.FATSz - 1;
+            syncFATMirrors();
+        }
+
+        repaired_count = repairs.size() + (free_lost_clusters ? 1 : 0) + (FSInfo_wrong ? 1 : 0) + stale_mirror_count;
+    }
+
+    allocator_lock.unlock();
+    for (size_t i = DIRECTORY_LOCK_COUNT; i > 0; i--)
+        m_directory_locks[i - 1].unlock();
+
+    cout << "Checked " << entry_count << " entries and " << (m_total_cluster_count - 2) << " clusters with "
+         << state.thread_count << " threads: ";
+    if (errors.empty())
+        cout << "no errors found." << endl;
+    else if (repair)
+        cout << errors.size() << " errors found, " << repaired_count << " repaired." << endl;
+    else
+        cout << errors.size() << " errors found." << endl;
+
+    return (errors.size() == repaired_count);
+}
+
+// *********************************************************
+// *********************************************************
+// *               FILE SYSTEM CHECK HELPERS               *
+// *********************************************************
+// *********************************************************
+
+void FileSystem::scanFsckFAT(FsckState& state, uint32_t worker_index)
+{
+    TraceSpan span("fsck_scan_fat");
+    FsckWorker& worker = state.workers[worker_index];
+
+    uint32_t chunk_size = (m_total_cluster_count + state.thread_count - 1) / state.thread_count;
+    uint32_t first_cluster = std::max<uint32_t>(2, worker_index * chunk_size);
+    uint32_t last_cluster = std::min<uint32_t>(m_total_cluster_count, (worker_index + 1) * chunk_size);
+
+    worker.free_cluster_count = 0;
+    worker.entry_count = 0;
+
+    for (uint32_t cluster = first_cluster; cluster < last_cluster; cluster++)
+    {
+        uint32_t value = getFsckFATEntry(state, cluster);
+        if (value == FREE_CLUSTER)
+            worker.free_cluster_count++;
+        else if (value >= 2 && value < m_total_cluster_count)
+            state.linked[value].store(true, std::memory_order_relaxed);
+    }
+}
+
+void FileSystem::checkFsckDirectory(FsckState& state, uint32_t worker_index, uint32_t cluster, uint32_t length, std::string path)
+{
+    FsckWorker& worker = state.workers[worker_index];
+    uint64_t bytes_per_cluster = m_bytes_per_cluster;
+    std::vector<uint8_t> buffer;
+
+    for (uint32_t i = 0; i < length; i++, cluster = getFsckFATEntry(state, cluster))
+    {
+        uint64_t sector_offset = (uint64_t)getFirstDataSector(cluster) * m_bpb.bytes_per_sector;
+        const uint8_t* data = m_device->view(sector_offset, bytes_per_cluster, buffer);
+        const ShortEntryView* entries = reinterpret_cast<const ShortEntryView*>(data);
+
+        // Deleted entries are zeroed rather than marking the end, so every slot is read
+        for (uint64_t offset = 0; offset < bytes_per_cluster; offset += DIR_ENTRY_SIZE)
+        {
+            const ShortEntryView& entry = entries[offset / DIR_ENTRY_SIZE];
+            uint8_t attribute = entry.attribute;
+
+            if (entry.name[0] == LAST_FREE_DIR_ENTRY || entry.name[0] == FREE_DIR_ENTRY || entry.name[0] == '.')
+                continue;
+            if ((attribute & ATTR_LONG) == ATTR_LONG || (attribute & ATTR_VOLUME_ID))
+                continue;
+
+            worker.entry_count++;
+
+            FsckChain chain = FsckChain();
+            chain.size = entry.size;
+            chain.entry_location = sector_offset + offset;
+            chain.first_cluster = entry.getCluster();
+            chain.new_size = chain.size;
+            chain.complete = true;
+
+            std::string entry_path = path + ROOT + convertFromShortName(std::string((const char*)entry.name, sizeof(entry.name)));
+            if (chain.first_cluster != 0)
+                walkFsckChain(state, worker_index, entry_path, chain);
+
+            // Cross-links are only reported, either chain may hold the data
+            if (chain.cross_linked)
+                continue;
+
+            if (attribute & ATTR_DIRECTORY)
+            {
+                if (chain.first_cluster == 0)
+                {
+                    worker.errors.push_back("Error: '" + entry_path + "' is a directory without clusters.");
+                    continue;
+                }
+
+                if (!chain.complete)
+                {
+                    chain.keep_clusters = chain.length;
+                    worker.repairs.push_back(chain);
+                }
+
+                if (chain.length > 0)
+                {
+                    FsckTask task = { chain.first_cluster, chain.length, entry_path };
+                    state.pool.push(worker_index, task);
+                }
+                continue;
+            }
+
+            // Files created empty keep the one cluster create gives them
+            uint64_t needed_clusters = (chain.size + bytes_per_cluster - 1) / bytes_per_cluster;
+            if (!chain.complete)
+            {
+                chain.keep_clusters = chain.length;
+                chain.new_size = std::min<uint64_t>(chain.size, chain.length * bytes_per_cluster);
+                worker.repairs.push_back(chain);
+            }
+            else if (chain.length < needed_clusters)
+            {
+                worker.errors.push_back("Error: '" + entry_path + "' has size " + std::to_string(chain.size) +
+                                        " but only " + std::to_string(chain.length) + " clusters.");
+                chain.keep_clusters = chain.length;
+                chain.new_size = chain.length * bytes_per_cluster;
+                worker.repairs.push_back(chain);
+            }
+            else if (chain.length > std::max<uint64_t>(needed_clusters, 1))
+            {
+                worker.errors.push_back("Error: '" + entry_path + "' has size " + std::to_string(chain.size) +
+                                        " but " + std::to_string(chain.length) + " clusters.");
+                chain.keep_clusters = std::max<uint64_t>(needed_clusters, 1);
+                worker.repairs.push_back(chain);
+            }
+        }
+    }
+}
+
+bool FileSystem::walkFsckChain(FsckState& state, uint32_t worker_index, std::string path, FsckChain& chain)
+{
+    FsckWorker& worker = state.workers[worker_index];
+    uint32_t cluster = chain.first_cluster;
+
+    chain.id = state.next_chain_id.fetch_add(1, std::memory_order_relaxed);
+    chain.length = 0;
+    chain.complete = false;
+    chain.cross_linked = false;
+
+    for (;;)
+    {
+        uint32_t value = (cluster >= 2 && cluster < m_total_cluster_count) ? getFsckFATEntry(state, cluster) : FREE_CLUSTER;
+        if (value == FREE_CLUSTER || value == BAD_CLUSTER)
+        {
+            worker.errors.push_back("Error: '" + path + "' links to invalid cluster " + std::to_string(cluster) +
+                                    " after " + std::to_string(chain.length) + " clusters.");
+            return false;
+        }
+
+        // Claim the cluster; one already claimed is either earlier in this chain or shared with another
+        uint32_t owner = 0;
+        if (!state.owners[cluster].compare_exchange_strong(owner, chain.id, std::memory_order_relaxed))
+        {
+            if (owner == chain.id)
+                worker.errors.push_back("Error: '" + path + "' loops back to cluster " + std::to_string(cluster) +
+                                        " after " + std::to_string(chain.length) + " clusters.");
+            else
+            {
+                worker.errors.push_back("Error: '" + path + "' is cross-linked at cluster " + std::to_string(cluster) + ".");
+                worker.cross_linked_clusters.push_back(cluster);
+                chain.cross_linked = true;
+            }
+            return false;
+        }
+
+        chain.length++;
+        if (value >= EOC)
+        {
+            chain.complete = true;
+            return true;
+        }
+
+        cluster = value;
+    }
+}
+
+void FileSystem::repairFsckErrors(FsckState& state, const std::vector<FsckChain>& repairs,
+                                  const std::set<uint32_t>& cross_linked_clusters, bool free_lost_clusters)
+{
+    std::vector<FsckChain>::const_iterator chain;
+    for (chain = repairs.begin(); chain != repairs.end(); chain++)
+    {
+        if (chain->keep_clusters == 0)
+        {
+            // Nothing of the chain is valid, so the entry becomes empty
+            fillMetadata(chain->entry_location + offsetof(ShortEntryView, high_cluster), 0, 2);
+            fillMetadata(chain->entry_location + offsetof(ShortEntryView, low_cluster), 0, 2);
+        }
+        else
+        {
+            uint32_t cluster = chain->first_cluster;
+            for (uint32_t i = 1; i < chain->keep_clusters; i++)
+                cluster = getFsckFATEntry(state, cluster);
+
+            uint32_t next_cluster = getFsckFATEntry(state, cluster);
+            setFATEntry(cluster, EOC);
+
+            // Only a complete chain has a tail of its own to free, and it ends where another chain joins it
+            while (chain->complete && next_cluster >= 2 && next_cluster < m_total_cluster_count &&
+                   state.owners[next_cluster].load(std::memory_order_relaxed) == chain->id &&
+                   cross_linked_clusters.count(next_cluster) == 0)
+            {
+                uint32_t following_cluster = getFsckFATEntry(state, next_cluster);
+                setFATEntry(next_cluster, FREE_CLUSTER);
+                state.owners[next_cluster].store(0, std::memory_order_relaxed);
+                next_cluster = following_cluster;
+            }
+        }
+
+        if (chain->new_size != chain->size)
+        {
+            LittleEndian<uint32_t> new_size = chain->new_size;
+            writeMetadata(chain->entry_location + offsetof(ShortEntryView, size), &new_size, sizeof(new_size));
+        }
+    }
+
+    if (free_lost_clusters)
+    {
+        for (uint32_t cluster = 2; cluster < m_total_cluster_count; cluster++)
+        {
+            uint32_t value = getFsckFATEntry(state, cluster);
+            if (value != FREE_CLUSTER && value != BAD_CLUSTER && state.owners[cluster].load(std::memory_order_relaxed) == 0)
+                setFATEntry(cluster, FREE_CLUSTER);
+        }
+    }
+
+    setFreeClusterCount(buildFreeClusterBitmap());
+    setFirstFreeCluster(findFreeCluster(2));
+
+    // Cached chains, directory indexes and lookups may describe the image before the repair
+    invalidateClusterExtents();
+    {
+        std::lock_guard<std::mutex> lock(m_directory_index_lock);
+        m_directory_index_cache.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_dentry_cache_lock);
+        m_dentry_cache.clear();
+        m_dentry_lru.clear();
+    }
+}
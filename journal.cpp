@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "stats.h"
+
+namespace FAT_FS
+{
+    const uint64_t JOURNAL_MAGIC = 0x314C4E4A444F4D46ULL;  // "FMODJNL1"
+    const uint32_t JOURNAL_RECORD_MAGIC = 0x4C4E524A;      // "JRNL"
+
+    // Starts the journal file and names the image it belongs to
+    struct JournalFileHeader
+    {
+        uint64_t magic;
+        uint64_t image_size;
+        uint32_t volume_id;
+        uint32_t reserved;
+        uint64_t reserved_2;
+    };
+
+    // Starts each committed transaction; the checksum covers the changes that follow
+    struct JournalRecordHeader
+    {
+        uint32_t magic;
+        uint32_t change_count;
+        uint64_t length;
+        uint64_t checksum;
+    };
+
+    // One change, followed by the bytes written unless it is a fill
+    struct JournalChange
+    {
+        uint64_t sequence;
+        uint64_t offset;
+        uint32_t length;
+        uint8_t fill;
+        uint8_t value;
+        uint16_t reserved;
+    };
+
+    // The transaction the calling thread has open
+    struct OpenTransaction
+    {
+        OpenTransaction() : journal(NULL), depth(0), change_count(0), last_change(0) {}
+
+        Journal* journal;
+        uint32_t depth;
+        std::vector<uint8_t> changes;
+        uint32_t change_count;
+
+        // Where the last change starts in changes, so a write continuing it can extend it
+        size_t last_change;
+        std::vector<std::function<void()> > actions;
+    };
+
+    thread_local OpenTransaction current_transaction;
+
+    // FNV-1a, enough to tell a record from one torn by a crash
+    uint64_t getChecksum(const uint8_t* data, uint64_t length, uint64_t hash = 0xCBF29CE484222325ULL)
+    {
+        for (uint64_t i = 0; i < length; i++)
+            hash = (hash ^ data[i]) * 0x100000001B3ULL;
+        return hash;
+    }
+
+    uint64_t getRecordChecksum(const JournalRecordHeader& header, const uint8_t* changes)
+    {
+        uint64_t hash = getChecksum((const uint8_t*)&header.change_count, sizeof(header.change_count));
+        hash = getChecksum((const uint8_t*)&header.length, sizeof(header.length), hash);
+        return getChecksum(changes, header.length, hash);
+    }
+
+    bool transferJournal(int file_descriptor, uint8_t* data, uint64_t length, uint64_t offset, bool write)
+    {
+        for (uint64_t done = 0; done < length; )
+        {
+            ssize_t count = write ? pwrite(file_descriptor, data + done, length - done, offset + done)
+                                  : pread(file_descriptor, data + done, length - done, offset + done);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            done += count;
+        }
+
+        return true;
+    }
+}
+
+using namespace FAT_FS;
+
+Journal::Journal(BlockDevice& device)
+    : m_device(device), m_file_descriptor(-1), m_open_transactions(0), m_checkpointing(false), m_pending_transactions(0),
+      m_next_change(0), m_journal_bytes(0), m_commit_requested(false), m_stopping(false), m_replayed_transactions(0),
+      m_committed_transactions(0), m_commits(0), m_checkpoints(0), m_failed_commits(0)
+{
+}
+
+Journal::~Journal()
+{
+    if (m_commit_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stopping = true;
+        }
+        m_commit_condition.notify_all();
+        m_commit_thread.join();
+    }
+
+    if (m_file_descriptor >= 0)
+    {
+        commit();
+        ::close(m_file_descriptor);
+    }
+}
+
+bool Journal::open(std::string path, uint32_t volume_id)
+{
+    m_path = path;
+    m_file_descriptor = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_file_descriptor < 0)
+        return false;
+
+    struct stat file_status;
+    if (fstat(m_file_descriptor, &file_status) != 0)
+        return false;
+
+    JournalFileHeader expected_header = { JOURNAL_MAGIC, m_device.getSize(), volume_id, 0, 0 };
+    if ((uint64_t)file_status.st_size >= sizeof(JournalFileHeader))
+    {
+        // Never replay, or empty, a journal written for another image
+        JournalFileHeader header;
+        if (!transferJournal(m_file_descriptor, (uint8_t*)&header, sizeof(header), 0, false) ||
+            memcmp(&header, &expected_header, sizeof(header)) != 0)
+            return false;
+
+        std::vector<uint8_t> records(file_status.st_size - sizeof(JournalFileHeader));
+        if (!transferJournal(m_file_descriptor, records.data(), records.size(), sizeof(JournalFileHeader), false))
+            return false;
+
+        replay(records);
+        if (m_replayed_transactions != 0)
+            m_device.flush();
+    }
+
+    // The image has everything the journal held, so start it over
+    if (!transferJournal(m_file_descriptor, (uint8_t*)&expected_header, sizeof(expected_header), 0, true) ||
+        ftruncate(m_file_descriptor, sizeof(JournalFileHeader)) != 0 || fdatasync(m_file_descriptor) != 0)
+        return false;
+    m_journal_bytes = sizeof(JournalFileHeader);
+
+    m_commit_thread = std::thread(&Journal::runCommitter, this);
+    return true;
+}
+
+void Journal::begin()
+{
+    OpenTransaction& transaction = current_transaction;
+    if (transaction.depth++ > 0)
+        return;
+    transaction.journal = this;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_gate_condition.wait(lock, [this]() { return !m_checkpointing; });
+    m_open_transactions++;
+}
+
+void Journal::end()
+{
+    OpenTransaction& transaction = current_transaction;
+    if (transaction.journal != this || --transaction.depth > 0)
+        return;
+
+    JournalRecordHeader header = { JOURNAL_RECORD_MAGIC, transaction.change_count, transaction.changes.size(), 0 };
+    if (transaction.change_count != 0)
+        header.checksum = getRecordChecksum(header, transaction.changes.data());
+
+    // Finished transactions join the next commit in the order they finish
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (transaction.change_count != 0)
+    {
+        // The commit thread only needs waking to start its wait, or to cut it short
+        bool wake_committer = m_pending.empty();
+        m_pending.insert(m_pending.end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+        m_pending.insert(m_pending.end(), transaction.changes.begin(), transaction.changes.end());
+        std::move(transaction.actions.begin(), transaction.actions.end(), std::back_inserter(m_pending_actions));
+        m_pending_transactions++;
+
+        if (m_pending.size() >= JOURNAL_COMMIT_BYTES && !m_commit_requested)
+        {
+            m_commit_requested = true;
+            wake_committer = true;
+        }
+        if (wake_committer)
+            m_commit_condition.notify_one();
+    }
+
+    if (--m_open_transactions == 0 && m_checkpointing)
+        m_gate_condition.notify_all();
+    lock.unlock();
+
+    transaction.journal = NULL;
+    transaction.changes.clear();
+    transaction.change_count = 0;
+    transaction.actions.clear();
+}
+
+bool Journal::inTransaction() const
+{
+    return current_transaction.journal == this;
+}
+
+void Journal::logWrite(uint64_t offset, const void* data, uint64_t length)
+{
+    // Changes made outside a transaction are held, and reach the image with the next checkpoint
+    m_device.holdRange(offset, length);
+    if (!inTransaction())
+        return;
+
+    // A write continuing the last one extends it, unless another change was logged in between
+    OpenTransaction& transaction = current_transaction;
+    if (transaction.change_count != 0)
+    {
+        JournalChange last;
+        memcpy(&last, transaction.changes.data() + transaction.last_change, sizeof(last));
+        if (!last.fill && last.offset + last.length == offset && last.length + length <= UINT32_MAX &&
+            m_next_change.load(std::memory_order_relaxed) == last.sequence + 1)
+        {
+            last.length += length;
+            memcpy(transaction.changes.data() + transaction.last_change, &last, sizeof(last));
+            transaction.changes.insert(transaction.changes.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+            return;
+        }
+    }
+
+    JournalChange change = { m_next_change.fetch_add(1, std::memory_order_relaxed), offset, (uint32_t)length, 0, 0, 0 };
+    transaction.last_change = transaction.changes.size();
+    transaction.changes.insert(transaction.changes.end(), (const uint8_t*)&change, (const uint8_t*)&change + sizeof(change));
+    transaction.changes.insert(transaction.changes.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+    transaction.change_count++;
+}
+
+void Journal::logFill(uint64_t offset, uint8_t value, uint64_t length)
+{
+    m_device.holdRange(offset, length);
+    if (!inTransaction())
+        return;
+
+    OpenTransaction& transaction = current_transaction;
+    JournalChange change = { m_next_change.fetch_add(1, std::memory_order_relaxed), offset, (uint32_t)length, 1, value, 0 };
+    transaction.last_change = transaction.changes.size();
+    transaction.changes.insert(transaction.changes.end(), (const uint8_t*)&change, (const uint8_t*)&change + sizeof(change));
+    transaction.change_count++;
+}
+
+void Journal::deferUntilCommitted(std::function<void()> action)
+{
+    if (inTransaction())
+        current_transaction.actions.push_back(action);
+    else
+        action();
+}
+
+void Journal::deferUntilCheckpointed(std::function<void()> action)
+{
+    // Checkpoints wait for open transactions, so the next one comes after this transaction commits
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_checkpoint_actions.push_back(action);
+}
+
+void Journal::commit()
+{
+    std::vector<std::function<void()> > actions;
+    {
+        std::lock_guard<std::mutex> write_lock(m_write_lock);
+
+        std::vector<uint8_t> records;
+        uint32_t transaction_count;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            records.swap(m_pending);
+            actions.swap(m_pending_actions);
+            transaction_count = m_pending_transactions;
+            m_pending_transactions = 0;
+            m_commit_requested = false;
+        }
+
+        if (records.empty())
+            return;
+
+        TraceSpan span("journal_commit");
+        if (transferJournal(m_file_descriptor, records.data(), records.size(), m_journal_bytes, true) &&
+            fdatasync(m_file_descriptor) == 0)
+        {
+            m_journal_bytes += records.size();
+            m_commits.fetch_add(1, std::memory_order_relaxed);
+            m_committed_transactions.fetch_add(transaction_count, std::memory_order_relaxed);
+            Statistics::count(STAT_JOURNAL_COMMITS);
+            Statistics::count(STAT_JOURNAL_TRANSACTIONS, transaction_count);
+        }
+        else
+        {
+            // Retry with the next commit, ahead of what finished since; the actions wait for it
+            m_failed_commits.fetch_add(1, std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            records.insert(records.end(), m_pending.begin(), m_pending.end());
+            m_pending.swap(records);
+            actions.insert(actions.end(), std::make_move_iterator(m_pending_actions.begin()),
+                           std::make_move_iterator(m_pending_actions.end()));
+            m_pending_actions.swap(actions);
+            m_pending_transactions += transaction_count;
+            return;
+        }
+    }
+
+    // Actions may take locks of their own, so they run once the next commit can start
+    std::vector<std::function<void()> >::iterator action;
+    for (action = actions.begin(); action != actions.end(); action++)
+        (*action)();
+}
+
+uint64_t Journal::checkpoint()
+{
+    std::lock_guard<std::mutex> checkpoint_lock(m_checkpoint_lock);
+
+    // Keep new transactions out until the image has caught up with the journal
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_checkpointing = true;
+        m_gate_condition.wait(lock, [this]() { return m_open_transactions == 0; });
+    }
+
+    commit();
+    uint64_t flushed_bytes = m_device.flush();
+
+    // Once the journal is empty, records a failed commit left are in the image already
+    std::vector<std::function<void()> > actions;
+    {
+        std::lock_guard<std::mutex> write_lock(m_write_lock);
+        if (ftruncate(m_file_descriptor, sizeof(JournalFileHeader)) == 0 && fdatasync(m_file_descriptor) == 0)
+        {
+            m_journal_bytes = sizeof(JournalFileHeader);
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_pending.clear();
+            m_pending_transactions = 0;
+            actions.swap(m_pending_actions);
+            actions.insert(actions.end(), std::make_move_iterator(m_checkpoint_actions.begin()),
+                           std::make_move_iterator(m_checkpoint_actions.end()));
+            m_checkpoint_actions.clear();
+        }
+    }
+    m_checkpoints.fetch_add(1, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_checkpointing = false;
+    }
+    m_gate_condition.notify_all();
+
+    std::vector<std::function<void()> >::iterator action;
+    for (action = actions.begin(); action != actions.end(); action++)
+        (*action)();
+
+    return flushed_bytes;
+}
+
+std::string Journal::describe()
+{
+    uint64_t journal_bytes;
+    {
+        std::lock_guard<std::mutex> write_lock(m_write_lock);
+        journal_bytes = m_journal_bytes;
+    }
+
+    return m_path + ", " + std::to_string(journal_bytes) + " bytes, " + std::to_string(m_replayed_transactions) +
+           " transactions replayed at mount, " + std::to_string(m_committed_transactions.load()) + " committed in " +
+           std::to_string(m_commits.load()) + " commits, " + std::to_string(m_checkpoints.load()) + " checkpoints" +
+           (m_failed_commits.load() != 0 ? ", " + std::to_string(m_failed_commits.load()) + " failed commits" : "");
+}
+
+void Journal::runCommitter()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_stopping)
+    {
+        m_commit_condition.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+        if (m_stopping)
+            break;
+
+        // Give other transactions the rest of the interval to finish and share the fdatasync
+        m_commit_condition.wait_for(lock, std::chrono::milliseconds(JOURNAL_COMMIT_INTERVAL_MS),
+                                    [this]() { return m_stopping || m_commit_requested; });
+
+        lock.unlock();
+        commit();
+
+        bool full;
+        {
+            std::lock_guard<std::mutex> write_lock(m_write_lock);
+            full = (m_journal_bytes >= JOURNAL_CHECKPOINT_BYTES);
+        }
+        if (full)
+            checkpoint();
+        lock.lock();
+    }
+}
+
+void Journal::replay(const std::vector<uint8_t>& records)
+{
+    struct ReplayedChange
+    {
+        uint64_t sequence;
+        size_t position;
+
+        bool operator<(const ReplayedChange& other) const { return sequence < other.sequence; }
+    };
+
+    // Collect the changes of every intact record; the first torn one ends the journal
+    std::vector<ReplayedChange> changes;
+    size_t position = 0;
+    while (position + sizeof(JournalRecordHeader) <= records.size())
+    {
+        JournalRecordHeader header;
+        memcpy(&header, records.data() + position, sizeof(header));
+
+        const uint8_t* record_changes = records.data() + position + sizeof(header);
+        if (header.magic != JOURNAL_RECORD_MAGIC || header.length > records.size() - position - sizeof(header) ||
+            header.checksum != getRecordChecksum(header, record_changes))
+            break;
+
+        size_t change_position = position + sizeof(header);
+        for (uint32_t i = 0; i < header.change_count; i++)
+        {
+            JournalChange change;
+            memcpy(&change, records.data() + change_position, sizeof(change));
+
+            ReplayedChange replayed = { change.sequence, change_position };
+            changes.push_back(replayed);
+            change_position += sizeof(change) + (change.fill ? 0 : change.length);
+        }
+
+        position += sizeof(header) + header.length;
+        m_replayed_transactions++;
+    }
+
+    // Transactions finish in a different order than they made their changes
+    std::stable_sort(changes.begin(), changes.end());
+
+    std::vector<ReplayedChange>::iterator replayed;
+    for (replayed = changes.begin(); replayed != changes.end(); replayed++)
+    {
+        JournalChange change;
+        memcpy(&change, records.data() + replayed->position, sizeof(change));
+
+        if (change.offset + change.length > m_device.getSize())
+            continue;
+
+        if (change.fill)
+            m_device.fill(change.offset, change.value, change.length);
+        else
+            m_device.write(change.offset, records.data() + replayed->position + sizeof(change), change.length);
+    }
+
+    m_next_change.store(changes.empty() ? 0 : changes.back().sequence + 1);
+}
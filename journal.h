@@ -0,0 +1,121 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include "blockdevice.h"
+
+namespace FAT_FS
+{
+    // A finished transaction waits at most this long for others to share its commit
+    const uint32_t JOURNAL_COMMIT_INTERVAL_MS = 10;
+
+    // Finished transactions are committed straight away once they add up to this many bytes
+    const uint64_t JOURNAL_COMMIT_BYTES = 1 << 20;
+
+    // A journal this large is checkpointed and starts over
+    const uint64_t JOURNAL_CHECKPOINT_BYTES = 32 << 20;
+
+    // A write-ahead log of metadata changes, kept in a file beside the image.
+    // A transaction records the bytes each change leaves in the image, and the
+    // device holds the blocks it changes, so nothing reaches the image before
+    // its record reaches the journal. Finished transactions are appended and
+    // fdatasync'd together by a commit thread. A checkpoint waits for the open
+    // transactions, flushes the device and empties the journal; what is left
+    // after a crash is replayed when the journal is next opened.
+    class Journal
+    {
+        public:
+            Journal(BlockDevice& device);
+            ~Journal();
+
+            // Open or create the journal for an image and replay whatever it holds;
+            // false if it cannot be used or belongs to another image
+            bool open(std::string path, uint32_t volume_id);
+
+            // Transactions are per thread; nested ones join the outermost
+            void begin();
+            void end();
+            bool inTransaction() const;
+
+            // Record a change the current transaction makes, before making it
+            void logWrite(uint64_t offset, const void* data, uint64_t length);
+            void logFill(uint64_t offset, uint8_t value, uint64_t length);
+
+            // Run an action once the current transaction has been committed, or once the journal
+            // has been checkpointed and holds nothing logged before now
+            void deferUntilCommitted(std::function<void()> action);
+            void deferUntilCheckpointed(std::function<void()> action);
+
+            // Commit every finished transaction, waiting for the disk
+            void commit();
+
+            // Returns the bytes the device flushed
+            uint64_t checkpoint();
+
+            std::string describe();
+        private:
+            Journal(const Journal&);
+            Journal& operator=(const Journal&);
+
+            void runCommitter();
+            void replay(const std::vector<uint8_t>& records);
+
+            BlockDevice& m_device;
+            int m_file_descriptor;
+            std::string m_path;
+
+            // Open transactions, and a checkpoint waiting for them to finish; new ones wait for it
+            std::mutex m_lock;
+            std::condition_variable m_gate_condition;
+            uint32_t m_open_transactions;
+            bool m_checkpointing;
+            std::mutex m_checkpoint_lock;
+
+            // Finished transactions waiting to be committed, and what runs once they are, or once
+            // the journal is next emptied
+            std::vector<uint8_t> m_pending;
+            std::vector<std::function<void()> > m_pending_actions;
+            uint32_t m_pending_transactions;
+            std::vector<std::function<void()> > m_checkpoint_actions;
+
+            // Changes are numbered as they are logged, so replay applies them in the order they were made
+            std::atomic<uint64_t> m_next_change;
+
+            // Held by whoever appends to the file, which commits in the order transactions finished
+            std::mutex m_write_lock;
+            uint64_t m_journal_bytes;
+
+            std::thread m_commit_thread;
+            std::condition_variable m_commit_condition;
+            bool m_commit_requested;
+            bool m_stopping;
+
+            uint32_t m_replayed_transactions;
+            std::atomic<uint64_t> m_committed_transactions;
+            std::atomic<uint64_t> m_commits;
+            std::atomic<uint64_t> m_checkpoints;
+            std::atomic<uint64_t> m_failed_commits;
+    };
+
+    // Groups the metadata changes of one command into a transaction of journal,
+    // if there is a journal. Commands begin one before taking any of their locks.
+    class JournalTransaction
+    {
+        public:
+            JournalTransaction(Journal* journal) : m_journal(journal) { if (m_journal) m_journal->begin(); }
+            ~JournalTransaction() { if (m_journal) m_journal->end(); }
+        private:
+            JournalTransaction(const JournalTransaction&);
+            JournalTransaction& operator=(const JournalTransaction&);
+
+            Journal* m_journal;
+    };
+}
+
+#endif
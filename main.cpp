@@ -1,153 +1,424 @@
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <functional>
+#include <stdexcept>
+#include <unistd.h>
 #include "filesystem.h"
+#include "outputbuffer.h"
 
 using namespace std;
 
+#define USAGE "Usage: fmod [--batch] [--script <file>] [--stop-on-error] [--deferred-fat-sync]\n" \
+              "            [--stats-file <file>] [--stats-interval <seconds>] [--populate]\n" \
+              "            [--huge-pages] [--lock-fat] [--backend mmap|cached|uring] [--cache-mb <n>]\n" \
+              "            [--flush-interval <seconds>] [--flush-dirty-mb <n>] [--journal <file>] <fat image>\n" \
+              "       fmod --fsck [--repair] <fat image>"
+
+// Batch mode output is flushed every BATCH_OUTPUT_BUFFER_SIZE bytes at most
+const size_t BATCH_OUTPUT_BUFFER_SIZE = 1 << 20;
+
+// Status of the last command, reported by the status command and the batch exit code
+enum CommandStatus
+{
+    STATUS_OK = 0,
+    STATUS_FAILED = 1,
+    STATUS_USAGE = 2,
+    STATUS_UNKNOWN_COMMAND = 3
+};
+
+struct Session
+{
+    bool exit_requested;
+    CommandStatus last_status;
+    FAT_FS::BatchOutputBuffer* output_buffer;
+};
+
+struct Command
+{
+    std::string usage;
+    size_t min_tokens;
+    size_t max_tokens;
+    std::function<bool(const std::vector<std::string>&)> handler;
+};
+
+typedef std::map<std::string, Command> CommandTable;
+
 std::vector<std::string> tokenize(std::string input);
+CommandTable buildCommandTable(FAT_FS::FileSystem& file_system, Session& session);
+CommandStatus runCommand(const CommandTable& commands, const std::vector<std::string>& tokenized_input);
 
 int main(int argc, char **argv)
 {
     // Check for proper number of arguments
-    if (argc != 2)
+    if (argc < 2)
     {
-        std::cout << "Usage: fmod <fat image>"  << endl;
+        std::cout << USAGE << endl;
         exit(EXIT_FAILURE);
     }
 
-    // Declare variables
-    std::string file_system_image = std::string(argv[1]);
-    FAT_FS::FileSystem file_system(file_system_image);
-
-    if (file_system.hasError())
+    // Parse mode and mount options
+    FAT_FS::MountOptions options;
+    bool batch_mode = !isatty(STDIN_FILENO);
+    bool stop_on_error = false;
+    bool fsck_mode = false;
+    bool repair = false;
+    std::string script_file;
+    for (int i = 1; i < argc - 1; i++)
     {
-        cout << "Error setting up file system." << endl;
-        return(EXIT_FAILURE);
-    }
-
-    for(;;)
-    {
-        std::string input;
-
-        // Print prompt
-        std::cout << "[" << file_system_image << "]> ";
-        std::getline(std::cin, input);
-
-        std::vector<std::string> tokenized_input = tokenize(input);
-
-        // Execute command
-        if (tokenized_input[0] == "exit")
+        std::string option(argv[i]);
+        if (option == "--deferred-fat-sync")
+            options.deferred_FAT_sync = true;
+        else if (option == "--populate")
+            options.populate = true;
+        else if (option == "--huge-pages")
+            options.huge_pages = true;
+        else if (option == "--lock-fat")
+            options.lock_FAT = true;
+        else if (option == "--batch")
+            batch_mode = true;
+        else if (option == "--stop-on-error")
+            stop_on_error = true;
+        else if (option == "--fsck")
+            fsck_mode = true;
+        else if (option == "--repair")
+            repair = true;
+        else if (option == "--script" && i + 1 < argc - 1)
         {
-            if (tokenized_input.size() == 1)
-                return(EXIT_SUCCESS);
-            else
-                cout << "Usage: exit" << endl;
+            script_file = argv[++i];
+            batch_mode = true;
         }
-        else if (tokenized_input[0] == "fsinfo")
+        else if (option == "--stats-file" && i + 1 < argc - 1)
+            options.stats_file = argv[++i];
+        else if (option == "--stats-interval" && i + 1 < argc - 1 && atoi(argv[i + 1]) > 0)
+            options.stats_interval = atoi(argv[++i]);
+        else if (option == "--backend" && i + 1 < argc - 1 && std::string(argv[i + 1]) == "mmap")
         {
-            if (tokenized_input.size() == 1)
-                file_system.fsinfo();
-            else
-                cout << "Usage: fsinfo" << endl;
+            options.backend = FAT_FS::BLOCK_DEVICE_MMAP;
+            i++;
         }
-        else if (tokenized_input[0] == "ls")
+        else if (option == "--backend" && i + 1 < argc - 1 && std::string(argv[i + 1]) == "cached")
         {
-            if (tokenized_input.size() == 1)
-                file_system.ls(file_system.getCurrentDirectoryName());
-            else if (tokenized_input.size() == 2)
-                file_system.ls(tokenized_input[1]);
-            else
-                cout << "Usage: ls <dir_name>" << endl;
+            options.backend = FAT_FS::BLOCK_DEVICE_CACHED;
+            i++;
         }
-        else if (tokenized_input[0] == "cd")
+        else if (option == "--backend" && i + 1 < argc - 1 && std::string(argv[i + 1]) == "uring")
         {
-            if (tokenized_input.size() == 2)
-                file_system.cd(tokenized_input[1]);
-            else
-                cout << "Usage: cd <dir_name>" << endl;
+            options.backend = FAT_FS::BLOCK_DEVICE_URING;
+            i++;
         }
-        else if (tokenized_input[0] == "size")
+        else if (option == "--cache-mb" && i + 1 < argc - 1 && atoi(argv[i + 1]) > 0)
+            options.cache_MB = atoi(argv[++i]);
+        else if (option == "--flush-interval" && i + 1 < argc - 1 && atoi(argv[i + 1]) > 0)
+            options.flush_interval = atoi(argv[++i]);
+        else if (option == "--flush-dirty-mb" && i + 1 < argc - 1 && atoi(argv[i + 1]) > 0)
+            options.flush_dirty_MB = atoi(argv[++i]);
+        else if (option == "--journal" && i + 1 < argc - 1)
+            options.journal_file = argv[++i];
+        else
         {
-            if (tokenized_input.size() == 2)
-                file_system.size(tokenized_input[1]);
-            else
-                cout << "Usage: size <file_name>" << endl;
+            std::cout << USAGE << endl;
+            exit(EXIT_FAILURE);
         }
-        else if (tokenized_input[0] == "open")
+    }
+
+    if (repair && !fsck_mode)
+    {
+        std::cout << USAGE << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The kernel writes mapped pages back whenever it likes, so it could write metadata before its journal record
+    if (!options.journal_file.empty() && options.backend == FAT_FS::BLOCK_DEVICE_MMAP)
+    {
+        cout << "Error: --journal needs --backend cached or uring." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Read commands from the script file when one is given
+    std::ifstream script;
+    std::istream* input_stream = &std::cin;
+    if (!script_file.empty())
+    {
+        script.open(script_file.c_str());
+        if (!script)
         {
-            if (tokenized_input.size() == 3)
-                file_system.open(tokenized_input[1], tokenized_input[2]);
-            else
-                cout << "Usage: open <file_name> <mode>" << endl;
+            cout << "Error: cannot open script '" << script_file << "'." << endl;
+            exit(EXIT_FAILURE);
         }
-        else if (tokenized_input[0] == "close")
+        input_stream = &script;
+    }
+
+    // Batch mode skips the prompt and buffers all output until exit or flush
+    FAT_FS::BatchOutputBuffer* output_buffer = NULL;
+    std::streambuf* console_buffer = NULL;
+    if (batch_mode)
+    {
+        std::ios_base::sync_with_stdio(false);
+        std::cin.tie(NULL);
+
+        output_buffer = new FAT_FS::BatchOutputBuffer(STDOUT_FILENO, BATCH_OUTPUT_BUFFER_SIZE);
+        console_buffer = std::cout.rdbuf(output_buffer);
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    {
+        // Declare variables
+        std::string file_system_image = std::string(argv[argc - 1]);
+        FAT_FS::FileSystem file_system(file_system_image, options);
+
+        if (file_system.hasError())
         {
-            if (tokenized_input.size() == 2)
-                file_system.close(tokenized_input[1]);
-            else
-                cout << "Usage: close <file_name>" << endl;
+            cout << "Error setting up file system." << endl;
+            exit_status = EXIT_FAILURE;
         }
-        else if (tokenized_input[0] == "read")
+        else if (fsck_mode)
         {
-            if (tokenized_input.size() == 4)
-                file_system.read(tokenized_input[1],
-                                 std::stoi(tokenized_input[2]),
-                                 std::stoi(tokenized_input[3]));
-            else
-                cout << "Usage: read <file_name> <start_pos> <num_bytes>" << endl;
+            // Check the image and exit, failing unless it is clean or was fully repaired
+            if (!file_system.fsck(repair))
+                exit_status = EXIT_FAILURE;
         }
-        else if (tokenized_input[0] == "write")
+        else
         {
-            if (tokenized_input.size() == 4)
+            Session session = { false, STATUS_OK, output_buffer };
+            CommandTable commands = buildCommandTable(file_system, session);
+
+            while (!session.exit_requested)
             {
-                if(tokenized_input[3][0] != '\"' || tokenized_input[3][tokenized_input[3].length() - 1] != '\"')
-                    cout << "Error: data must be quoted." << endl;
-                else
-                    file_system.write(tokenized_input[1],
-                                      std::stoi(tokenized_input[2]),
-                                      tokenized_input[3].substr(1, tokenized_input[3].length() - 2));
+                std::string input;
+
+                // Print prompt
+                if (!batch_mode)
+                    std::cout << "[" << file_system_image << "]> ";
+
+                if (!std::getline(*input_stream, input))
+                    break;
+
+                std::vector<std::string> tokenized_input = tokenize(input);
+                if (tokenized_input.empty())
+                    continue;
+
+                // Execute command
+                CommandStatus status = runCommand(commands, tokenized_input);
+                if (tokenized_input[0] != "status")
+                    session.last_status = status;
+
+                if (status != STATUS_OK && batch_mode)
+                {
+                    exit_status = EXIT_FAILURE;
+                    if (stop_on_error)
+                        break;
+                }
             }
-            else
-                cout << "Usage: write <file_name> <start_pos> <quoted_data>" << endl;
         }
-        else if (tokenized_input[0] == "create")
+    }
+
+    // The file system is unmounted before the buffered output is written out
+    if (output_buffer)
+    {
+        std::cout.rdbuf(console_buffer);
+        delete output_buffer;
+    }
+
+    return exit_status;
+}
+
+CommandTable buildCommandTable(FAT_FS::FileSystem& file_system, Session& session)
+{
+    CommandTable commands;
+    FAT_FS::FileSystem* fs = &file_system;
+    Session* state = &session;
+
+    commands["exit"] = { "exit", 1, 1, [state](const std::vector<std::string>&) {
+        state->exit_requested = true;
+        return true;
+    } };
+    commands["status"] = { "status", 1, 1, [state](const std::vector<std::string>&) {
+        cout << state->last_status << endl;
+        return true;
+    } };
+    commands["flush"] = { "flush", 1, 1, [state](const std::vector<std::string>&) {
+        return state->output_buffer ? state->output_buffer->flush() : static_cast<bool>(cout.flush());
+    } };
+    commands["fsinfo"] = { "fsinfo", 1, 1, [fs](const std::vector<std::string>&) {
+        return fs->fsinfo();
+    } };
+    commands["ls"] = { "ls <dir_name>", 1, 2, [fs](const std::vector<std::string>& args) {
+        return fs->ls(args.size() == 2 ? args[1] : fs->getCurrentDirectoryName());
+    } };
+    commands["du"] = { "du [-s] [dir_name]", 1, 3, [fs](const std::vector<std::string>& args) {
+        bool summary_only = (args.size() > 1 && args[1] == "-s");
+        if (args.size() == 3 && !summary_only)
+            throw std::invalid_argument("du");
+
+        size_t dir_index = summary_only ? 2 : 1;
+        return fs->du(args.size() > dir_index ? args[dir_index] : fs->getCurrentDirectoryName(), summary_only);
+    } };
+    commands["find"] = { "find [dir_name] [-name <pattern>] [-min <bytes>] [-max <bytes>] [-type f|d] [-attr <rhsda>]", 1, 12,
+                         [fs](const std::vector<std::string>& args) {
+        FAT_FS::FindFilter filter;
+        std::string dir_name = fs->getCurrentDirectoryName();
+
+        size_t i = 1;
+        if (i < args.size() && args[i][0] != '-')
+            dir_name = args[i++];
+
+        // Every option takes one value; anything else is reported as a usage error
+        for (; i < args.size(); i += 2)
         {
-            if (tokenized_input.size() == 2)
-                file_system.create(tokenized_input[1]);
+            if (i + 1 >= args.size())
+                throw std::invalid_argument(args[i]);
+
+            const std::string& value = args[i + 1];
+            if (args[i] == "-name")
+                filter.name_pattern = value;
+            else if (args[i] == "-min")
+                filter.min_size = std::stoull(value);
+            else if (args[i] == "-max")
+                filter.max_size = std::stoull(value);
+            else if (args[i] == "-type" && value == "f")
+                filter.excluded_attributes |= FAT_FS::ATTR_DIRECTORY;
+            else if (args[i] == "-type" && value == "d")
+                filter.required_attributes |= FAT_FS::ATTR_DIRECTORY;
+            else if (args[i] == "-attr")
+            {
+                const std::string letters = "rhsda";
+                const uint8_t attributes[] = { FAT_FS::ATTR_READ_ONLY, FAT_FS::ATTR_HIDDEN, FAT_FS::ATTR_SYSTEM,
+                                               FAT_FS::ATTR_DIRECTORY, FAT_FS::ATTR_ARCHIVE };
+
+                for (size_t j = 0; j < value.length(); j++)
+                {
+                    size_t attribute = letters.find(value[j]);
+                    if (attribute == std::string::npos)
+                        throw std::invalid_argument(value);
+
+                    filter.required_attributes |= attributes[attribute];
+                }
+            }
             else
-                cout << "Usage: create <file_name>" << endl;
+                throw std::invalid_argument(args[i]);
         }
-        else if (tokenized_input[0] == "rm")
+
+        return fs->find(dir_name, filter);
+    } };
+    commands["cd"] = { "cd <dir_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->cd(args[1]);
+    } };
+    commands["size"] = { "size <file_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->size(args[1]);
+    } };
+    commands["open"] = { "open <file_name> <mode>", 3, 3, [fs](const std::vector<std::string>& args) {
+        return fs->open(args[1], args[2]);
+    } };
+    commands["close"] = { "close <file_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->close(args[1]);
+    } };
+    commands["read"] = { "read <file_name> <start_pos> <num_bytes>", 4, 4, [fs](const std::vector<std::string>& args) {
+        return fs->read(args[1], std::stoi(args[2]), std::stoi(args[3]));
+    } };
+    commands["write"] = { "write <file_name> <start_pos> <quoted_data>", 4, 4, [fs](const std::vector<std::string>& args) {
+        if (args[3].length() < 2 || args[3][0] != '\"' || args[3][args[3].length() - 1] != '\"')
         {
-            if (tokenized_input.size() == 2)
-                file_system.rm(tokenized_input[1]);
-            else
-                cout << "Usage: rm <file_name>" << endl;
+            cout << "Error: data must be quoted." << endl;
+            return false;
         }
-        else if (tokenized_input[0] == "mkdir")
+
+        return fs->write(args[1], std::stoi(args[2]), args[3].substr(1, args[3].length() - 2));
+    } };
+    commands["create"] = { "create <file_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->create(args[1]);
+    } };
+    commands["rm"] = { "rm <file_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->rm(args[1]);
+    } };
+    commands["mkdir"] = { "mkdir <directory_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->mkdir(args[1]);
+    } };
+    commands["rmdir"] = { "rmdir <directory_name>", 2, 2, [fs](const std::vector<std::string>& args) {
+        return fs->rmdir(args[1]);
+    } };
+    commands["undelete"] = { "undelete", 1, 1, [fs](const std::vector<std::string>&) {
+        return fs->undelete();
+    } };
+    commands["sync"] = { "sync", 1, 1, [fs](const std::vector<std::string>&) {
+        return fs->sync();
+    } };
+    commands["fatcheck"] = { "fatcheck", 1, 1, [fs](const std::vector<std::string>&) {
+        return fs->fatcheck();
+    } };
+    commands["fsck"] = { "fsck [repair]", 1, 2, [fs](const std::vector<std::string>& args) {
+        if (args.size() == 2 && args[1] != "repair")
         {
-            if (tokenized_input.size() == 2)
-                file_system.mkdir(tokenized_input[1]);
-            else
-                cout << "Usage: mkdir <directory_name>" << endl;
+            cout << "Usage: fsck [repair]" << endl;
+            return false;
         }
-        else if (tokenized_input[0] == "rmdir")
+
+        return fs->fsck(args.size() == 2);
+    } };
+    commands["defrag"] = { "defrag [path] [-rate <MB/s>]", 1, 4, [fs](const std::vector<std::string>& args) {
+        std::string path = fs->getCurrentDirectoryName();
+        uint32_t max_MB_per_second = 0;
+
+        size_t i = 1;
+        if (i < args.size() && args[i] != "-rate")
+            path = args[i++];
+
+        if (i < args.size())
         {
-            if (tokenized_input.size() == 2)
-                file_system.rmdir(tokenized_input[1]);
-            else
-                cout << "Usage: rmdir <directory_name>" << endl;
+            if (args[i] != "-rate" || i + 2 != args.size())
+                throw std::invalid_argument(args[i]);
+            max_MB_per_second = std::stoul(args[i + 1]);
         }
-        else if (tokenized_input[0] == "undelete")
+
+        return fs->defrag(path, max_MB_per_second);
+    } };
+    commands["fraginfo"] = { "fraginfo [worst_file_count]", 1, 2, [fs](const std::vector<std::string>& args) {
+        return fs->fraginfo(args.size() == 2 ? std::stoul(args[1]) : 10);
+    } };
+    commands["stats"] = { "stats", 1, 1, [fs](const std::vector<std::string>&) {
+        return fs->stats();
+    } };
+    commands["trace"] = { "trace start <file> | trace stop", 2, 3, [fs](const std::vector<std::string>& args) {
+        if ((args[1] == "start") != (args.size() == 3))
         {
-            file_system.undelete();
+            cout << "Usage: trace start <file> | trace stop" << endl;
+            return false;
         }
-        else
-            std::cout << "Invalid commmand" << endl;
+
+        return fs->trace(args[1], args.size() == 3 ? args[2] : "");
+    } };
+
+    return commands;
+}
+
+CommandStatus runCommand(const CommandTable& commands, const std::vector<std::string>& tokenized_input)
+{
+    CommandTable::const_iterator command = commands.find(tokenized_input[0]);
+    if (command == commands.end())
+    {
+        std::cout << "Invalid commmand" << endl;
+        return STATUS_UNKNOWN_COMMAND;
     }
 
-    return 0;
+    const Command& entry = command->second;
+    if (tokenized_input.size() < entry.min_tokens || tokenized_input.size() > entry.max_tokens)
+    {
+        cout << "Usage: " << entry.usage << endl;
+        return STATUS_USAGE;
+    }
+
+    // Numeric arguments that fail to parse are reported as usage errors
+    try
+    {
+        return entry.handler(tokenized_input) ? STATUS_OK : STATUS_FAILED;
+    }
+    catch (const std::logic_error&)
+    {
+        cout << "Usage: " << entry.usage << endl;
+        return STATUS_USAGE;
+    }
 }
 
 std::vector<std::string> tokenize(std::string input)
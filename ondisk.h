@@ -0,0 +1,141 @@
+#ifndef ONDISK_H
+#define ONDISK_H
+#include <cstdint>
+#include <cstring>
+
+namespace FAT_FS
+{
+    // A little-endian integer at any alignment. Reading or assigning one is a
+    // single unaligned load or store on little-endian hosts.
+    template <typename T>
+    class LittleEndian
+    {
+        public:
+            LittleEndian() {}
+            LittleEndian(T value) { *this = value; }
+
+            operator T() const
+            {
+                T value;
+                memcpy(&value, m_bytes, sizeof(T));
+                return swap(value);
+            }
+
+            LittleEndian& operator=(T value)
+            {
+                value = swap(value);
+                memcpy(m_bytes, &value, sizeof(T));
+                return *this;
+            }
+        private:
+            static T swap(T value)
+            {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                if (sizeof(T) == 2)
+                    return (T)__builtin_bswap16((uint16_t)value);
+                if (sizeof(T) == 4)
+                    return (T)__builtin_bswap32((uint32_t)value);
+                if (sizeof(T) == 8)
+                    return (T)__builtin_bswap64((uint64_t)value);
+#endif
+                return value;
+            }
+
+            uint8_t m_bytes[sizeof(T)];
+    };
+
+    // The on-disk structures, laid over the image as they are stored. Fields are
+    // only decoded when read, so a view costs nothing until it is used.
+
+    // The boot sector up to the end of the FAT32 BIOS parameter block
+    struct BootSectorView
+    {
+        uint8_t jump[3];
+        uint8_t OEM_name[8];
+        LittleEndian<uint16_t> bytes_per_sector;
+        uint8_t sectors_per_cluster;
+        LittleEndian<uint16_t> reserved_sector_count;
+        uint8_t num_FATS;
+        LittleEndian<uint16_t> root_entry_count;
+        LittleEndian<uint16_t> total_sectors_16;
+        uint8_t media;
+        LittleEndian<uint16_t> FATSz_16;
+        LittleEndian<uint16_t> sectors_per_track;
+        LittleEndian<uint16_t> num_heads;
+        LittleEndian<uint32_t> hidden_sectors;
+        LittleEndian<uint32_t> total_sectors;
+        LittleEndian<uint32_t> FATSz;
+        LittleEndian<uint16_t> extended_flags;
+        LittleEndian<uint16_t> version;
+        LittleEndian<uint32_t> root_cluster;
+        LittleEndian<uint16_t> fsinfo;
+        LittleEndian<uint16_t> backup_boot_sector;
+        uint8_t reserved[12];
+        uint8_t drive_number;
+        uint8_t reserved_1;
+        uint8_t boot_signature;
+        LittleEndian<uint32_t> volume_id;
+        uint8_t volume_label[11];
+        uint8_t file_system_type[8];
+    };
+
+    struct FSInfoSectorView
+    {
+        LittleEndian<uint32_t> lead_signature;
+        uint8_t reserved[480];
+        LittleEndian<uint32_t> struct_signature;
+        LittleEndian<uint32_t> free_cluster_count;
+        LittleEndian<uint32_t> first_free_cluster;
+        uint8_t reserved_1[12];
+        LittleEndian<uint32_t> trail_signature;
+    };
+
+    // A 32-byte short directory entry
+    struct ShortEntryView
+    {
+        uint8_t name[11];
+        uint8_t attribute;
+        uint8_t NT_reserved;
+        uint8_t create_time_tenth;
+        LittleEndian<uint16_t> create_time;
+        LittleEndian<uint16_t> create_date;
+        LittleEndian<uint16_t> access_date;
+        LittleEndian<uint16_t> high_cluster;
+        LittleEndian<uint16_t> write_time;
+        LittleEndian<uint16_t> write_date;
+        LittleEndian<uint16_t> low_cluster;
+        LittleEndian<uint32_t> size;
+
+        uint32_t getCluster() const { return ((uint32_t)high_cluster << 16) | low_cluster; }
+        void setCluster(uint32_t cluster)
+        {
+            high_cluster = cluster >> 16;
+            low_cluster = cluster & 0x0000FFFF;
+        }
+    };
+
+    // A 32-byte long name entry, holding 13 UCS-2 characters of the name
+    struct LongEntryView
+    {
+        uint8_t order;
+        LittleEndian<uint16_t> name_1[5];
+        uint8_t attribute;
+        uint8_t type;
+        uint8_t checksum;
+        LittleEndian<uint16_t> name_2[6];
+        LittleEndian<uint16_t> low_cluster;
+        LittleEndian<uint16_t> name_3[2];
+
+        uint16_t getCharacter(uint32_t i) const
+        {
+            return (i < 5) ? name_1[i] : (i < 11) ? name_2[i - 5] : name_3[i - 11];
+        }
+    };
+
+    static_assert(sizeof(BootSectorView) == 90, "BootSectorView must match the on-disk layout");
+    static_assert(sizeof(FSInfoSectorView) == 512, "FSInfoSectorView must match the on-disk layout");
+    static_assert(sizeof(ShortEntryView) == 32, "ShortEntryView must match the on-disk layout");
+    static_assert(sizeof(LongEntryView) == 32, "LongEntryView must match the on-disk layout");
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef OUTPUTBUFFER_H
+#define OUTPUTBUFFER_H
+#include <streambuf>
+#include <vector>
+#include <unistd.h>
+
+namespace FAT_FS
+{
+    // Large output buffer for batch mode that ignores std::endl flushes and
+    // only writes out when it fills up or flush() is called
+    class BatchOutputBuffer : public std::streambuf
+    {
+        public:
+            BatchOutputBuffer(int fd, size_t size) : m_fd(fd), m_buffer(size)
+            {
+                setp(&m_buffer[0], &m_buffer[0] + m_buffer.size());
+            }
+
+            ~BatchOutputBuffer() { flush(); }
+
+            bool flush()
+            {
+                const char* data = pbase();
+                size_t remaining = pptr() - pbase();
+
+                while (remaining > 0)
+                {
+                    ssize_t written = ::write(m_fd, data, remaining);
+                    if (written < 0)
+                        return false;
+
+                    data += written;
+                    remaining -= written;
+                }
+
+                setp(&m_buffer[0], &m_buffer[0] + m_buffer.size());
+                return true;
+            }
+        protected:
+            virtual int_type overflow(int_type c)
+            {
+                if (!flush())
+                    return traits_type::eof();
+
+                if (!traits_type::eq_int_type(c, traits_type::eof()))
+                {
+                    *pptr() = traits_type::to_char_type(c);
+                    pbump(1);
+                }
+
+                return traits_type::not_eof(c);
+            }
+
+            // Flushes requested by std::endl are deferred to flush()
+            virtual int sync() { return 0; }
+        private:
+            BatchOutputBuffer(const BatchOutputBuffer&);
+            BatchOutputBuffer& operator=(const BatchOutputBuffer&);
+
+            int m_fd;
+            std::vector<char> m_buffer;
+    };
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+#include <pthread.h>
+#include <utility>
+
+namespace FAT_FS
+{
+    class ReadWriteLock
+    {
+        public:
+            ReadWriteLock() { pthread_rwlock_init(&m_lock, NULL); }
+            ~ReadWriteLock() { pthread_rwlock_destroy(&m_lock); }
+
+            void lockRead() { pthread_rwlock_rdlock(&m_lock); }
+            void lockWrite() { pthread_rwlock_wrlock(&m_lock); }
+            void unlock() { pthread_rwlock_unlock(&m_lock); }
+        private:
+            ReadWriteLock(const ReadWriteLock&);
+            ReadWriteLock& operator=(const ReadWriteLock&);
+
+            pthread_rwlock_t m_lock;
+    };
+
+    class ReadLock
+    {
+        public:
+            ReadLock(ReadWriteLock& lock) : m_lock(lock) { m_lock.lockRead(); }
+            ~ReadLock() { m_lock.unlock(); }
+        private:
+            ReadLock(const ReadLock&);
+            ReadLock& operator=(const ReadLock&);
+
+            ReadWriteLock& m_lock;
+    };
+
+    class WriteLock
+    {
+        public:
+            WriteLock(ReadWriteLock& lock) : m_first(&lock), m_second(0) { m_first->lockWrite(); }
+
+            // Two locks are always taken in address order, and only once if they are the same lock
+            WriteLock(ReadWriteLock& first, ReadWriteLock& second) : m_first(&first), m_second(&second)
+            {
+                if (m_second < m_first)
+                    std::swap(m_first, m_second);
+                if (m_first == m_second)
+                    m_second = 0;
+
+                m_first->lockWrite();
+                if (m_second)
+                    m_second->lockWrite();
+            }
+
+            ~WriteLock()
+            {
+                if (m_second)
+                    m_second->unlock();
+                m_first->unlock();
+            }
+        private:
+            WriteLock(const WriteLock&);
+            WriteLock& operator=(const WriteLock&);
+
+            ReadWriteLock* m_first;
+            ReadWriteLock* m_second;
+    };
+}
+
+#endif
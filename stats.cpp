@@ -0,0 +1,290 @@
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+#include "stats.h"
+
+using namespace std;
+
+namespace FAT_FS
+{
+    const char* const COUNTER_NAMES[STAT_COUNTER_COUNT] = { "fat_reads", "fat_writes", "dir_entries_decoded",
+                                                            "clusters_allocated", "clusters_freed",
+                                                            "bytes_read", "bytes_written", "bytes_flushed",
+                                                            "journal_commits", "journal_transactions" };
+
+    const char* const COMMAND_NAMES[STAT_COMMAND_COUNT] = { "fsinfo", "open", "close", "create", "read", "write",
+                                                            "rm", "cd", "ls", "mkdir", "rmdir", "size",
+                                                            "undelete", "sync", "fatcheck", "fsck", "du", "find", "defrag", "fraginfo" };
+
+    // Counters of one thread. Only the owning thread writes them, so a relaxed
+    // load and store is enough and readers never see a torn value.
+    struct ThreadStatistics
+    {
+        ThreadStatistics()
+        {
+            for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++)
+                counters[i].store(0, std::memory_order_relaxed);
+
+            for (uint32_t i = 0; i < STAT_COMMAND_COUNT; i++)
+            {
+                for (uint32_t j = 0; j < HISTOGRAM_BUCKET_COUNT; j++)
+                    latency_buckets[i][j].store(0, std::memory_order_relaxed);
+                latency_total_ns[i].store(0, std::memory_order_relaxed);
+                latency_max_ns[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint64_t> counters[STAT_COUNTER_COUNT];
+        std::atomic<uint64_t> latency_buckets[STAT_COMMAND_COUNT][HISTOGRAM_BUCKET_COUNT];
+        std::atomic<uint64_t> latency_total_ns[STAT_COMMAND_COUNT];
+        std::atomic<uint64_t> latency_max_ns[STAT_COMMAND_COUNT];
+    };
+
+    // Threads register their counters on first use and fold them into the retired totals on exit
+    class StatisticsRegistry
+    {
+        public:
+            void add(ThreadStatistics* statistics)
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_live.push_back(statistics);
+            }
+
+            void remove(ThreadStatistics* statistics)
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                addTo(m_retired, *statistics);
+
+                for (size_t i = 0; i < m_live.size(); i++)
+                {
+                    if (m_live[i] == statistics)
+                    {
+                        m_live.erase(m_live.begin() + i);
+                        break;
+                    }
+                }
+            }
+
+            StatisticsSnapshot getSnapshot()
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                StatisticsSnapshot snapshot = m_retired;
+
+                for (size_t i = 0; i < m_live.size(); i++)
+                    addTo(snapshot, *m_live[i]);
+
+                return snapshot;
+            }
+        private:
+            static void addTo(StatisticsSnapshot& snapshot, const ThreadStatistics& statistics)
+            {
+                for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++)
+                    snapshot.counters[i] += statistics.counters[i].load(std::memory_order_relaxed);
+
+                for (uint32_t i = 0; i < STAT_COMMAND_COUNT; i++)
+                {
+                    LatencyHistogram& histogram = snapshot.latencies[i];
+                    for (uint32_t j = 0; j < HISTOGRAM_BUCKET_COUNT; j++)
+                    {
+                        uint64_t count = statistics.latency_buckets[i][j].load(std::memory_order_relaxed);
+                        histogram.buckets[j] += count;
+                        histogram.count += count;
+                    }
+
+                    histogram.total_ns += statistics.latency_total_ns[i].load(std::memory_order_relaxed);
+                    histogram.max_ns = std::max(histogram.max_ns, statistics.latency_max_ns[i].load(std::memory_order_relaxed));
+                }
+            }
+
+            std::mutex m_lock;
+            std::vector<ThreadStatistics*> m_live;
+            StatisticsSnapshot m_retired;
+    };
+
+    StatisticsRegistry& getRegistry()
+    {
+        // Never destroyed, so threads that exit during shutdown can still retire their counters
+        static StatisticsRegistry* registry = new StatisticsRegistry();
+        return *registry;
+    }
+
+    class ThreadStatisticsHandle
+    {
+        public:
+            ThreadStatisticsHandle() : m_statistics(new ThreadStatistics()) { getRegistry().add(m_statistics); }
+            ~ThreadStatisticsHandle()
+            {
+                getRegistry().remove(m_statistics);
+                delete m_statistics;
+            }
+
+            ThreadStatistics& get() { return *m_statistics; }
+        private:
+            ThreadStatistics* m_statistics;
+    };
+
+    ThreadStatistics& getThreadStatistics()
+    {
+        static thread_local ThreadStatisticsHandle handle;
+        return handle.get();
+    }
+
+    void addRelaxed(std::atomic<uint64_t>& value, uint64_t amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::getPercentile(double percentile) const
+    {
+        if (count == 0)
+            return 0;
+
+        uint64_t rank = percentile * (count - 1) + 1;
+        uint64_t seen = 0;
+
+        for (uint32_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min(Statistics::getBucketValue(i), max_ns);
+        }
+
+        return max_ns;
+    }
+
+    void Statistics::count(StatCounter counter, uint64_t amount)
+    {
+        addRelaxed(getThreadStatistics().counters[counter], amount);
+    }
+
+    void Statistics::recordLatency(StatCommand command, uint64_t nanoseconds)
+    {
+        ThreadStatistics& statistics = getThreadStatistics();
+
+        addRelaxed(statistics.latency_buckets[command][getBucket(nanoseconds)], 1);
+        addRelaxed(statistics.latency_total_ns[command], nanoseconds);
+        if (nanoseconds > statistics.latency_max_ns[command].load(std::memory_order_relaxed))
+            statistics.latency_max_ns[command].store(nanoseconds, std::memory_order_relaxed);
+    }
+
+    StatisticsSnapshot Statistics::getSnapshot()
+    {
+        return getRegistry().getSnapshot();
+    }
+
+    void Statistics::print(std::ostream& out)
+    {
+        StatisticsSnapshot snapshot = getSnapshot();
+
+        for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++)
+            out << std::left << std::setw(21) << COUNTER_NAMES[i] << std::right << snapshot.counters[i] << endl;
+
+        out << endl;
+        out << std::left << std::setw(10) << "command" << std::right << std::setw(10) << "count"
+            << std::setw(12) << "mean(us)" << std::setw(12) << "p50(us)" << std::setw(12) << "p90(us)"
+            << std::setw(12) << "p99(us)" << std::setw(12) << "max(us)" << endl;
+
+        std::ios_base::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(1);
+
+        for (uint32_t i = 0; i < STAT_COMMAND_COUNT; i++)
+        {
+            const LatencyHistogram& histogram = snapshot.latencies[i];
+            if (histogram.count == 0)
+                continue;
+
+            out << std::left << std::setw(10) << COMMAND_NAMES[i] << std::right
+                << std::setw(10) << histogram.count
+                << std::setw(12) << histogram.total_ns / 1000.0 / histogram.count
+                << std::setw(12) << histogram.getPercentile(0.50) / 1000.0
+                << std::setw(12) << histogram.getPercentile(0.90) / 1000.0
+                << std::setw(12) << histogram.getPercentile(0.99) / 1000.0
+                << std::setw(12) << histogram.max_ns / 1000.0 << endl;
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    bool Statistics::writePrometheus(std::string file_name)
+    {
+        StatisticsSnapshot snapshot = getSnapshot();
+
+        // Write to a temporary file and rename it so a scraper never reads a partial file
+        std::string temporary_file_name = file_name + ".tmp";
+        std::ofstream out(temporary_file_name.c_str());
+        if (!out)
+            return false;
+
+        for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++)
+        {
+            out << "# TYPE fmod_" << COUNTER_NAMES[i] << "_total counter\n";
+            out << "fmod_" << COUNTER_NAMES[i] << "_total " << snapshot.counters[i] << "\n";
+        }
+
+        out << "# TYPE fmod_command_duration_seconds histogram\n";
+        for (uint32_t i = 0; i < STAT_COMMAND_COUNT; i++)
+        {
+            const LatencyHistogram& histogram = snapshot.latencies[i];
+            if (histogram.count == 0)
+                continue;
+
+            // Prometheus buckets are cumulative, so only buckets that add samples are listed
+            uint64_t cumulative = 0;
+            for (uint32_t j = 0; j < HISTOGRAM_BUCKET_COUNT; j++)
+            {
+                if (histogram.buckets[j] == 0)
+                    continue;
+
+                cumulative += histogram.buckets[j];
+                out << "fmod_command_duration_seconds_bucket{command=\"" << COMMAND_NAMES[i] << "\",le=\""
+                    << (getBucketValue(j + 1) - 1) / 1e9 << "\"} " << cumulative << "\n";
+            }
+
+            out << "fmod_command_duration_seconds_bucket{command=\"" << COMMAND_NAMES[i] << "\",le=\"+Inf\"} " << histogram.count << "\n";
+            out << "fmod_command_duration_seconds_sum{command=\"" << COMMAND_NAMES[i] << "\"} " << histogram.total_ns / 1e9 << "\n";
+            out << "fmod_command_duration_seconds_count{command=\"" << COMMAND_NAMES[i] << "\"} " << histogram.count << "\n";
+        }
+
+        out.close();
+        if (!out)
+            return false;
+
+        return std::rename(temporary_file_name.c_str(), file_name.c_str()) == 0;
+    }
+
+    const char* Statistics::getCounterName(StatCounter counter)
+    {
+        return COUNTER_NAMES[counter];
+    }
+
+    const char* Statistics::getCommandName(StatCommand command)
+    {
+        return COMMAND_NAMES[command];
+    }
+
+    uint32_t Statistics::getBucket(uint64_t value)
+    {
+        if (value < HISTOGRAM_SUB_BUCKET_COUNT)
+            return value;
+
+        uint32_t exponent = 63 - __builtin_clzll(value);
+        uint32_t sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKET_COUNT - 1);
+        return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKET_COUNT + sub_bucket;
+    }
+
+    uint64_t Statistics::getBucketValue(uint32_t bucket)
+    {
+        if (bucket < HISTOGRAM_SUB_BUCKET_COUNT)
+            return bucket;
+        if (bucket >= HISTOGRAM_BUCKET_COUNT)
+            return UINT64_MAX;
+
+        uint32_t exponent = bucket / HISTOGRAM_SUB_BUCKET_COUNT + HISTOGRAM_SUB_BUCKET_BITS - 1;
+        uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKET_COUNT;
+        return (HISTOGRAM_SUB_BUCKET_COUNT + sub_bucket) << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+    }
+}
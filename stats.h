@@ -0,0 +1,116 @@
+#ifndef STATS_H
+#define STATS_H
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include "trace.h"
+
+namespace FAT_FS
+{
+    enum StatCounter
+    {
+        STAT_FAT_READS,
+        STAT_FAT_WRITES,
+        STAT_DIR_ENTRIES_DECODED,
+        STAT_CLUSTERS_ALLOCATED,
+        STAT_CLUSTERS_FREED,
+        STAT_BYTES_READ,
+        STAT_BYTES_WRITTEN,
+        STAT_BYTES_FLUSHED,
+        STAT_JOURNAL_COMMITS,
+        STAT_JOURNAL_TRANSACTIONS,
+        STAT_COUNTER_COUNT
+    };
+
+    enum StatCommand
+    {
+        STAT_FSINFO,
+        STAT_OPEN,
+        STAT_CLOSE,
+        STAT_CREATE,
+        STAT_READ,
+        STAT_WRITE,
+        STAT_RM,
+        STAT_CD,
+        STAT_LS,
+        STAT_MKDIR,
+        STAT_RMDIR,
+        STAT_SIZE,
+        STAT_UNDELETE,
+        STAT_SYNC,
+        STAT_FATCHECK,
+        STAT_FSCK,
+        STAT_DU,
+        STAT_FIND,
+        STAT_DEFRAG,
+        STAT_FRAGINFO,
+        STAT_COMMAND_COUNT
+    };
+
+    // Log-linear buckets: 16 linear sub-buckets per power of two keep every bucket within 6.25% of its value
+    const uint32_t HISTOGRAM_SUB_BUCKET_BITS = 4;
+    const uint32_t HISTOGRAM_SUB_BUCKET_COUNT = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    const uint32_t HISTOGRAM_BUCKET_COUNT = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKET_COUNT;
+
+    struct LatencyHistogram
+    {
+        LatencyHistogram() : buckets(HISTOGRAM_BUCKET_COUNT, 0), count(0), total_ns(0), max_ns(0) {}
+
+        uint64_t getPercentile(double percentile) const;
+
+        std::vector<uint64_t> buckets;
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+    };
+
+    struct StatisticsSnapshot
+    {
+        StatisticsSnapshot() : counters(STAT_COUNTER_COUNT, 0), latencies(STAT_COMMAND_COUNT) {}
+
+        std::vector<uint64_t> counters;
+        std::vector<LatencyHistogram> latencies;
+    };
+
+    // Process-wide statistics. Each thread updates its own counters without
+    // locking; a snapshot sums the counters of every thread.
+    class Statistics
+    {
+        public:
+            static void count(StatCounter counter, uint64_t amount = 1);
+            static void recordLatency(StatCommand command, uint64_t nanoseconds);
+
+            static StatisticsSnapshot getSnapshot();
+            static void print(std::ostream& out);
+            static bool writePrometheus(std::string file_name);
+
+            static const char* getCounterName(StatCounter counter);
+            static const char* getCommandName(StatCommand command);
+            static uint32_t getBucket(uint64_t value);
+            static uint64_t getBucketValue(uint32_t bucket);
+    };
+
+    // Records the latency of one command from construction to destruction, and traces it as a span
+    class CommandTimer
+    {
+        public:
+            CommandTimer(StatCommand command) : m_command(command), m_start(std::chrono::steady_clock::now()),
+                                                m_span(Statistics::getCommandName(command)) {}
+            ~CommandTimer()
+            {
+                std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - m_start;
+                Statistics::recordLatency(m_command, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            }
+        private:
+            CommandTimer(const CommandTimer&);
+            CommandTimer& operator=(const CommandTimer&);
+
+            StatCommand m_command;
+            std::chrono::steady_clock::time_point m_start;
+            TraceSpan m_span;
+    };
+}
+
+#endif
@@ -0,0 +1,310 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <cstdlib>
+#include <unistd.h>
+#include "filesystem.h"
+#include "fatimage.h"
+#include "toolsupport.h"
+
+using namespace std;
+
+#define USAGE "Usage: stress [--threads <n>] [--iterations <n>] [--files-per-thread <n>] [--max-file-size <bytes>]\n" \
+              "              [--volume-mb <n>] [--cluster-size <bytes>] [--seed <n>] [--image <path>]\n" \
+              "              [--backend mmap|cached|uring] [--cache-mb <n>] [--journal <path>] [--deferred-fat-sync]"
+
+struct StressOptions
+{
+    StressOptions() : threads(8), iterations(1000), files_per_thread(16), max_file_size(32 << 10), image_path("stress.img")
+    {
+        image.directory_count = 8;
+        image.files_per_directory = 8;
+        image.large_directory_entries = 256;
+        image.large_file_size = 1 << 20;
+    }
+
+    FAT_FS::ImageOptions image;
+    FAT_FS::MountOptions mount;
+    uint32_t threads;
+    uint32_t iterations;
+    uint32_t files_per_thread;
+    uint32_t max_file_size;
+    std::string image_path;
+};
+
+// The files a client expects to find in its own directory, and what they hold
+typedef std::map<std::string, std::string> FileModel;
+
+const StressOptions* g_options = NULL;
+FAT_FS::NullBuffer g_null_buffer;
+std::atomic<uint64_t> g_operations(0);
+std::atomic<uint64_t> g_failures(0);
+std::mutex g_failure_lock;
+std::vector<std::string> g_failure_messages;
+
+// Only this many failures are printed, the rest are only counted
+const size_t MAX_REPORTED_FAILURES = 20;
+
+bool parseOptions(int argc, char **argv, StressOptions& options);
+bool expect(bool succeeded, std::string operation);
+void runClient(FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, uint32_t client, FileModel& model);
+bool writeFile(FAT_FS::FileSystem& fs, const std::string& path, uint32_t offset, const std::string& data);
+bool verifyImage(FAT_FS::FileSystem& fs, const std::vector<FileModel>& models, std::string stage);
+
+int main(int argc, char **argv)
+{
+    StressOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        cout << USAGE << endl;
+        return EXIT_FAILURE;
+    }
+    g_options = &options;
+
+    FAT_FS::ImageLayout layout;
+    if (!FAT_FS::generateImage(options.image_path, options.image, layout))
+    {
+        cout << "Error: cannot generate image." << endl;
+        return EXIT_FAILURE;
+    }
+
+    // A journal left by an earlier image must not be replayed into this one
+    if (!options.mount.journal_file.empty())
+        unlink(options.mount.journal_file.c_str());
+
+    std::vector<FileModel> models(options.threads);
+    bool success = true;
+    double elapsed_seconds = 0;
+
+    {
+        FAT_FS::FileSystem fs(options.image_path, options.mount);
+        if (fs.hasError())
+        {
+            cout << "Error: cannot mount image." << endl;
+            return EXIT_FAILURE;
+        }
+
+        std::streambuf* console_buffer = cout.rdbuf(&g_null_buffer);
+        expect(fs.mkdir("/shared"), "mkdir /shared");
+
+        // Every client works under its own directory but shares /shared, the root and the generated tree
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < options.threads; t++)
+            threads.push_back(std::thread(runClient, std::ref(fs), std::cref(layout), t, std::ref(models[t])));
+
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+        elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout.rdbuf(console_buffer);
+
+        success &= verifyImage(fs, models, "after the run");
+    }
+
+    // What reached the disk, including anything the journal replays, must check out the same way
+    {
+        FAT_FS::FileSystem fs(options.image_path, options.mount);
+        if (fs.hasError())
+        {
+            cout << "Error: cannot mount image again." << endl;
+            success = false;
+        }
+        else
+            success &= verifyImage(fs, models, "after a remount");
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_failure_lock);
+        for (size_t i = 0; i < g_failure_messages.size(); i++)
+            cout << "Error: " << g_failure_messages[i] << endl;
+        if (g_failures > g_failure_messages.size())
+            cout << "Error: " << (g_failures - g_failure_messages.size()) << " more operations failed." << endl;
+    }
+    success &= (g_failures == 0);
+
+    cout << g_operations << " operations by " << options.threads << " threads in " << elapsed_seconds << " s: "
+         << (success ? "passed" : "FAILED") << "." << endl;
+
+    unlink(options.image_path.c_str());
+    if (!options.mount.journal_file.empty())
+        unlink(options.mount.journal_file.c_str());
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool parseOptions(int argc, char **argv, StressOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option(argv[i]);
+        if (option == "--deferred-fat-sync")
+        {
+            options.mount.deferred_FAT_sync = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+
+        std::string value(argv[++i]);
+        try
+        {
+            if (option == "--threads")
+                options.threads = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--iterations")
+                options.iterations = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--files-per-thread")
+                options.files_per_thread = std::max<uint32_t>(1, std::stoul(value));
+            else if (option == "--max-file-size")
+                options.max_file_size = std::max<uint32_t>(1, std::stoul(value));
+            else if (!FAT_FS::parseImageOption(option, value, options.image, options.mount, options.image_path))
+                return false;
+        }
+        catch (const std::logic_error&)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Counts an operation, and records it as a failure unless it succeeded
+bool expect(bool succeeded, std::string operation)
+{
+    g_operations++;
+    if (!succeeded && g_failures++ < MAX_REPORTED_FAILURES)
+    {
+        std::lock_guard<std::mutex> lock(g_failure_lock);
+        g_failure_messages.push_back(operation + " failed.");
+    }
+
+    return succeeded;
+}
+
+// One client: creates, appends to and removes files in its own directory, makes and removes
+// subdirectories, and creates, lists and looks up entries in directories every client shares.
+// Nothing here should fail, since no other client touches the same names.
+void runClient(FAT_FS::FileSystem& fs, const FAT_FS::ImageLayout& layout, uint32_t client, FileModel& model)
+{
+    std::mt19937 random(g_options->image.seed + client);
+    std::uniform_int_distribution<uint32_t> pick_file(0, g_options->files_per_thread - 1);
+    std::uniform_int_distribution<uint32_t> pick_length(1, std::max<uint32_t>(1, g_options->max_file_size / 4));
+    std::string directory = "/s" + std::to_string(client);
+
+    if (!expect(fs.mkdir(directory), "mkdir " + directory))
+        return;
+
+    for (uint32_t i = 0; i < g_options->iterations; i++)
+    {
+        std::string path = directory + "/f" + std::to_string(pick_file(random));
+        std::string data(pick_length(random), 'a' + (client + i) % 26);
+        FileModel::iterator file = model.find(path);
+
+        if (file == model.end())
+        {
+            if (expect(fs.create(path), "create " + path) && writeFile(fs, path, 0, data))
+                model[path] = data;
+        }
+        else if (i % 4 == 0 || file->second.size() + data.size() > g_options->max_file_size)
+        {
+            if (expect(fs.rm(path), "rm " + path))
+                model.erase(file);
+        }
+        else if (writeFile(fs, path, file->second.size(), data))
+            file->second += data;
+
+        if (i % 8 == 0)
+        {
+            std::string subdirectory = directory + "/m" + std::to_string(i);
+            expect(fs.mkdir(subdirectory), "mkdir " + subdirectory);
+            expect(fs.create(subdirectory + "/x"), "create " + subdirectory + "/x");
+            expect(fs.ls(subdirectory), "ls " + subdirectory);
+            expect(fs.rm(subdirectory + "/x"), "rm " + subdirectory + "/x");
+            expect(fs.rmdir(subdirectory), "rmdir " + subdirectory);
+        }
+
+        if (i % 4 == 1)
+        {
+            std::string shared_path = "/shared/t" + std::to_string(client) + "_" + std::to_string(i);
+            expect(fs.create(shared_path), "create " + shared_path);
+            expect(fs.rm(shared_path), "rm " + shared_path);
+        }
+        else if (i % 4 == 2)
+        {
+            expect(fs.ls("/shared"), "ls /shared");
+            expect(fs.ls("/"), "ls /");
+            expect(fs.ls(directory), "ls " + directory);
+            if (!layout.files.empty())
+            {
+                const std::string& generated_path = layout.files[(client + i) % layout.files.size()];
+                expect(fs.size(generated_path), "size " + generated_path);
+            }
+        }
+    }
+}
+
+// Writes data at offset and reads the whole file back, through one open of the file
+bool writeFile(FAT_FS::FileSystem& fs, const std::string& path, uint32_t offset, const std::string& data)
+{
+    if (!expect(fs.open(path, FAT_FS::READ_WRITE), "open " + path))
+        return false;
+
+    bool written = expect(fs.write(path, offset, data), "write " + path);
+    expect(fs.read(path, 0, offset + data.size()), "read " + path);
+    expect(fs.close(path), "close " + path);
+    return written;
+}
+
+// Checks the image with fsck and fatcheck, and that every client's files hold what was written
+bool verifyImage(FAT_FS::FileSystem& fs, const std::vector<FileModel>& models, std::string stage)
+{
+    bool success = true;
+    std::streambuf* console_buffer = cout.rdbuf();
+
+    // Deferred frees and FAT mirrors are settled by a checkpoint
+    cout.rdbuf(&g_null_buffer);
+    fs.sync();
+
+    std::ostringstream report;
+    cout.rdbuf(report.rdbuf());
+    bool clean = fs.fsck(false);
+    bool consistent = fs.fatcheck();
+    cout.rdbuf(console_buffer);
+
+    if (!clean || !consistent)
+    {
+        cout << "Error: the image does not check out " << stage << ":" << endl << report.str();
+        success = false;
+    }
+
+    for (size_t t = 0; t < models.size(); t++)
+    {
+        for (FileModel::const_iterator file = models[t].begin(); file != models[t].end(); file++)
+        {
+            std::ostringstream contents;
+            cout.rdbuf(&g_null_buffer);
+            bool opened = fs.open(file->first, FAT_FS::READ);
+            cout.rdbuf(contents.rdbuf());
+            bool read = opened && fs.read(file->first, 0, file->second.size() + 1);
+            cout.rdbuf(&g_null_buffer);
+            if (opened)
+                fs.close(file->first);
+            cout.rdbuf(console_buffer);
+
+            if (!read || contents.str() != file->second + "\n")
+            {
+                cout << "Error: '" << file->first << "' does not hold what was written " << stage << "." << endl;
+                success = false;
+            }
+        }
+    }
+
+    return success;
+}
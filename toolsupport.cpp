@@ -0,0 +1,44 @@
+#include <algorithm>
+#include <stdexcept>
+#include "toolsupport.h"
+
+namespace FAT_FS
+{
+    bool parseImageOption(const std::string& option, const std::string& value,
+                          ImageOptions& image, MountOptions& mount, std::string& image_path)
+    {
+        if (option == "--volume-mb")
+            image.volume_size = std::stoull(value) << 20;
+        else if (option == "--cluster-size")
+        {
+            uint32_t cluster_size = std::stoul(value);
+            if (cluster_size < image.bytes_per_sector || cluster_size % image.bytes_per_sector != 0 ||
+                cluster_size / image.bytes_per_sector > 128)
+                throw std::invalid_argument("cluster size");
+            image.sectors_per_cluster = cluster_size / image.bytes_per_sector;
+        }
+        else if (option == "--seed")
+            image.seed = std::stoul(value);
+        else if (option == "--image")
+            image_path = value;
+        else if (option == "--backend")
+        {
+            if (value == "mmap")
+                mount.backend = BLOCK_DEVICE_MMAP;
+            else if (value == "cached")
+                mount.backend = BLOCK_DEVICE_CACHED;
+            else if (value == "uring")
+                mount.backend = BLOCK_DEVICE_URING;
+            else
+                throw std::invalid_argument("backend");
+        }
+        else if (option == "--cache-mb")
+            mount.cache_MB = std::max<uint32_t>(1, std::stoul(value));
+        else if (option == "--journal")
+            mount.journal_file = value;
+        else
+            return false;
+
+        return true;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef TOOLSUPPORT_H
+#define TOOLSUPPORT_H
+#include <streambuf>
+#include <string>
+#include "filesystem.h"
+#include "fatimage.h"
+
+namespace FAT_FS
+{
+    // Discards everything written to it, so bench and stress can silence what FileSystem prints
+    class NullBuffer : public std::streambuf
+    {
+        protected:
+            virtual int_type overflow(int_type c) { return traits_type::not_eof(c); }
+            virtual std::streamsize xsputn(const char*, std::streamsize count) { return count; }
+    };
+
+    // Applies one of the options bench and stress share: --volume-mb, --cluster-size, --seed,
+    // --image, --backend, --cache-mb and --journal. Returns false for any other option, and
+    // throws std::invalid_argument or std::out_of_range when the value is not valid.
+    bool parseImageOption(const std::string& option, const std::string& value,
+                          ImageOptions& image, MountOptions& mount, std::string& image_path);
+}
+
+#endif
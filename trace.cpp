@@ -0,0 +1,140 @@
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include "trace.h"
+
+using namespace std;
+
+namespace FAT_FS
+{
+    // One event in the ring. The sequence is odd while the slot is being
+    // written and 2 * index + 2 once event number index is complete, so a
+    // reader can tell finished events from torn or overwritten ones.
+    struct TraceSlot
+    {
+        std::atomic<uint64_t> sequence;
+        std::atomic<const char*> name;
+        std::atomic<uint64_t> start_ns;
+        std::atomic<uint64_t> end_ns;
+        std::atomic<uint32_t> thread_id;
+    };
+
+    std::atomic<bool> Tracer::s_running(false);
+
+    std::atomic<uint64_t> g_trace_head(0);
+    std::atomic<uint32_t> g_trace_thread_count(0);
+    TraceSlot* g_trace_ring = NULL;
+
+    std::mutex g_trace_control_lock;
+    std::string g_trace_file_name;
+    uint64_t g_trace_start_ns = 0;
+
+    uint32_t getTraceThreadId()
+    {
+        static thread_local uint32_t thread_id = ++g_trace_thread_count;
+        return thread_id;
+    }
+
+    bool Tracer::start(std::string file_name)
+    {
+        std::lock_guard<std::mutex> lock(g_trace_control_lock);
+        if (s_running.load(std::memory_order_relaxed))
+            return false;
+
+        // Make sure the trace can be written before recording anything
+        std::ofstream out(file_name.c_str());
+        if (!out)
+            return false;
+
+        // The ring is never freed, so a span finishing late never writes to released memory
+        if (g_trace_ring == NULL)
+        {
+            g_trace_ring = new TraceSlot[TRACE_RING_CAPACITY];
+            for (uint32_t i = 0; i < TRACE_RING_CAPACITY; i++)
+                g_trace_ring[i].sequence.store(0, std::memory_order_relaxed);
+        }
+
+        g_trace_file_name = file_name;
+        g_trace_start_ns = getTimestamp();
+        g_trace_head.store(0, std::memory_order_relaxed);
+        s_running.store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool Tracer::stop(uint64_t& event_count, uint64_t& dropped_count)
+    {
+        std::lock_guard<std::mutex> lock(g_trace_control_lock);
+        if (!s_running.load(std::memory_order_relaxed))
+            return false;
+
+        s_running.store(false, std::memory_order_release);
+
+        uint64_t head = g_trace_head.load(std::memory_order_acquire);
+        uint64_t first = (head > TRACE_RING_CAPACITY) ? head - TRACE_RING_CAPACITY : 0;
+        event_count = 0;
+        dropped_count = first;
+
+        std::ofstream out(g_trace_file_name.c_str());
+        if (!out)
+            return false;
+
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        out << std::fixed << std::setprecision(3);
+
+        for (uint64_t i = first; i < head; i++)
+        {
+            TraceSlot& slot = g_trace_ring[i % TRACE_RING_CAPACITY];
+
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const char* name = slot.name.load(std::memory_order_relaxed);
+            uint64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            uint64_t end_ns = slot.end_ns.load(std::memory_order_relaxed);
+            uint32_t thread_id = slot.thread_id.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // Skip events still being written or already overwritten by a newer one
+            if (sequence != 2 * i + 2 || slot.sequence.load(std::memory_order_relaxed) != sequence)
+            {
+                dropped_count++;
+                continue;
+            }
+
+            uint64_t relative_start_ns = (start_ns > g_trace_start_ns) ? start_ns - g_trace_start_ns : 0;
+            uint64_t duration_ns = (end_ns > start_ns) ? end_ns - start_ns : 0;
+
+            out << (event_count++ == 0 ? "\n" : ",\n")
+                << "{\"name\":\"" << name << "\",\"cat\":\"fmod\",\"ph\":\"X\""
+                << ",\"ts\":" << relative_start_ns / 1000.0
+                << ",\"dur\":" << duration_ns / 1000.0
+                << ",\"pid\":" << getpid() << ",\"tid\":" << thread_id << "}";
+        }
+
+        out << "\n]}\n";
+        out.close();
+        return static_cast<bool>(out);
+    }
+
+    uint64_t Tracer::getTimestamp()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Tracer::record(const char* name, uint64_t start_ns, uint64_t end_ns)
+    {
+        // Claim a slot without locking, overwriting the oldest event when the ring is full
+        uint64_t index = g_trace_head.fetch_add(1, std::memory_order_relaxed);
+        TraceSlot& slot = g_trace_ring[index % TRACE_RING_CAPACITY];
+
+        slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.start_ns.store(start_ns, std::memory_order_relaxed);
+        slot.end_ns.store(end_ns, std::memory_order_relaxed);
+        slot.thread_id.store(getTraceThreadId(), std::memory_order_relaxed);
+
+        slot.sequence.store(2 * index + 2, std::memory_order_release);
+    }
+}
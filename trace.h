@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <string>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+namespace FAT_FS
+{
+    // Events kept by the trace ring, older events are overwritten once it is full
+    const uint32_t TRACE_RING_CAPACITY = 1 << 17;
+
+    // Process-wide recorder of Chrome trace-event spans
+    class Tracer
+    {
+        public:
+            static bool start(std::string file_name);
+            static bool stop(uint64_t& event_count, uint64_t& dropped_count);
+            static bool isRunning() { return s_running.load(std::memory_order_relaxed); }
+
+            static uint64_t getTimestamp();
+            static void record(const char* name, uint64_t start_ns, uint64_t end_ns);
+        private:
+            static std::atomic<bool> s_running;
+    };
+
+    // Records the time from construction to destruction as a span while tracing is running
+    class TraceSpan
+    {
+        public:
+            TraceSpan(const char* name) : m_name(name), m_start(Tracer::isRunning() ? Tracer::getTimestamp() : 0) {}
+            ~TraceSpan()
+            {
+                if (m_start != 0 && Tracer::isRunning())
+                    Tracer::record(m_name, m_start, Tracer::getTimestamp());
+            }
+        private:
+            TraceSpan(const TraceSpan&);
+            TraceSpan& operator=(const TraceSpan&);
+
+            const char* m_name;
+            uint64_t m_start;
+    };
+}
+
+#endif
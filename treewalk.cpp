@@ -0,0 +1,221 @@
+#include "filesystem.h"
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <mutex>
+#include <fnmatch.h>
+
+using namespace FAT_FS;
+
+namespace FAT_FS
+{
+    std::string joinTreePath(const std::string& path, const std::string& name)
+    {
+        return (path == ROOT) ? path + name : path + ROOT + name;
+    }
+}
+
+// *********************************************************
+// *********************************************************
+// *                      TREE WALK                        *
+// *********************************************************
+// *********************************************************
+
+bool FileSystem::du(std::string dir_name, bool summary_only)
+{
+    CommandTimer timer(STAT_DU);
+    DirectoryEntry directory;
+    if (!resolvePath(dir_name, directory))
+    {
+        cout << "Error: '" << dir_name << "' not found." << endl;
+        return false;
+    }
+    else if (!isDirectory(directory))
+    {
+        cout << "Error: '" << dir_name << "' is not a directory." << endl;
+        return false;
+    }
+
+    // Each directory is printed once everything below it is counted, so subdirectories come first
+    std::mutex output_lock;
+    uint64_t total_size = 0;
+    uint64_t file_count = 0;
+    uint64_t directory_count = 0;
+    TreeWalkVisitor visitor;
+    visitor.finish_directory = [&](const TreeWalkNode& node) {
+        std::lock_guard<std::mutex> lock(output_lock);
+        if (!node.parent)
+        {
+            total_size = node.total_size;
+            file_count = node.file_count;
+            directory_count = node.directory_count;
+        }
+        else if (summary_only)
+            return;
+
+        cout << node.total_usage << "\t" << node.path << endl;
+    };
+
+    walkTree(directory, normalizePath(dir_name), visitor);
+
+    cout << file_count << " files and " << directory_count << " directories holding " << total_size << " bytes." << endl;
+    return true;
+}
+
+bool FileSystem::find(std::string dir_name, const FindFilter& filter)
+{
+    CommandTimer timer(STAT_FIND);
+    DirectoryEntry directory;
+    if (!resolvePath(dir_name, directory))
+    {
+        cout << "Error: '" << dir_name << "' not found." << endl;
+        return false;
+    }
+    else if (!isDirectory(directory))
+    {
+        cout << "Error: '" << dir_name << "' is not a directory." << endl;
+        return false;
+    }
+
+    // Matches are written out a directory at a time while the rest of the tree is still being walked
+    std::mutex output_lock;
+    TreeWalkVisitor visitor;
+    visitor.visit_directory = [&](const TreeWalkNode& node, const std::list<DirectoryEntry>& entries) {
+        std::string matches;
+
+        std::list<DirectoryEntry>::const_iterator iterator;
+        for (iterator = entries.begin(); iterator != entries.end(); iterator++)
+        {
+            if ((iterator->attribute & filter.required_attributes) != filter.required_attributes ||
+                (iterator->attribute & filter.excluded_attributes) != 0)
+                continue;
+            if (iterator->size < filter.min_size || iterator->size > filter.max_size)
+                continue;
+            if (!filter.name_pattern.empty() && fnmatch(filter.name_pattern.c_str(), iterator->name.c_str(), 0) != 0)
+                continue;
+
+            matches += joinTreePath(node.path, iterator->name) + "\n";
+        }
+
+        if (!matches.empty())
+        {
+            std::lock_guard<std::mutex> lock(output_lock);
+            cout << matches;
+        }
+    };
+
+    walkTree(directory, normalizePath(dir_name), visitor);
+    return true;
+}
+
+// *********************************************************
+// *********************************************************
+// *                  TREE WALK HELPERS                    *
+// *********************************************************
+// *********************************************************
+
+void FileSystem::walkTree(const DirectoryEntry& directory, std::string path, const TreeWalkVisitor& visitor)
+{
+    TraceSpan span("tree_walk");
+    WorkStealingPool<std::shared_ptr<TreeWalkNode> > pool;
+
+    std::shared_ptr<TreeWalkNode> root = std::make_shared<TreeWalkNode>();
+    root->path = path;
+    root->cluster = directory.cluster;
+    root->pending = 1;
+    pool.push(0, root);
+
+    pool.run([&](uint32_t worker_index, std::shared_ptr<TreeWalkNode>& node) {
+        walkTreeDirectory(pool, worker_index, node, visitor);
+    });
+}
+
+void FileSystem::walkTreeDirectory(WorkStealingPool<std::shared_ptr<TreeWalkNode> >& pool, uint32_t worker_index,
+                                   const std::shared_ptr<TreeWalkNode>& node, const TreeWalkVisitor& visitor)
+{
+    std::list<DirectoryEntry> entries;
+    uint32_t chain_length = 0;
+    {
+        ReadLock lock(getDirectoryLock(node->cluster));
+
+        // A directory removed after its parent was read has nothing left to walk
+        if (isLiveDirectory(node->cluster))
+        {
+            entries = getDirectoryEntries(node->cluster);
+            chain_length = getChainLength(getClusterExtents(node->cluster));
+        }
+    }
+
+    uint64_t total_size = 0;
+    uint64_t total_usage = (uint64_t)chain_length * m_bytes_per_cluster;
+    uint64_t file_count = 0;
+    uint64_t directory_count = 0;
+
+    std::list<DirectoryEntry>::iterator iterator = entries.begin();
+    while (iterator != entries.end())
+    {
+        if (iterator->name == "." || iterator->name == ".." || (iterator->attribute & ATTR_VOLUME_ID))
+        {
+            iterator = entries.erase(iterator);
+            continue;
+        }
+
+        if (isDirectory(*iterator))
+        {
+            // Count the subdirectory against this one before another thread can finish it
+            std::shared_ptr<TreeWalkNode> child = std::make_shared<TreeWalkNode>();
+            child->parent = node;
+            child->path = joinTreePath(node->path, iterator->name);
+            child->cluster = iterator->cluster;
+            child->pending = 1;
+
+            node->pending.fetch_add(1, std::memory_order_relaxed);
+            pool.push(worker_index, child);
+            directory_count++;
+        }
+        else
+        {
+            // Usage is rounded up to whole clusters, and a file keeps one cluster from create even when empty
+            uint64_t clusters = (iterator->size + m_bytes_per_cluster - 1) / m_bytes_per_cluster;
+            if (iterator->cluster != 0 && clusters == 0)
+                clusters = 1;
+
+            total_size += iterator->size;
+            total_usage += clusters * m_bytes_per_cluster;
+            file_count++;
+        }
+
+        iterator++;
+    }
+
+    node->total_size.fetch_add(total_size, std::memory_order_relaxed);
+    node->total_usage.fetch_add(total_usage, std::memory_order_relaxed);
+    node->file_count.fetch_add(file_count, std::memory_order_relaxed);
+    node->directory_count.fetch_add(directory_count, std::memory_order_relaxed);
+
+    if (visitor.visit_directory)
+        visitor.visit_directory(*node, entries);
+
+    finishTreeWalkNode(node, visitor);
+}
+
+void FileSystem::finishTreeWalkNode(std::shared_ptr<TreeWalkNode> node, const TreeWalkVisitor& visitor)
+{
+    // The last of a directory's own scan and its subdirectories to finish adds its totals to the parent
+    while (node && node->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        if (visitor.finish_directory)
+            visitor.finish_directory(*node);
+
+        std::shared_ptr<TreeWalkNode> parent = node->parent;
+        if (parent)
+        {
+            parent->total_size.fetch_add(node->total_size, std::memory_order_relaxed);
+            parent->total_usage.fetch_add(node->total_usage, std::memory_order_relaxed);
+            parent->file_count.fetch_add(node->file_count, std::memory_order_relaxed);
+            parent->directory_count.fetch_add(node->directory_count, std::memory_order_relaxed);
+        }
+
+        node = parent;
+    }
+}
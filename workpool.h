@@ -0,0 +1,110 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+namespace FAT_FS
+{
+    // Runs tasks on one thread per core until no task is left. Each thread
+    // takes the newest task it pushed itself, so a tree is walked depth
+    // first, and steals the oldest task of another thread when it runs dry.
+    template<typename Task>
+    class WorkStealingPool
+    {
+        public:
+            typedef std::function<void(uint32_t worker_index, Task& task)> Handler;
+
+            WorkStealingPool() : m_thread_count(std::max<uint32_t>(1, std::thread::hardware_concurrency())),
+                                 m_workers(new Worker[m_thread_count]), m_pending_tasks(0) {}
+
+            uint32_t getThreadCount() const { return m_thread_count; }
+
+            // Queue a task on a worker, either before run or from a handler running on that worker
+            void push(uint32_t worker_index, const Task& task)
+            {
+                m_pending_tasks.fetch_add(1, std::memory_order_acq_rel);
+
+                std::lock_guard<std::mutex> lock(m_workers[worker_index].lock);
+                m_workers[worker_index].tasks.push_back(task);
+            }
+
+            // Run every queued task and every task they push, with the calling thread as worker 0
+            void run(const Handler& handler)
+            {
+                std::vector<std::thread> threads;
+                for (uint32_t i = 1; i < m_thread_count; i++)
+                    threads.push_back(std::thread(&WorkStealingPool::runWorker, this, i, std::cref(handler)));
+
+                runWorker(0, handler);
+
+                for (size_t i = 0; i < threads.size(); i++)
+                    threads[i].join();
+            }
+        private:
+            WorkStealingPool(const WorkStealingPool&);
+            WorkStealingPool& operator=(const WorkStealingPool&);
+
+            struct Worker
+            {
+                std::mutex lock;
+                std::deque<Task> tasks;
+            };
+
+            bool take(uint32_t worker_index, Task& task)
+            {
+                for (uint32_t i = 0; i < m_thread_count; i++)
+                {
+                    Worker& victim = m_workers[(worker_index + i) % m_thread_count];
+                    std::lock_guard<std::mutex> lock(victim.lock);
+                    if (victim.tasks.empty())
+                        continue;
+
+                    if (i == 0)
+                    {
+                        task = victim.tasks.back();
+                        victim.tasks.pop_back();
+                    }
+                    else
+                    {
+                        task = victim.tasks.front();
+                        victim.tasks.pop_front();
+                    }
+                    return true;
+                }
+
+                return false;
+            }
+
+            void runWorker(uint32_t worker_index, const Handler& handler)
+            {
+                for (;;)
+                {
+                    Task task;
+                    if (take(worker_index, task))
+                    {
+                        handler(worker_index, task);
+
+                        // Tasks the handler pushed are counted before this one is released
+                        m_pending_tasks.fetch_sub(1, std::memory_order_acq_rel);
+                    }
+                    else if (m_pending_tasks.load(std::memory_order_acquire) == 0)
+                        break;
+                    else
+                        std::this_thread::yield();
+                }
+            }
+
+            uint32_t m_thread_count;
+            std::unique_ptr<Worker[]> m_workers;
+            std::atomic<uint64_t> m_pending_tasks;
+    };
+}
+
+#endif